@@ -0,0 +1,156 @@
+#ifndef BATCHQUEUE_HPP
+#define BATCHQUEUE_HPP
+
+#include <mutex>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <memory>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <condition_variable>
+
+#include <zmq.hpp>
+
+#include "zmqpool.hpp"
+#include "evaluator.hpp"
+#include "wireformat.hpp"
+
+//! Collects DNN evaluations of many threads and sends them as one batched request
+/*!
+ * \details Search threads call evaluate, which parks the calling thread until its own result arrives.
+ *          The thread which fills the batch sends the request.
+ *          If the batch is not filled in time, the first thread whose timeout expires sends the partial batch.
+ *          A queue can be shared between the search threads of several concurrent games.
+ *          It must be owned outside of the problem, because problem states are copied for each policy iteration.
+ *          Batches are evaluated by a backend, e.g. DNNEvaluatorZMQ where request holds B states, reply B results.
+ * \author adamp87
+*/
+class DNNBatchQueue : public DNNEvaluator {
+    //! One pending evaluation, lives on the stack of the waiting thread
+    struct Request {
+        const std::vector<float>* state; //!< input of dnn
+        std::vector<float>* result; //!< output of dnn, set by sender thread
+        bool queued; //!< not yet taken by a sender thread
+        bool done; //!< result is ready
+        std::exception_ptr error; //!< error of sender thread, rethrown at waiting thread
+    };
+
+    std::unique_ptr<DNNEvaluator> owned; //!< backend created by the queue
+    DNNEvaluator& backend; //!< evaluates the batches
+    size_t batchSize; //!< number of states to collect before sending
+    std::chrono::microseconds timeout; //!< max wait time for batch to be filled
+
+    std::mutex lock; //!< guards pending and state of requests
+    std::condition_variable ready; //!< notified when a batch got its results
+    std::vector<Request*> pending; //!< requests not yet sent
+
+    DNNBatchQueue(const DNNBatchQueue&) = delete;
+
+    //! Send pending requests as one batch, lock is released during communication
+    void flush(std::unique_lock<std::mutex>& guard) {
+        std::vector<Request*> batch;
+        batch.swap(pending);
+        for (size_t i = 0; i < batch.size(); ++i)
+            batch[i]->queued = false;
+        guard.unlock();
+
+        std::exception_ptr error;
+        std::vector<float> result;
+        try {
+            send(batch, result);
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        guard.lock();
+        size_t resultSize = result.size() / batch.size();
+        for (size_t i = 0; i < batch.size(); ++i) {
+            Request& req = *batch[i];
+            if (error) {
+                req.error = error;
+            } else {
+                req.result->assign(result.begin() + i*resultSize, result.begin() + (i+1)*resultSize);
+            }
+            req.done = true;
+        }
+        ready.notify_all();
+    }
+
+    //! Evaluate batch by the backend and return concatenated results
+    void send(const std::vector<Request*>& batch, std::vector<float>& result) {
+        std::vector<const std::vector<float>*> states(batch.size());
+        for (size_t i = 0; i < batch.size(); ++i)
+            states[i] = batch[i]->state;
+
+        backend.evaluate(states, result);
+        if (result.size() == 0 || result.size() % batch.size() != 0)
+            throw std::runtime_error("Bad Reply");
+    }
+
+public:
+    //! Create queue for one dnn server
+    /*!
+    * \param sockets Pool of connected sockets
+    * \param port Port of the dnn server
+    * \param batchSize Number of states to collect before sending
+    * \param timeout Max wait time in microseconds for the batch to be filled
+    * \param wire Encoding of requests and replies
+    */
+    DNNBatchQueue(ZMQSocketPool& sockets, const std::string& port, size_t batchSize, unsigned int timeout,
+                  const DNNWireFormat& wire = DNNWireFormat())
+        : owned(new DNNEvaluatorZMQ(sockets, port, wire)), backend(*owned),
+          batchSize(std::max<size_t>(batchSize, 1)), timeout(timeout)
+    {}
+
+    //! Create queue of an evaluator, e.g. an in-process dnn profits from batches as the server does
+    /*!
+    * \param backend Evaluates the batches, not owned
+    * \param batchSize Number of states to collect before sending
+    * \param timeout Max wait time in microseconds for the batch to be filled
+    */
+    DNNBatchQueue(DNNEvaluator& backend, size_t batchSize, unsigned int timeout)
+        : backend(backend), batchSize(std::max<size_t>(batchSize, 1)), timeout(timeout)
+    {}
+
+    //! Interface of DNNEvaluator, each state waits in the queue
+    void evaluate(const std::vector<const std::vector<float>*>& states, std::vector<float>& result) override {
+        result.clear();
+        std::vector<float> row;
+        for (size_t i = 0; i < states.size(); ++i) {
+            evaluate(*states[i], row);
+            result.insert(result.end(), row.begin(), row.end());
+        }
+    }
+
+    //! Evaluate state on dnn, blocks until result of state is ready, thread-safe
+    void evaluate(const std::vector<float>& state, std::vector<float>& result) {
+        Request req;
+        req.state = &state;
+        req.result = &result;
+        req.queued = true;
+        req.done = false;
+
+        std::unique_lock<std::mutex> guard(lock);
+        pending.push_back(&req);
+        if (pending.size() >= batchSize)
+            flush(guard); // batch is full
+
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (!req.done) {
+            if (!req.queued) { // sent by other thread, wait for results
+                ready.wait(guard);
+                continue;
+            }
+            if (ready.wait_until(guard, deadline) == std::cv_status::timeout && req.queued)
+                flush(guard); // batch was not filled in time, send partial batch
+        }
+
+        if (req.error)
+            std::rethrow_exception(req.error);
+    }
+};
+
+#endif // BATCHQUEUE_HPP
@@ -0,0 +1,120 @@
+#include <chrono>
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iostream>
+
+#include "mcts.hpp"
+#include "chess/chess.hpp"
+#include "connect4/connect4.hpp"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+//! Measure policy iterations per second of one search from the initial state
+template <class TProblem>
+double measure(const TProblem& state, unsigned int policyIter, unsigned int virtualLoss, double virtualLossW, unsigned int seed) {
+    typedef MCTS<TProblem, MCTSNodeBaseMT<typename TProblem::ActType>, MCTSStorageArena> MCTSDef;
+    MCTSDef ai(seed);
+    std::vector<typename TProblem::ActType> history;
+    ai.setVirtualLoss(virtualLoss, virtualLossW);
+
+    // execute prints statistics of root childs, hide them
+    std::stringstream sink;
+    std::streambuf* coutBuf = std::cout.rdbuf(sink.rdbuf());
+    auto t0 = std::chrono::high_resolution_clock::now();
+    ai.execute(0, true, state, policyIter, history);
+    auto t1 = std::chrono::high_resolution_clock::now();
+    std::cout.rdbuf(coutBuf);
+
+    double sec = std::chrono::duration_cast<std::chrono::duration<double> >(t1-t0).count();
+    return ai.getIterations() / sec;
+}
+
+template <class TProblem>
+void sweep(const std::string& name, const TProblem& state, unsigned int policyIter, unsigned int maxThreads,
+           const std::vector<unsigned int>& virtualLosses, double virtualLossW, unsigned int seed) {
+    for (size_t v = 0; v < virtualLosses.size(); ++v) {
+        double base = 0.0;
+        for (unsigned int threads = 1; threads <= maxThreads; threads *= 2) {
+#ifdef _OPENMP
+            omp_set_num_threads(threads);
+#endif
+            double iterPerSec = measure(state, policyIter, virtualLosses[v], virtualLossW, seed);
+            if (threads == 1)
+                base = iterPerSec;
+            std::cout << name << ";"
+                      << threads << ";"
+                      << virtualLosses[v] << ";"
+                      << policyIter << ";"
+                      << iterPerSec << ";"
+                      << iterPerSec / base
+                      << std::endl;
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    unsigned int seed = 0;
+    unsigned int maxThreads = 32;
+    unsigned int virtualLoss = 3;
+    unsigned int policyIter[2] = {2000, 20000}; // chess, connect4
+
+    if (argc == 2 && (argv[1] == std::string("-h") || argv[1] == std::string("--help"))) {
+        std::cout << "Paramaters:" << std::endl;
+        std::cout << "threads 32 (maximum number of threads, doubled from 1)" << std::endl;
+        std::cout << "virtualLoss 3 (compared against disabled virtual loss)" << std::endl;
+        std::cout << "seed 0" << std::endl;
+        std::cout << "chess 2000 (policy iterations for chess, 0 skips)" << std::endl;
+        std::cout << "connect4 20000 (policy iterations for connect4, 0 skips)" << std::endl;
+        return 0;
+    }
+
+    if (argc % 2 == 0) {
+        std::cout << "Invalid input, exe key1 value1 key2 value2" << std::endl;
+        return -1;
+    }
+
+    for (int i = 1; i < argc; i+=2) {
+        std::string key(argv[i+0]);
+        std::string val(argv[i+1]);
+        if (key == "threads") {
+            maxThreads = std::stoi(val);
+        } else if (key == "virtualLoss") {
+            virtualLoss = std::stoi(val);
+        } else if (key == "seed") {
+            seed = std::stoi(val);
+        } else if (key == "chess") {
+            policyIter[0] = std::stoi(val);
+        } else if (key == "connect4") {
+            policyIter[1] = std::stoi(val);
+        } else {
+            std::cout << "Unknown Key: " << key << std::endl;
+            return -1;
+        }
+    }
+
+#ifndef _OPENMP
+    std::cout << "Built without OpenMP, only one thread is measured" << std::endl;
+    maxThreads = 1;
+#endif
+
+    std::vector<unsigned int> virtualLosses;
+    virtualLosses.push_back(0);
+    if (virtualLoss != 0)
+        virtualLosses.push_back(virtualLoss);
+
+    // pure mcts, port "0" does not use dnn
+    zmq::context_t zmq_context(1);
+    ZMQSocketPool sockets(zmq_context);
+    DNNPlayers pure(sockets, "0", "0");
+    std::cout << "Problem;Threads;VirtualLoss;PolicyIter;IterPerSec;Speedup" << std::endl;
+    if (policyIter[0] != 0)
+        sweep("Chess", Chess(pure), policyIter[0], maxThreads, virtualLosses, 0.0, seed);
+    if (policyIter[1] != 0)
+        sweep("Connect4", Connect4(pure), policyIter[1], maxThreads, virtualLosses, -1.0, seed);
+
+    return 0;
+}
@@ -0,0 +1,211 @@
+#include <chrono>
+#include <cmath>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <iostream>
+
+#include "mcts.hpp"
+#include "ucbkernel.hpp"
+#include "chess/chess.hpp"
+#include "connect4/connect4.hpp"
+
+//! Statistics of many parents, stored as separate child nodes and as arrays
+struct Layouts {
+    typedef MCTSNodeBaseMT<int> NodeMT;
+
+    size_t childs; //!< childs per parent
+    std::vector<std::vector<std::unique_ptr<NodeMT> > > nodes; //!< childs allocated one by one as in heap storage
+    std::vector<std::uint32_t> N; //!< arrays of all parents, childs of a parent are contiguous
+    std::vector<double> W;
+    std::vector<double> P;
+    std::vector<double> visitSqrt; //!< of parents
+
+    Layouts(size_t parents, size_t childs, std::default_random_engine& generator) : childs(childs) {
+        std::uniform_int_distribution<std::uint32_t> visits(0, 1000);
+        std::uniform_real_distribution<double> win(-1.0, 1.0);
+        nodes.resize(parents);
+        for (size_t c = 0; c < childs; ++c) { // interleave allocations of parents, as the tree grows
+            for (size_t p = 0; p < parents; ++p) {
+                nodes[p].push_back(std::unique_ptr<NodeMT>(new NodeMT(0)));
+                NodeMT& node = *nodes[p].back();
+                node.N = visits(generator);
+                node.W += node.N * win(generator) * 0.5;
+                node.P = 1.0 / childs;
+            }
+        }
+        for (size_t p = 0; p < parents; ++p) {
+            std::uint32_t sum = 0;
+            for (size_t c = 0; c < childs; ++c) {
+                const NodeMT& node = *nodes[p][c];
+                N.push_back(static_cast<std::uint32_t>(node.N));
+                W.push_back(node.W);
+                P.push_back(node.P);
+                sum += N.back();
+            }
+            visitSqrt.push_back(sqrt(sum));
+        }
+    }
+
+    size_t selectNodes(size_t p, double c) const {
+        size_t best = 0;
+        double bestVal = -std::numeric_limits<double>::max();
+        for (size_t i = 0; i < childs; ++i) {
+            const NodeMT& node = *nodes[p][i];
+            double val = MCTSKernelUCB::value(static_cast<std::uint32_t>(node.N), node.W, node.P, 0.0, 1.0, visitSqrt[p], c);
+            if (bestVal < val) {
+                best = i;
+                bestVal = val;
+            }
+        }
+        return best;
+    }
+
+    size_t selectScalar(size_t p, double c) const {
+        size_t o = p * childs;
+        return MCTSKernelUCB::argmaxScalar(0, childs, &N[o], &W[o], &P[o], nullptr, 1.0, visitSqrt[p], c);
+    }
+
+    size_t selectSIMD(size_t p, double c) const {
+        size_t o = p * childs;
+        return MCTSKernelUCB::argmax(childs, &N[o], &W[o], &P[o], nullptr, 1.0, visitSqrt[p], c);
+    }
+};
+
+//! Measure selections per second on random parents
+template <typename TSelect>
+double measureSelect(const std::vector<size_t>& order, TSelect select, size_t& checksum) {
+    auto t0 = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < order.size(); ++i)
+        checksum += select(order[i]);
+    auto t1 = std::chrono::high_resolution_clock::now();
+    double sec = std::chrono::duration_cast<std::chrono::duration<double> >(t1-t0).count();
+    return order.size() / sec;
+}
+
+//! Measure policy iterations per second of one search from the initial state
+template <class TProblem, class TNodeBase, template <class> class TStorage, template <class> class TSelection = MCTSSelectDefault>
+double measureSearch(const TProblem& state, unsigned int policyIter, unsigned int seed) {
+    MCTS<TProblem, TNodeBase, TStorage, TSelection> ai(seed);
+    std::vector<typename TProblem::ActType> history;
+
+    // execute prints statistics of root childs, hide them
+    std::stringstream sink;
+    std::streambuf* coutBuf = std::cout.rdbuf(sink.rdbuf());
+    auto t0 = std::chrono::high_resolution_clock::now();
+    ai.execute(0, true, state, policyIter, history);
+    auto t1 = std::chrono::high_resolution_clock::now();
+    std::cout.rdbuf(coutBuf);
+
+    double sec = std::chrono::duration_cast<std::chrono::duration<double> >(t1-t0).count();
+    return ai.getIterations() / sec;
+}
+
+template <class TProblem>
+void sweepSearch(const std::string& name, const TProblem& state, unsigned int policyIter, unsigned int seed) {
+    typedef typename TProblem::ActType ActType;
+    std::cout << name << ";Heap;" << policyIter << ";"
+              << measureSearch<TProblem, MCTSNodeBaseMT<ActType>, MCTSStorageHeap>(state, policyIter, seed) << std::endl;
+    std::cout << name << ";Arena;" << policyIter << ";"
+              << measureSearch<TProblem, MCTSNodeBaseMT<ActType>, MCTSStorageArena>(state, policyIter, seed) << std::endl;
+    std::cout << name << ";SoA;" << policyIter << ";"
+              << measureSearch<TProblem, MCTSNodeBaseSoA<ActType>, MCTSStorageSoA>(state, policyIter, seed) << std::endl;
+    // selection policies on the arena, UCT does not compute noise, Gumbel selects root by halving
+    std::cout << name << ";Arena+PUCT;" << policyIter << ";"
+              << measureSearch<TProblem, MCTSNodeBaseMT<ActType>, MCTSStorageArena, MCTSSelectPUCT>(state, policyIter, seed) << std::endl;
+    std::cout << name << ";Arena+UCT;" << policyIter << ";"
+              << measureSearch<TProblem, MCTSNodeBaseMT<ActType>, MCTSStorageArena, MCTSSelectUCT>(state, policyIter, seed) << std::endl;
+    std::cout << name << ";Arena+Gumbel;" << policyIter << ";"
+              << measureSearch<TProblem, MCTSNodeBaseMT<ActType>, MCTSStorageArena, MCTSSelectGumbel>(state, policyIter, seed) << std::endl;
+}
+
+int main(int argc, char** argv) {
+    unsigned int seed = 0;
+    size_t totalChilds = 1 << 20;
+    size_t selections = 1 << 22;
+    unsigned int policyIter[2] = {20000, 200000}; // chess, connect4
+
+    if (argc == 2 && (argv[1] == std::string("-h") || argv[1] == std::string("--help"))) {
+        std::cout << "Paramaters:" << std::endl;
+        std::cout << "childs 1048576 (number of childs of all parents, sets the working set)" << std::endl;
+        std::cout << "selections 4194304 (number of selections per layout)" << std::endl;
+        std::cout << "seed 0" << std::endl;
+        std::cout << "chess 20000 (policy iterations of the search for chess, 0 skips)" << std::endl;
+        std::cout << "connect4 200000 (policy iterations of the search for connect4, 0 skips)" << std::endl;
+        return 0;
+    }
+
+    if (argc % 2 == 0) {
+        std::cout << "Invalid input, exe key1 value1 key2 value2" << std::endl;
+        return -1;
+    }
+
+    for (int i = 1; i < argc; i+=2) {
+        std::string key(argv[i+0]);
+        std::string val(argv[i+1]);
+        if (key == "childs") {
+            totalChilds = std::stoull(val);
+        } else if (key == "selections") {
+            selections = std::stoull(val);
+        } else if (key == "seed") {
+            seed = std::stoi(val);
+        } else if (key == "chess") {
+            policyIter[0] = std::stoi(val);
+        } else if (key == "connect4") {
+            policyIter[1] = std::stoi(val);
+        } else {
+            std::cout << "Unknown Key: " << key << std::endl;
+            return -1;
+        }
+    }
+
+#if defined(__AVX2__)
+    std::cout << "SIMD: AVX2" << std::endl;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    std::cout << "SIMD: NEON" << std::endl;
+#else
+    std::cout << "SIMD: none, build with -march=native (BUILD_Native) to enable" << std::endl;
+#endif
+
+    // selection of one node, as number of childs in connect4 and chess
+    std::default_random_engine generator(seed);
+    const size_t childCounts[] = {7, 30, 64, 218};
+    std::cout << "Childs;Parents;Nodes;SoA;SoASIMD" << std::endl;
+    for (size_t childs : childCounts) {
+        size_t parents = std::max<size_t>(totalChilds / childs, 1);
+        Layouts layouts(parents, childs, generator);
+        std::uniform_int_distribution<size_t> parent(0, parents-1);
+        std::vector<size_t> order(selections / childs);
+        for (size_t i = 0; i < order.size(); ++i)
+            order[i] = parent(generator);
+
+        const double c = Chess::UCT_C;
+        size_t checksum[3] = {0, 0, 0};
+        double nodes = measureSelect(order, [&](size_t p) { return layouts.selectNodes(p, c); }, checksum[0]);
+        double scalar = measureSelect(order, [&](size_t p) { return layouts.selectScalar(p, c); }, checksum[1]);
+        double simd = measureSelect(order, [&](size_t p) { return layouts.selectSIMD(p, c); }, checksum[2]);
+        if (checksum[0] != checksum[1] || checksum[0] != checksum[2]) {
+            std::cout << "Error in selection, layouts select different childs" << std::endl;
+            return -1;
+        }
+        std::cout << childs << ";" << parents << ";" << nodes << ";" << scalar << ";" << simd << std::endl;
+    }
+
+    // whole search on one thread, pure mcts, port "0" does not use dnn
+    zmq::context_t zmq_context(1);
+    ZMQSocketPool sockets(zmq_context);
+    DNNPlayers pure(sockets, "0", "0");
+#ifdef _OPENMP
+    omp_set_num_threads(1);
+#endif
+    std::cout << "Problem;Storage;PolicyIter;IterPerSec" << std::endl;
+    if (policyIter[0] != 0)
+        sweepSearch("Chess", Chess(pure), policyIter[0], seed);
+    if (policyIter[1] != 0)
+        sweepSearch("Connect4", Connect4(pure), policyIter[1], seed);
+
+    return 0;
+}
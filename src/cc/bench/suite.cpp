@@ -0,0 +1,392 @@
+#include <chrono>
+#include <atomic>
+#include <cstdlib>
+
+#include <new>
+#include <string>
+#include <vector>
+#include <random>
+#include <sstream>
+#include <iostream>
+#include <functional>
+
+#include "mcts.hpp"
+#include "evaluator.hpp"
+#include "chess/chess.hpp"
+#include "connect4/connect4.hpp"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// live heap bytes of the program, every allocation carries its size in a header
+static std::atomic<size_t> heapBytes(0);
+constexpr static size_t HeapHeader = 16; // keeps the alignment of operator new
+
+void* operator new(size_t bytes) {
+    void* raw = std::malloc(bytes + HeapHeader);
+    if (raw == nullptr)
+        throw std::bad_alloc();
+    *static_cast<size_t*>(raw) = bytes;
+    heapBytes.fetch_add(bytes, std::memory_order_relaxed);
+    return static_cast<char*>(raw) + HeapHeader;
+}
+
+void operator delete(void* ptr) noexcept {
+    if (ptr == nullptr)
+        return;
+    void* raw = static_cast<char*>(ptr) - HeapHeader;
+    heapBytes.fetch_sub(*static_cast<size_t*>(raw), std::memory_order_relaxed);
+    std::free(raw);
+}
+
+//! Parameters of the suite, defaults are fixed so results of commits can be compared
+struct Config {
+    unsigned int seed = 0;
+    unsigned int repeat = 3; //!< best of repetitions is reported
+    int perftDepth = 5;
+    unsigned int games = 100; //!< random games replayed by update and encode
+    unsigned int maxThreads = 8;
+    unsigned int policyIter[2] = {2000, 20000}; //!< chess, connect4
+    size_t allocNodes = 1 << 20;
+    std::string filter = ""; //!< run only benchmarks whose name contains this
+};
+
+//! Print one result, value is per second unless the unit says otherwise
+void report(const std::string& bench, const std::string& params, double value, const std::string& unit) {
+    std::cout << bench << ";" << params << ";" << value << ";" << unit << std::endl;
+}
+
+//! Best duration in seconds of repeat runs of func
+double best(unsigned int repeat, const std::function<void()>& func) {
+    double sec = std::numeric_limits<double>::max();
+    for (unsigned int r = 0; r < std::max(repeat, 1u); ++r) {
+        auto t0 = std::chrono::steady_clock::now();
+        func();
+        auto t1 = std::chrono::steady_clock::now();
+        sec = std::min(sec, std::chrono::duration_cast<std::chrono::duration<double> >(t1-t0).count());
+    }
+    return sec;
+}
+
+//! Actions of random games from the initial state, same for a seed
+template <class TProblem>
+std::vector<std::vector<typename TProblem::ActType> > randomGames(const TProblem& initial, unsigned int games,
+                                                                   size_t maxMoves, unsigned int seed) {
+    std::default_random_engine generator(seed);
+    std::vector<std::vector<typename TProblem::ActType> > result(games);
+    typename TProblem::ActType actions[TProblem::MaxActions];
+    for (unsigned int g = 0; g < games; ++g) {
+        TProblem state(initial);
+        while (!state.isFinished() && result[g].size() < maxMoves) {
+            int player = state.getPlayer();
+            int nActions = state.getPossibleActions(player, player, actions);
+            std::uniform_int_distribution<int> pick(0, nActions-1);
+            result[g].push_back(actions[pick(generator)]);
+            state.update(result[g].back());
+        }
+    }
+    return result;
+}
+
+//! Leaf count of the move tree from the initial position, checked against the reference counts
+bool benchPerft(const Config& cfg, const Chess& initial) {
+    const unsigned long long reference[] = {1, 20, 400, 8902, 197281, 4865609, 119060324};
+    for (int depth = 1; depth <= cfg.perftDepth && depth <= 6; ++depth) {
+        unsigned long long nodes = 0;
+        double sec = best(cfg.repeat, [&]() { nodes = Chess::perft(initial, depth); });
+        if (nodes != reference[depth]) {
+            std::cout << "Error in perft " << depth << ": " << nodes << " instead of " << reference[depth] << std::endl;
+            return false;
+        }
+        report("Perft", "depth " + std::to_string(depth), nodes / sec, "leafs/s");
+    }
+    return true;
+}
+
+//! Copy and update of each state of random games, as each policy iteration does, chess has no undo
+void benchChessUpdate(const Config& cfg, const std::string& name, const Chess& initial) {
+    auto games = randomGames(initial, cfg.games, 300, cfg.seed);
+    std::vector<Chess> states;
+    std::vector<Chess::ActType> actions;
+    for (auto& g : games) {
+        Chess state(initial);
+        for (auto& act : g) {
+            states.push_back(state);
+            actions.push_back(act);
+            state.update(act);
+        }
+    }
+    int sink = 0;
+    double sec = best(cfg.repeat, [&]() {
+        for (size_t i = 0; i < states.size(); ++i) {
+            Chess next(states[i]);
+            next.update(actions[i]);
+            sink += next.getPlayer();
+        }
+    });
+    report("Update", name, states.size() / sec, "plies/s");
+    if (sink < 0)
+        std::cout << sink << std::endl;
+}
+
+//! Update and undo of whole random games
+void benchConnect4Update(const Config& cfg, const Connect4& initial) {
+    auto games = randomGames(initial, cfg.games, 6*7, cfg.seed);
+    size_t plies = 0;
+    for (auto& g : games)
+        plies += g.size();
+    int sink = 0;
+    double sec = best(cfg.repeat, [&]() {
+        for (int r = 0; r < 100; ++r) { // games of connect4 are short, replay them to get measurable times
+            for (auto& g : games) {
+                Connect4 state(initial);
+                for (auto& act : g)
+                    state.update(act);
+                sink += state.getPlayer();
+                for (size_t i = 0; i < g.size(); ++i)
+                    state.undo();
+            }
+        }
+    });
+    report("Update", "Connect4 update+undo", 2 * 100 * plies / sec, "plies/s");
+    if (sink < 0)
+        std::cout << sink << std::endl;
+}
+
+//! Encoding of the dnn input of each state of random games, from the view of the player to move
+template <class TProblem>
+void benchEncode(const Config& cfg, const std::string& name, const TProblem& initial, size_t maxMoves) {
+    auto games = randomGames(initial, cfg.games, maxMoves, cfg.seed);
+    std::vector<TProblem> states;
+    for (auto& g : games) {
+        TProblem state(initial);
+        for (auto& act : g) {
+            states.push_back(state);
+            state.update(act);
+        }
+    }
+    std::vector<float> data;
+    float sink = 0.0f;
+    double sec = best(cfg.repeat, [&]() {
+        for (const TProblem& state : states) {
+            data.clear();
+            state.getGameStateDNN(data, state.getPlayer());
+            sink += data[0];
+        }
+    });
+    report("Encode", name + " " + std::to_string(data.size()) + " floats", states.size() / sec, "states/s");
+    if (sink < 0.0f)
+        std::cout << sink << std::endl;
+}
+
+//! Policy iterations per second of one search from the initial state, pure mcts without dnn
+template <class TProblem, class TNodeBase, template <class> class TStorage>
+double searchRate(const Config& cfg, const TProblem& initial, unsigned int policyIter, double virtualLossW, size_t& nodes) {
+    std::vector<typename TProblem::ActType> history;
+    unsigned int iterations = 0;
+    double sec = best(cfg.repeat, [&]() {
+        MCTS<TProblem, TNodeBase, TStorage> ai(cfg.seed);
+        ai.setVerbose(false);
+        ai.setVirtualLoss(3, virtualLossW);
+        ai.execute(0, true, initial, policyIter, history);
+        iterations = ai.getIterations();
+        nodes = ai.getNodeCount();
+    });
+    return iterations / sec;
+}
+
+template <class TProblem>
+void benchSearch(const Config& cfg, const std::string& name, const TProblem& initial, unsigned int policyIter, double virtualLossW) {
+    typedef typename TProblem::ActType ActType;
+    for (unsigned int threads = 1; threads <= cfg.maxThreads; threads *= 2) {
+#ifdef _OPENMP
+        omp_set_num_threads(threads);
+#endif
+        size_t nodes = 0;
+        double rate = searchRate<TProblem, MCTSNodeBaseMT<ActType>, MCTSStorageArena>(cfg, initial, policyIter, virtualLossW, nodes);
+        report("Search", name + " threads " + std::to_string(threads), rate, "iter/s");
+    }
+#ifdef _OPENMP
+    omp_set_num_threads(1);
+#endif
+}
+
+//! Heap bytes of the tree after a search divided by its nodes
+template <class TProblem, class TNodeBase, template <class> class TStorage>
+void benchTreeMemory(const Config& cfg, const std::string& name, const TProblem& initial, unsigned int policyIter) {
+    typedef MCTS<TProblem, TNodeBase, TStorage> MCTSDef;
+    std::vector<typename TProblem::ActType> history;
+    size_t before = heapBytes;
+    MCTSDef ai(cfg.seed);
+    ai.setVerbose(false);
+    ai.execute(0, true, initial, policyIter, history);
+    size_t bytes = heapBytes - before;
+    report("Memory", name + " sizeof node", double(MCTSDef::getNodeBytes()), "bytes");
+    report("Memory", name + " tree of " + std::to_string(ai.getNodeCount()) + " nodes",
+           double(bytes) / ai.getNodeCount(), "bytes/node");
+}
+
+//! Node of the allocation benchmark, same members as MCTS::Node
+template <class TNodeBase, template <class> class TStorage>
+struct BenchNode : public TNodeBase {
+    typename TStorage<BenchNode>::Childs childs;
+    BenchNode* transposition;
+
+    template <typename... TStats>
+    BenchNode(const typename TNodeBase::ActType& action, TStats&... stats) : TNodeBase(action, stats...), transposition(nullptr) {}
+    BenchNode(const BenchNode&) = delete;
+};
+
+//! Expand nodes breadth first with childs each until the storage holds the nodes, then release them
+template <class TNodeBase, template <class> class TStorage>
+void benchAllocation(const Config& cfg, const std::string& name, size_t childs) {
+    typedef BenchNode<TNodeBase, TStorage> Node;
+    std::vector<typename TNodeBase::ActType> actions(childs);
+    size_t nodes = 0;
+    size_t bytes = 0;
+    double sec = best(cfg.repeat, [&]() {
+        size_t before = heapBytes;
+        TStorage<Node> storage;
+        typename TStorage<Node>::Childs root;
+        std::vector<Node*> frontier(1, storage.add(root, actions.data(), 1));
+        for (size_t i = 0; storage.size() < cfg.allocNodes; ++i) {
+            Node* first = storage.add(frontier[i]->childs, actions.data(), childs);
+            for (size_t c = 0; c < childs; ++c)
+                frontier.push_back(frontier[i]->childs[c]);
+            (void)first;
+        }
+        nodes = storage.size();
+        bytes = heapBytes - before - frontier.capacity() * sizeof(Node*);
+        storage.clear();
+    });
+    report("Allocation", name + " childs " + std::to_string(childs), nodes / sec, "nodes/s");
+    report("Allocation", name + " childs " + std::to_string(childs) + " memory", double(bytes) / nodes, "bytes/node");
+}
+
+int main(int argc, char** argv) {
+    Config cfg;
+
+    if (argc == 2 && (argv[1] == std::string("-h") || argv[1] == std::string("--help"))) {
+        std::cout << "Paramaters:" << std::endl;
+        std::cout << "filter Perft (run only benchmarks whose name contains it: Perft, Update, Encode, Search, Memory, Allocation)" << std::endl;
+        std::cout << "repeat 3 (repetitions of each measurement, best is reported)" << std::endl;
+        std::cout << "seed 0 (seed of random games and searches)" << std::endl;
+        std::cout << "perft 5 (maximum depth of chess perft, at most 6)" << std::endl;
+        std::cout << "games 100 (random games replayed by update and encode)" << std::endl;
+        std::cout << "threads 8 (maximum number of search threads, doubled from 1)" << std::endl;
+        std::cout << "chess 2000 (policy iterations of chess searches, 0 skips)" << std::endl;
+        std::cout << "connect4 20000 (policy iterations of connect4 searches, 0 skips)" << std::endl;
+        std::cout << "nodes 1048576 (nodes of the allocation benchmark)" << std::endl;
+        return 0;
+    }
+
+    if (argc % 2 == 0) {
+        std::cout << "Invalid input, exe key1 value1 key2 value2" << std::endl;
+        return -1;
+    }
+
+    for (int i = 1; i < argc; i+=2) {
+        std::string key(argv[i+0]);
+        std::string val(argv[i+1]);
+        if (key == "filter") {
+            cfg.filter = val;
+        } else if (key == "repeat") {
+            cfg.repeat = std::stoi(val);
+        } else if (key == "seed") {
+            cfg.seed = std::stoi(val);
+        } else if (key == "perft") {
+            cfg.perftDepth = std::stoi(val);
+        } else if (key == "games") {
+            cfg.games = std::stoi(val);
+        } else if (key == "threads") {
+            cfg.maxThreads = std::max(std::stoi(val), 1);
+        } else if (key == "chess") {
+            cfg.policyIter[0] = std::stoi(val);
+        } else if (key == "connect4") {
+            cfg.policyIter[1] = std::stoi(val);
+        } else if (key == "nodes") {
+            cfg.allocNodes = std::stoull(val);
+        } else {
+            std::cout << "Unknown Key: " << key << std::endl;
+            return -1;
+        }
+    }
+
+#ifndef _OPENMP
+    std::cout << "Built without OpenMP, only one thread is measured" << std::endl;
+    cfg.maxThreads = 1;
+#endif
+#if defined(__AVX2__)
+    std::cout << "SIMD: AVX2" << std::endl;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    std::cout << "SIMD: NEON" << std::endl;
+#else
+    std::cout << "SIMD: none" << std::endl;
+#endif
+    auto enabled = [&](const std::string& bench) { return bench.find(cfg.filter) != std::string::npos; };
+
+    // pure mcts, port "0" does not use dnn
+    zmq::context_t zmq_context(1);
+    ZMQSocketPool sockets(zmq_context);
+    DNNPlayers pure(sockets, "0", "0");
+    const Chess chess(pure);
+    const Connect4 connect4(pure);
+    // copies of states with a real endpoint, which is longer than the small string buffer
+    DNNPlayers remote(sockets, "tcp://localhost:5555", "tcp://localhost:5555");
+    const Chess chessRemote(remote);
+    // search with the evaluation path of dnn, without zeromq and python
+    DNNEvaluatorSynthetic synthetic[2] = {DNNEvaluatorSynthetic(Chess::PlaneSize+1), DNNEvaluatorSynthetic(Connect4::PlaneSize+1)};
+    DNNPlayers chessPlayers(sockets, "synthetic", "synthetic");
+    DNNPlayers connect4Players(sockets, "synthetic", "synthetic");
+    for (int p = 0; p < 2; ++p) {
+        chessPlayers.setEvaluator(p, &synthetic[0]);
+        connect4Players.setEvaluator(p, &synthetic[1]);
+    }
+    Chess chessSynthetic(chessPlayers);
+    Connect4 connect4Synthetic(connect4Players);
+#ifdef _OPENMP
+    omp_set_num_threads(1);
+#endif
+
+    Chess::perft(chess, 1); // attack tables are built at first use, not in the first measurement
+    std::cout << "Benchmark;Case;Value;Unit" << std::endl;
+    if (enabled("Perft") && !benchPerft(cfg, chess))
+        return -1;
+    if (enabled("Update")) {
+        benchChessUpdate(cfg, "Chess copy+update", chess);
+        benchChessUpdate(cfg, "Chess copy+update endpoint", chessRemote);
+        benchConnect4Update(cfg, connect4);
+    }
+    if (enabled("Encode")) {
+        benchEncode(cfg, "Chess", chess, 300);
+        benchEncode(cfg, "Connect4", connect4, 6*7);
+    }
+    if (enabled("Search")) {
+        if (cfg.policyIter[0] != 0)
+            benchSearch(cfg, "Chess", chess, cfg.policyIter[0], 0.0);
+        if (cfg.policyIter[1] != 0)
+            benchSearch(cfg, "Connect4", connect4, cfg.policyIter[1], -1.0);
+        if (cfg.policyIter[0] != 0)
+            benchSearch(cfg, "Chess synthetic", chessSynthetic, cfg.policyIter[0], -1.0);
+        if (cfg.policyIter[1] != 0)
+            benchSearch(cfg, "Connect4 synthetic", connect4Synthetic, cfg.policyIter[1], -1.0);
+    }
+    if (enabled("Memory")) {
+        typedef Chess::ActType ActType;
+        if (cfg.policyIter[0] != 0) {
+            benchTreeMemory<Chess, MCTSNodeBaseMT<ActType>, MCTSStorageHeap>(cfg, "Chess Heap", chess, cfg.policyIter[0]);
+            benchTreeMemory<Chess, MCTSNodeBaseMT<ActType>, MCTSStorageArena>(cfg, "Chess Arena", chess, cfg.policyIter[0]);
+            benchTreeMemory<Chess, MCTSNodeBaseSoA<ActType>, MCTSStorageSoA>(cfg, "Chess SoA", chess, cfg.policyIter[0]);
+        }
+    }
+    if (enabled("Allocation")) {
+        const size_t childCounts[] = {7, 30};
+        for (size_t childs : childCounts) {
+            benchAllocation<MCTSNodeBaseMT<int>, MCTSStorageHeap>(cfg, "Heap", childs);
+            benchAllocation<MCTSNodeBaseMT<int>, MCTSStorageArena>(cfg, "Arena", childs);
+            benchAllocation<MCTSNodeBaseSoA<int>, MCTSStorageSoA>(cfg, "SoA", childs);
+        }
+    }
+    return 0;
+}
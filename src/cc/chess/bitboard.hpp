@@ -0,0 +1,260 @@
+#ifndef BITBOARD_HPP
+#define BITBOARD_HPP
+
+#include <cstdint>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(__BMI2__)
+#include <immintrin.h>
+#endif
+
+//! Precomputed attack tables for chess move generation
+/*!
+ * \details Square index is y*8+x, same as the dnn planes.
+ *          Knight, king and pawn attacks are looked up directly.
+ *          Slider attacks use magic bitboards, or PEXT if the instruction set is available (BMI2).
+ *          Magic numbers are searched once at first use with fixed seeds, this takes some tens of milliseconds.
+ *          Lines and segments between squares are precomputed for check and pin masks.
+ * \author adamp87
+*/
+class ChessBitBoard {
+public:
+    typedef std::uint64_t BitBoard;
+
+    //! Bit of square
+    static BitBoard bit(int sq) {
+        return BitBoard(1) << sq;
+    }
+
+    //! Number of set bits
+    static int count(BitBoard b) {
+#if defined(_MSC_VER)
+        return static_cast<int>(__popcnt64(b));
+#else
+        return __builtin_popcountll(b);
+#endif
+    }
+
+    //! Index of least significant set bit, b must not be zero
+    static int lsb(BitBoard b) {
+#if defined(_MSC_VER)
+        unsigned long idx;
+        _BitScanForward64(&idx, b);
+        return static_cast<int>(idx);
+#else
+        return __builtin_ctzll(b);
+#endif
+    }
+
+    //! Return index of least significant bit and clear it
+    static int pop(BitBoard& b) {
+        int sq = lsb(b);
+        b &= b - 1;
+        return sq;
+    }
+
+    //! Mirror board vertically, square y*8+x moves to (7-y)*8+x
+    static BitBoard flip(BitBoard b) {
+#if defined(_MSC_VER)
+        return _byteswap_uint64(b);
+#else
+        return __builtin_bswap64(b);
+#endif
+    }
+
+    static BitBoard knight(int sq) { return get().knightTable[sq]; }
+    static BitBoard king(int sq) { return get().kingTable[sq]; }
+    //! Squares attacked by pawn of player on sq
+    static BitBoard pawn(int player, int sq) { return get().pawnTable[player][sq]; }
+    //! Squares strictly between a and b, if they are on one line
+    static BitBoard between(int a, int b) { return get().betweenTable[a][b]; }
+    //! Full line through a and b including them, zero if not on one line
+    static BitBoard line(int a, int b) { return get().lineTable[a][b]; }
+
+    static BitBoard rook(int sq, BitBoard occ) {
+        const ChessBitBoard& t = get();
+        return t.attacks[t.rookMagic[sq].index(occ)];
+    }
+
+    static BitBoard bishop(int sq, BitBoard occ) {
+        const ChessBitBoard& t = get();
+        return t.attacks[t.bishopMagic[sq].index(occ)];
+    }
+
+    static BitBoard queen(int sq, BitBoard occ) {
+        return rook(sq, occ) | bishop(sq, occ);
+    }
+
+private:
+    //! Lookup of one square of one slider type
+    struct Magic {
+        BitBoard mask; //!< relevant occupancy, board edges excluded
+        BitBoard magic; //!< multiplier for hashing
+        unsigned int shift; //!< 64 minus number of relevant bits
+        size_t offset; //!< first entry of square in attacks
+
+        size_t index(BitBoard occ) const {
+#if defined(__BMI2__)
+            return offset + static_cast<size_t>(_pext_u64(occ, mask));
+#else
+            return offset + static_cast<size_t>(((occ & mask) * magic) >> shift);
+#endif
+        }
+    };
+
+    BitBoard knightTable[64];
+    BitBoard kingTable[64];
+    BitBoard pawnTable[2][64];
+    BitBoard betweenTable[64][64];
+    BitBoard lineTable[64][64];
+    Magic rookMagic[64];
+    Magic bishopMagic[64];
+    std::vector<BitBoard> attacks; //!< slider attacks of all squares, rook then bishop
+
+    //! Tables are built on first use, thread-safe by C++11 static initialization
+    static const ChessBitBoard& get() {
+        static const ChessBitBoard tables;
+        return tables;
+    }
+
+    static bool isInside(int x, int y) {
+        return 0 <= x && x < 8 && 0 <= y && y < 8;
+    }
+
+    //! Attacks of slider on sq by walking the rays, used to build tables
+    static BitBoard slide(int sq, BitBoard occ, const int (*dirs)[2]) {
+        BitBoard result = 0;
+        for (int d = 0; d < 4; ++d) {
+            int x = sq % 8 + dirs[d][0];
+            int y = sq / 8 + dirs[d][1];
+            for (; isInside(x, y); x += dirs[d][0], y += dirs[d][1]) {
+                result |= bit(y*8+x);
+                if (occ & bit(y*8+x))
+                    break;
+            }
+        }
+        return result;
+    }
+
+    //! Deterministic random numbers with few bits set for magic search
+    static BitBoard sparseRandom(BitBoard& seed) {
+        BitBoard r[3];
+        for (int i = 0; i < 3; ++i) { // xorshift64*
+            seed ^= seed >> 12;
+            seed ^= seed << 25;
+            seed ^= seed >> 27;
+            r[i] = seed * 2685821657736338717ULL;
+        }
+        return r[0] & r[1] & r[2];
+    }
+
+    //! Find magic of square and fill its attacks
+    void initMagic(int sq, const int (*dirs)[2], Magic& m) {
+        // edges only matter if the slider is on them
+        const BitBoard rank1 = 0xFFULL, rank8 = 0xFFULL << 56;
+        const BitBoard fileA = 0x0101010101010101ULL, fileH = fileA << 7;
+        BitBoard edges = ((rank1 | rank8) & ~(sq < 8 ? rank1 : 0) & ~(sq >= 56 ? rank8 : 0)) |
+                         ((fileA | fileH) & ~(sq % 8 == 0 ? fileA : 0) & ~(sq % 8 == 7 ? fileH : 0));
+        m.mask = slide(sq, 0, dirs) & ~edges;
+        int bits = count(m.mask);
+        m.shift = 64 - bits;
+        m.offset = attacks.size();
+        attacks.resize(attacks.size() + (size_t(1) << bits));
+
+        // enumerate all subsets of mask, carry-rippler
+        std::vector<BitBoard> occupancy;
+        std::vector<BitBoard> reference;
+        BitBoard occ = 0;
+        do {
+            occupancy.push_back(occ);
+            reference.push_back(slide(sq, occ, dirs));
+            occ = (occ - m.mask) & m.mask;
+        } while (occ);
+
+#if defined(__BMI2__)
+        m.magic = 0;
+        for (size_t i = 0; i < occupancy.size(); ++i)
+            attacks[m.index(occupancy[i])] = reference[i];
+#else
+        // seeds per rank are known to find magics after few candidates, as in Stockfish
+        const BitBoard seeds[8] = {728, 10316, 55013, 32803, 12281, 15100, 16645, 255};
+        BitBoard seed = seeds[sq/8];
+        std::vector<unsigned int> epoch(occupancy.size(), 0);
+        for (unsigned int attempt = 1; ; ++attempt) {
+            m.magic = sparseRandom(seed);
+            if (count((m.mask * m.magic) >> 56) < 6)
+                continue; // poor candidate
+            bool ok = true;
+            for (size_t i = 0; ok && i < occupancy.size(); ++i) {
+                size_t idx = static_cast<size_t>(((occupancy[i] & m.mask) * m.magic) >> m.shift);
+                if (epoch[idx] != attempt) { // free in this attempt
+                    epoch[idx] = attempt;
+                    attacks[m.offset + idx] = reference[i];
+                } else if (attacks[m.offset + idx] != reference[i]) {
+                    ok = false; // destructive collision
+                }
+            }
+            if (ok)
+                break;
+        }
+#endif
+    }
+
+    ChessBitBoard() {
+        const int rookDirs[4][2] = {{1,0},{-1,0},{0,1},{0,-1}};
+        const int bishopDirs[4][2] = {{1,1},{1,-1},{-1,1},{-1,-1}};
+        const int knightSteps[8][2] = {{-2,-1},{-2,1},{2,-1},{2,1},{-1,-2},{-1,2},{1,-2},{1,2}};
+
+        for (int sq = 0; sq < 64; ++sq) {
+            int x = sq % 8;
+            int y = sq / 8;
+            knightTable[sq] = kingTable[sq] = 0;
+            pawnTable[0][sq] = pawnTable[1][sq] = 0;
+            for (int i = 0; i < 8; ++i) {
+                if (isInside(x+knightSteps[i][0], y+knightSteps[i][1]))
+                    knightTable[sq] |= bit((y+knightSteps[i][1])*8 + x+knightSteps[i][0]);
+            }
+            for (int dy = -1; dy <= 1; ++dy) {
+                for (int dx = -1; dx <= 1; ++dx) {
+                    if ((dx != 0 || dy != 0) && isInside(x+dx, y+dy))
+                        kingTable[sq] |= bit((y+dy)*8 + x+dx);
+                }
+            }
+            for (int dx = -1; dx <= 1; dx += 2) {
+                if (isInside(x+dx, y+1))
+                    pawnTable[0][sq] |= bit((y+1)*8 + x+dx); // white moves up
+                if (isInside(x+dx, y-1))
+                    pawnTable[1][sq] |= bit((y-1)*8 + x+dx); // black moves down
+            }
+        }
+
+        for (int a = 0; a < 64; ++a) {
+            for (int b = 0; b < 64; ++b) {
+                betweenTable[a][b] = lineTable[a][b] = 0;
+                if (a == b)
+                    continue;
+                const int (*dirs)[2] = NULL;
+                if (slide(a, 0, rookDirs) & bit(b))
+                    dirs = rookDirs;
+                else if (slide(a, 0, bishopDirs) & bit(b))
+                    dirs = bishopDirs;
+                else
+                    continue;
+                betweenTable[a][b] = slide(a, bit(b), dirs) & slide(b, bit(a), dirs);
+                lineTable[a][b] = (slide(a, 0, dirs) & slide(b, 0, dirs)) | bit(a) | bit(b);
+            }
+        }
+
+        for (int sq = 0; sq < 64; ++sq)
+            initMagic(sq, rookDirs, rookMagic[sq]);
+        for (int sq = 0; sq < 64; ++sq)
+            initMagic(sq, bishopDirs, bishopMagic[sq]);
+    }
+
+    ChessBitBoard(const ChessBitBoard&) = delete;
+};
+
+#endif // BITBOARD_HPP
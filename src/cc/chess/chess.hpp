@@ -3,12 +3,18 @@
 
 #include <string>
 #include <vector>
+#include <cmath>
 #include <numeric>
 #include <algorithm>
-#include <functional>
+#include <sstream>
+#include <cctype>
 
 #include <zmq.hpp>
 
+#include "zmqpool.hpp"
+#include "dnnplayers.hpp"
+#include "bitboard.hpp"
+
 #ifdef __CUDACC__
 #define CUDA_CALLABLE_MEMBER __host__ __device__
 #else
@@ -58,6 +64,8 @@ public:
     constexpr static double DirichletAlpha = 0.3; //!< interface
     constexpr static unsigned int MaxActions = 218; //!< interface: https://chess.stackexchange.com/questions/4490/maximum-possible-movement-in-a-turn
     constexpr static unsigned int MaxChildPerNode = MaxActions; //!< interface
+    constexpr static unsigned int PlaneSize = 8*8; //!< values of one plane of the dnn state, for DNNWireFormat
+    constexpr static unsigned int PlaneHeight = 8; //!< rows of one plane, width is PlaneSize/PlaneHeight
 
 private:
     struct Figure {
@@ -99,34 +107,157 @@ private:
         }
     };
 
+    typedef ChessBitBoard::BitBoard BitBoard;
+
+    constexpr static int HistoryLength = 8; //!< turns encoded for the dnn and hashed for transpositions
+    constexpr static int RepetitionWindow = 128; //!< turns compared for repetitions, more than the 100 turns of the 50 turn rule
+
     StateSparse figures; //!< Sparse representation of chess figures
     std::int_fast16_t time; //!< current turn of the game
     std::int_fast16_t timeLastProgress; //!< last time when figure was taken or pawn moved
-    std::vector<StateSparse> history; //!< previous relevant board states, current state should not be part of it
+    std::int_fast16_t timeFirst; //!< first turn of the history, start of game or time set by setBoardFEN
+
+    // history is kept in rings of fixed size, copy of the state does not depend on the length of the game
+    std::uint64_t hashes[RepetitionWindow]; //!< hash of the figures of the last turns, indexed by time modulo window
+    std::uint8_t repeated[HistoryLength]; //!< number of earlier turns with the same figures, indexed by time modulo length
+    BitBoard boards[HistoryLength][2][6]; //!< figures of the last turns per player and type, indexed by time modulo length
+
+    const DNNPlayers& players; //!< dnn settings of both players, shared by all copies of the state, not owned
+
+    //! Finalizer of splitmix64, spreads bits of packed fields over the hash
+    static std::uint64_t mixHash(std::uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    //! Zobrist hash of figures, key of each figure is mixed from all fields compared by StateSparse
+    static std::uint64_t getHash(const StateSparse& figs) {
+        std::uint64_t hash = 0;
+        for (int i = 0; i < 16*2; ++i) {
+            const FigureSparse& fig = figs[i];
+            std::uint64_t packed = (std::uint64_t(i) << 48) |
+                                   (std::uint64_t(fig.type) << 40) |
+                                   (std::uint64_t(std::uint8_t(fig.posY*8 + fig.posX)) << 32) |
+                                   std::uint64_t(std::uint16_t(fig.firstMoved));
+            hash ^= mixHash(packed);
+        }
+        return hash;
+    }
+
+    //! Number of turns in the history, including the current one
+    int historySize() const {
+        return time - timeFirst + 1;
+    }
 
-    std::string ports[2]; //!< ports for zeromq socket connections: white, black
-    zmq::context_t& zmq_context; //!< zeromq context for socket connections
+    //! Append current state to the history, keeps its bitboards for the dnn input and counts its repetitions
+    /*!
+    * \details Pawn moves and captures cannot be undone, only turns since the last progress are compared.
+    *          The game is even before the window is exceeded.
+    *          Note: moves are not checked, only if board has the same state.
+    */
+    void pushHistory() {
+        BitBoard (&bits)[2][6] = boards[time % HistoryLength];
+        std::fill(&bits[0][0], &bits[0][0] + 2*6, BitBoard(0));
+        for (int i = 0; i < 16*2; ++i) {
+            if (figures[i].type != Figure::Unset)
+                bits[i/16][figures[i].type-1] |= ChessBitBoard::bit(figures[i].posY*8 + figures[i].posX);
+        }
 
-    int repetitions(const StateSparse& figs, int t_skip=0) const {
-        // note: moves are not checked, only if board has the same state
+        const std::uint64_t hash = getHash(figures);
+        int first = std::max<int>(std::max<int>(timeLastProgress, timeFirst), time - RepetitionWindow + 1);
         int count = 0;
-        for (auto it = history.rbegin()+t_skip; it != history.rend(); ++it) {
-            const StateSparse& hist = *it;
-            if (hist == figs)
+        for (int t = first; t < time; ++t) {
+            if (hashes[t % RepetitionWindow] == hash)
                 count += 1;
         }
-        return count;
+        hashes[time % RepetitionWindow] = hash;
+        repeated[time % HistoryLength] = static_cast<std::uint8_t>(count);
+    }
+
+    //! Start the history at the current turn, after figures or time were set without update
+    void restartHistory() {
+        timeFirst = time;
+        pushHistory();
+    }
+
+    //! Game is even by repetitions or by the 50 turn rule, regardless of the figures
+    bool isForcedEven() const {
+        return repeated[time % HistoryLength] == 3 || time-timeLastProgress >= 100;
+    }
+
+    //! Bitboards of the figures, built from the sparse state for move generation
+    struct StateBits {
+        BitBoard pieces[2][7]; //!< figures per player and type
+        BitBoard occupied[2]; //!< figures per player
+        BitBoard all; //!< figures of both players
+        std::int_fast8_t index[8*8]; //!< index of figure in sparse state, -1 if square is free
+    };
+
+    void getStateBits(StateBits& bits) const {
+        std::fill(&bits.pieces[0][0], &bits.pieces[0][0] + 2*7, BitBoard(0));
+        std::fill(bits.index, bits.index + 8*8, -1);
+        bits.occupied[0] = bits.occupied[1] = 0;
+        for (int i = 0; i < 16*2; ++i) {
+            if (figures[i].type == Figure::Unset)
+                continue;
+            int sq = figures[i].posY*8 + figures[i].posX;
+            bits.pieces[i/16][figures[i].type] |= ChessBitBoard::bit(sq);
+            bits.occupied[i/16] |= ChessBitBoard::bit(sq);
+            bits.index[sq] = i;
+        }
+        bits.all = bits.occupied[0] | bits.occupied[1];
+    }
+
+    //! Figures of player which attack square, sliders are blocked by occ
+    static BitBoard attackers(const StateBits& bits, int sq, int player, BitBoard occ) {
+        typedef ChessBitBoard BB;
+        const BitBoard* p = bits.pieces[player];
+        return (BB::pawn((player+1)%2, sq) & p[Figure::Pawn]) |
+               (BB::knight(sq) & p[Figure::Knight]) |
+               (BB::king(sq) & p[Figure::King]) |
+               (BB::bishop(sq, occ) & (p[Figure::Bishop] | p[Figure::Queen])) |
+               (BB::rook(sq, occ) & (p[Figure::Rook] | p[Figure::Queen]));
+    }
+
+    //! Castling with the left (index 2) or right (index 3) rook
+    /*!
+    * \details King and rook must be unmoved and the squares between them free.
+    *          If legal is set, the king must not be in check, nor pass or land on an attacked square.
+    */
+    bool canCastle(const StateBits& bits, int idxAi, bool left, bool legal) const {
+        const FigureSparse& king = figures[idxAi*16];
+        const FigureSparse& rook = figures[idxAi*16 + (left ? 2 : 3)];
+        if (king.type != Figure::King || king.firstMoved != 0 || rook.type != Figure::Rook || rook.firstMoved != 0)
+            return false;
+        const int x = king.posX;
+        const int y = king.posY;
+        const int dx = left ? -1 : 1;
+        for (int n = 1; n <= (left ? 3 : 2); ++n) {
+            if (x+n*dx < 0 || 8 <= x+n*dx || (bits.all & ChessBitBoard::bit(y*8+x+n*dx)))
+                return false;
+        }
+        if (!legal)
+            return true;
+        BitBoard occ = bits.all ^ ChessBitBoard::bit(y*8+x);
+        for (int n = 0; n <= 2; ++n) {
+            if (attackers(bits, y*8+x+n*dx, (idxAi+1)%2, occ))
+                return false;
+        }
+        return true;
     }
 
 public:
-    //! Set initial state
-    Chess(zmq::context_t& zmq_context, const std::string& portW, const std::string& portB)
-        : zmq_context(zmq_context)
+    //! Set initial state, players are kept by reference
+    explicit Chess(const DNNPlayers& players)
+        : players(players)
     {
-        ports[0] = portW;
-        ports[1] = portB;
         time = 0;
         timeLastProgress = 0;
+        timeFirst = 0;
+        std::fill(hashes, hashes + RepetitionWindow, std::uint64_t(0));
+        std::fill(repeated, repeated + HistoryLength, std::uint8_t(0));
+        std::fill(&boards[0][0][0], &boards[0][0][0] + HistoryLength*2*6, BitBoard(0));
         for (int idxAi = 0; idxAi < 2; ++idxAi) {
             figures[0+16*idxAi].posX = 4;
             figures[0+16*idxAi].type = Figure::King;
@@ -157,6 +288,7 @@ public:
                 figures[i+8+16*idxAi].type = Figure::Pawn;
             }
         }
+        pushHistory();
     }
 
     //! Interface
@@ -175,174 +307,159 @@ public:
 
     //! Interface, Implements game logic, return the possible actions that idxAi can play
     /*!
+    * \details Moves are generated on bitboards with precomputed attack tables.
+    *          For the player to move, moves leaving the king in check are filtered with check and pin masks.
+    *          A king can only be taken by the player to move, so moves of the other player are not filtered.
     * \param idxMe ID of player who executes function
     * \param idxAi ID of player to get possible actions for
     * \param actions Allocated array to store possible actions
+    * \param checkKing Filter moves leaving king in check and detect checkmate
     * \return Number of possible actions
     */
     CUDA_CALLABLE_MEMBER ActCounterType getPossibleActions(int idxMe, int idxAi, ActType* actions, bool checkKing=true) const {
-        // inspired by: https://codereview.stackexchange.com/questions/173656/chess-game-in-c
-        //NOTE: cuda does not like lambda functions, should be refactored to build for cuda
-        Figure board[8*8];
+        typedef ChessBitBoard BB;
         ActCounterType nActions = 0;
+        const int idxOp = (idxAi+1)%2;
+        const int king = idxAi * 16;
 
-        auto getPos = [&] (int x, int y, int dx, int dy) -> int { return (y+dy)*8+x+dx; };
-        auto isInsideBoard = [&] (int x, int y, int dx, int dy) -> bool { int xx=x+dx; int yy=y+dy; return 0<=xx && xx<8 && 0<=yy && yy<8; };
-        auto isFree = [&] (int x, int y, int dx, int dy) -> bool { return isInsideBoard(x,y,dx,dy) && board[getPos(x,y,dx,dy)].type == Figure::Unset; };
-        auto isOpponent = [&] (int x, int y, int dx, int dy) -> bool { return isInsideBoard(x,y,dx,dy) && board[getPos(x,y,dx,dy)].type != Figure::Unset && board[getPos(x,y,dx,dy)].playerIdx != idxAi; };
-        auto isEnPassant = [&] (int x, int y, int dx, int dy) -> bool { return isOpponent(x,y,dx,dy) && board[getPos(x,y,dx,dy)].type == Figure::Pawn && board[getPos(x,y,dx,dy)].firstMoved == time; };
-
-        auto isKingInCheck = [&] (int x, int y, int dx, int dy, ActType::Type type=ActType::Normal) -> bool {
-            if (!checkKing)
-                return false; // block recursion
-            Chess copy(*this);
-            ActType testAction(x,y,x+dx,y+dy,type);
-            copy.update(testAction);
-            ActType copyactions[MaxActions];
-            ActCounterType copynActions = copy.getPossibleActions(copy.getPlayer(), copy.getPlayer(), copyactions, false);
-            for (int i = 0; i < copynActions; ++i) {
-                int king = idxAi * 16;
-                if (copyactions[i].toX == copy.figures[king].posX && copyactions[i].toY == copy.figures[king].posY) {
-                    // opponent can hit king
-                    return true;
-                }
-            }
-            return false;
-        };
-
-        auto addMove = [&] (int x, int y, int dx, int dy, ActType::Type type=ActType::Normal) -> void {
-            if(isFree(x,y,dx,dy) || isOpponent(x,y,dx,dy)) {
-                if (isKingInCheck(x, y, dx, dy, type))
-                    return;
+        // check repetitions count and progress (50 turn rule)
+        if (isForcedEven()) {
+            int x = figures[king].posX;
+            int y = figures[king].posY;
+            actions[0] = ActType(x,y,x,y,ActType::Even);
+            return 1;
+        }
 
-                actions[nActions++] = ActType(x,y,x+dx,y+dy,type);
+        StateBits bits;
+        getStateBits(bits);
+        const BitBoard own = bits.occupied[idxAi];
+        const BitBoard opp = bits.occupied[idxOp];
+        const int kingSq = figures[king].posY*8 + figures[king].posX;
+        const bool legal = checkKing && idxAi == getPlayer() && figures[king].type == Figure::King;
+
+        BitBoard checkers = 0;
+        BitBoard checkMask = ~BitBoard(0); // targets which resolve check
+        BitBoard pinned = 0;
+        if (legal) {
+            checkers = attackers(bits, kingSq, idxOp, bits.all);
+            if (BB::count(checkers) > 1)
+                checkMask = 0; // double check, only king can move
+            else if (checkers)
+                checkMask = checkers | BB::between(kingSq, BB::lsb(checkers));
+
+            // own figure is pinned, if it is the only one between king and opponent slider
+            const BitBoard* op = bits.pieces[idxOp];
+            BitBoard snipers = (BB::rook(kingSq, opp) & (op[Figure::Rook] | op[Figure::Queen])) |
+                               (BB::bishop(kingSq, opp) & (op[Figure::Bishop] | op[Figure::Queen]));
+            while (snipers) {
+                BitBoard blockers = BB::between(kingSq, BB::pop(snipers)) & bits.all;
+                if (BB::count(blockers) == 1 && (blockers & own))
+                    pinned |= blockers;
             }
+        }
+
+        auto addMove = [&] (int from, int to, ActType::Type type) -> void {
+            actions[nActions++] = ActType(from%8, from/8, to%8, to/8, type);
         };
-        auto addPromote = [&] (int x, int y, int dx, int dy) -> void {
-            addMove(x,y,dx,dy,ActType::PromoteK);
-            addMove(x,y,dx,dy,ActType::PromoteB);
-            addMove(x,y,dx,dy,ActType::PromoteR);
-            addMove(x,y,dx,dy,ActType::PromoteQ);
+        auto addTargets = [&] (int from, BitBoard targets) -> void {
+            while (targets)
+                addMove(from, BB::pop(targets), ActType::Normal);
         };
-
-        auto opNul = [&] (int    ) -> int { return    0; };
-        auto opPos = [&] (int val) -> int { return  val; };
-        auto opNeg = [&] (int val) -> int { return -val; };
-        auto scanLine = [&] (int x, int y, std::function<int (int)> opX, std::function<int (int)> opY) -> void {
-            for(int n=1; n < 8; ++n) {
-                if (isFree(x,y,opX(n),opY(n))) {
-                    addMove(x,y,opX(n),opY(n));
+        auto addPawnTargets = [&] (int from, BitBoard targets) -> void {
+            while (targets) {
+                int to = BB::pop(targets);
+                if (to/8 != 0 && to/8 != 7) {
+                    addMove(from, to, ActType::Normal);
                     continue;
                 }
-                if (isOpponent(x,y,opX(n),opY(n))) {
-                    addMove(x,y,opX(n),opY(n));
-                    break;
-                }
-                break;
+                addMove(from, to, ActType::PromoteK);
+                addMove(from, to, ActType::PromoteB);
+                addMove(from, to, ActType::PromoteR);
+                addMove(from, to, ActType::PromoteQ);
             }
         };
 
-        auto castlingL = [&] (int x, int y) -> bool {
-            bool isKingMoved = figures[idxAi*16  ].type != Figure::King || figures[idxAi*16  ].firstMoved != 0;
-            bool isRookMoved = figures[idxAi*16+2].type != Figure::Rook || figures[idxAi*16+2].firstMoved != 0;
-            return (!isKingMoved && !isRookMoved &&
-                    isFree(x, y, -1, 0) && isFree(x, y, -2, 0) && isFree(x, y, -3, 0) &&
-                    !isKingInCheck(x, y, 0, 0) && !isKingInCheck(x, y, -1, 0) && !isKingInCheck(x, y, -2, 0));
-        };
-
-        auto castlingR = [&] (int x, int y) -> bool {
-            bool isKingMoved = figures[idxAi*16  ].type != Figure::King || figures[idxAi*16  ].firstMoved != 0;
-            bool isRookMoved = figures[idxAi*16+3].type != Figure::Rook || figures[idxAi*16+3].firstMoved != 0;
-            return (!isKingMoved && !isRookMoved &&
-                    isFree(x, y, +1, 0) && isFree(x, y, +2, 0) &&
-                    !isKingInCheck(x, y, 0, 0) && !isKingInCheck(x, y, +1, 0) && !isKingInCheck(x, y, +2, 0));
-        };
-
-        // check repetitions count
-        if (repetitions(figures) == 3) {
-            int king = idxAi * 16;
-            int x = figures[king].posX;
-            int y = figures[king].posY;
-            actions[0] = ActType(x,y,x,y,ActType::Even);
-            return 1;
-        }
-
-        // no progress have been made (50 turn rule)
-        if (time-timeLastProgress >= 100) {
-            int king = idxAi * 16;
-            int x = figures[king].posX;
-            int y = figures[king].posY;
-            actions[0] = ActType(x,y,x,y,ActType::Even);
-            return 1;
-        }
-
-        // set up dense board
-        for(int i = 0; i < 16*2; ++i) {
+        // for each figure of current ai
+        for(int i = idxAi*16; i < (idxAi+1)*16; ++i) {
             if (figures[i].type == Figure::Unset)
                 continue;
-            int x = figures[i].posX;
-            int y = figures[i].posY;
-            board[getPos(x,y,0,0)] = figures[i];
-        }
+            const int x = figures[i].posX;
+            const int y = figures[i].posY;
+            const int from = y*8+x;
+            BitBoard mask = ~own & checkMask;
+            if (pinned & BB::bit(from))
+                mask &= BB::line(kingSq, from); // move only along the pin
 
-        // for each figure of current ai
-        for(int i = idxAi*16; i < (idxAi+1)*16; ++i) {
-            int x = figures[i].posX;
-            int y = figures[i].posY;
             switch(figures[i].type){
-                case Figure::Type::Pawn:
-                    // black pawn
-                    if(idxAi==1 && y==6 && isFree(x,y,0,-1) && isFree(x,y,0,-2)) addMove(x,y,0,-2);
-                    if(idxAi==1 && isFree(x,y,0,-1)) {if (y!=1) addMove(x,y,0,-1); else addPromote(x,y,0,-1);}
-                    if(idxAi==1 && isOpponent(x,y,-1,-1)) {if (y!=1) addMove(x,y,-1,-1); else addPromote(x,y,-1,-1);}
-                    if(idxAi==1 && isOpponent(x,y,1,-1)) {if (y!=1) addMove(x,y,1,-1); else addPromote(x,y,1,-1);}
-                    if(idxAi==1 && y==3 && isEnPassant(x,y,1,0)) addMove(x,y,1,-1,ActType::EnPassant);
-                    if(idxAi==1 && y==3 && isEnPassant(x,y,-1,0)) addMove(x,y,-1,-1,ActType::EnPassant);
-                    // white pawn
-                    if(idxAi==0 && y==1 && isFree(x,y,0,1) && isFree(x,y,0,2)) addMove(x,y,0,2);
-                    if(idxAi==0 && isFree(x,y,0,1)) {if (y!=6) addMove(x,y,0,1); else addPromote(x,y,0,1);}
-                    if(idxAi==0 && isOpponent(x,y,-1,1)) {if (y!=6) addMove(x,y,-1,1); else addPromote(x,y,-1,1);}
-                    if(idxAi==0 && isOpponent(x,y,1,1)) {if (y!=6) addMove(x,y,1,1); else addPromote(x,y,1,1);}
-                    if(idxAi==0 && y==4 && isEnPassant(x,y,1,0)) addMove(x,y,1,1,ActType::EnPassant);
-                    if(idxAi==0 && y==4 && isEnPassant(x,y,-1,0)) addMove(x,y,-1,1,ActType::EnPassant);
+                case Figure::Type::Pawn: {
+                    const int dir = idxAi == 0 ? 1 : -1;
+                    if (y+dir < 0 || 8 <= y+dir)
+                        break;
+                    BitBoard pushes = 0;
+                    if (!(bits.all & BB::bit(from+dir*8))) {
+                        pushes |= BB::bit(from+dir*8);
+                        if (y == (idxAi == 0 ? 1 : 6) && !(bits.all & BB::bit(from+dir*16)))
+                            pushes |= BB::bit(from+dir*16);
+                    }
+                    addPawnTargets(from, pushes & mask);
+                    addPawnTargets(from, BB::pawn(idxAi, from) & opp & mask);
+
+                    // opponent pawn next to it made its first move in the last turn
+                    if (y != (idxAi == 0 ? 4 : 3))
+                        break;
+                    for (int dx = 1; dx >= -1; dx -= 2) {
+                        if (x+dx < 0 || 8 <= x+dx)
+                            continue;
+                        const int cap = from+dx;
+                        const int to = cap+dir*8;
+                        const int idx = bits.index[cap];
+                        if (idx < 0 || idx/16 != idxOp || figures[idx].type != Figure::Pawn || figures[idx].firstMoved != time)
+                            continue;
+                        if (own & BB::bit(to))
+                            continue;
+                        if (legal) {
+                            // two figures leave the line of the king, test the board after the move
+                            BitBoard occ = (bits.all ^ BB::bit(from) ^ BB::bit(cap)) | BB::bit(to);
+                            if (attackers(bits, kingSq, idxOp, occ) & ~(BB::bit(cap) | BB::bit(to)))
+                                continue;
+                        }
+                        addMove(from, to, ActType::EnPassant);
+                    }
                     break;
+                }
 
                 case Figure::Type::Knight:
-                    addMove(x,y,-2,-1); addMove(x,y,-2,1); addMove(x,y,2,-1); addMove(x,y,2,1);
-                    addMove(x,y,-1,-2); addMove(x,y,-1,2); addMove(x,y,1,-2); addMove(x,y,1,2);
+                    addTargets(from, BB::knight(from) & mask);
                     break;
 
-                case Figure::Type::King:
-                    for(auto dy : {-1,0,1})
-                        for(auto dx : {-1,0,1})
-                            addMove(x,y,dy,dx);
-                    if (castlingL(x, y)) addMove(x,y,-2,0,ActType::Castling);
-                    if (castlingR(x, y)) addMove(x,y,+2,0,ActType::Castling);
+                case Figure::Type::King: {
+                    BitBoard targets = BB::king(from) & ~own;
+                    if (legal) {
+                        // king does not block attacks on squares behind it
+                        BitBoard occ = bits.all ^ BB::bit(from);
+                        BitBoard candidates = targets;
+                        while (candidates) {
+                            int to = BB::pop(candidates);
+                            if (attackers(bits, to, idxOp, occ))
+                                targets &= ~BB::bit(to);
+                        }
+                    }
+                    addTargets(from, targets);
+                    if (canCastle(bits, idxAi, true, legal)) addMove(from, from-2, ActType::Castling);
+                    if (canCastle(bits, idxAi, false, legal)) addMove(from, from+2, ActType::Castling);
                     break;
+                }
 
                 case Figure::Type::Rook:
-                    scanLine(x,y,opNul,opPos);
-                    scanLine(x,y,opNul,opNeg);
-                    scanLine(x,y,opPos,opNul);
-                    scanLine(x,y,opNeg,opNul);
+                    addTargets(from, BB::rook(from, bits.all) & mask);
                     break;
 
                 case Figure::Type::Bishop:
-                    scanLine(x,y,opPos,opPos);
-                    scanLine(x,y,opPos,opNeg);
-                    scanLine(x,y,opNeg,opPos);
-                    scanLine(x,y,opNeg,opNeg);
+                    addTargets(from, BB::bishop(from, bits.all) & mask);
                     break;
 
                 case Figure::Type::Queen:
-                    scanLine(x,y,opNul,opPos);
-                    scanLine(x,y,opNul,opNeg);
-                    scanLine(x,y,opPos,opNul);
-                    scanLine(x,y,opNeg,opNul);
-                    scanLine(x,y,opPos,opPos);
-                    scanLine(x,y,opPos,opNeg);
-                    scanLine(x,y,opNeg,opPos);
-                    scanLine(x,y,opNeg,opNeg);
+                    addTargets(from, BB::queen(from, bits.all) & mask);
                     break;
 
                 case Figure::Type::Unset:
@@ -352,18 +469,9 @@ public:
 
         if (nActions == 0 && checkKing) {
             //checkmate or even
-            int king = idxAi * 16;
-            bool checkmate = false;
-            nActions = getPossibleActions(idxMe, getPlayer(time+1), actions, false);
-            for (int i = 0; i < nActions; ++i) {
-                if (actions[i].toX == figures[king].posX && actions[i].toY == figures[king].posY) {
-                    // opponent can hit king
-                    checkmate = true;
-                }
-            }
             int x = figures[king].posX;
             int y = figures[king].posY;
-            if (checkmate) {
+            if (checkers) {
                 actions[0] = ActType(x,y,x,y,ActType::CheckMate);
             } else {
                 actions[0] = ActType(x,y,x,y,ActType::Even);
@@ -374,11 +482,26 @@ public:
         return nActions;
     }
 
+    //! Interface, hash of the state for the transposition table
+    /*!
+    * \details Covers everything the possible actions and the dnn input depend on:
+    *          the boards of the last 8 turns, their repetitions, the turn and the last progress.
+    *          Because of the history, transpositions are found only if the last 8 turns are the same.
+    */
+    std::uint64_t getHash() const {
+        std::uint64_t hash = mixHash((std::uint64_t(std::uint16_t(time)) << 16) | std::uint16_t(timeLastProgress));
+        for (int t = 0; t != HistoryLength && t < historySize(); ++t) {
+            int count = repeated[(time-t) % HistoryLength];
+            std::uint64_t board = hashes[(time-t) % RepetitionWindow] ^ mixHash(std::min(count, 3));
+            hash ^= t == 0 ? board : (board << (t*8)) | (board >> (64-t*8)); // rotate by turn, keeps order of boards
+        }
+        return hash;
+    }
+
     //! Interface, Update the game state according to move
     CUDA_CALLABLE_MEMBER void update(ActType& act) {
         int idxAi = getPlayer(time);
         int idxOp = getPlayer(time+1);
-        history.push_back(figures);
         for(int i = idxAi*16; i < 16*(idxAi+1); ++i) {
             if (figures[i].type != Figure::Unset && figures[i].posX == act.fromX && figures[i].posY == act.fromY) {
                 figures[i].posX = act.toX;
@@ -432,10 +555,11 @@ public:
             }
         }
         ++time;
+        pushHistory();
     }
 
     void getGameStateDNN(std::vector<float>& data, int idxMe) const {
-        const int T = 8;
+        const int T = HistoryLength;
         const int p1_piece_start = 0;
         const int p1_piece_count = 6 * T * 8 * 8;
         const int p2_piece_start = p1_piece_start + p1_piece_count;
@@ -457,70 +581,43 @@ public:
         const int noactioncount_start = p2_castlingR_start + p2_castlingR_count;
         const int noactioncount_count = 8 * 8;
 
-        auto fill_player_piece = [&] (const StateSparse& figs, int idxPP, int p_piece_start, int t) -> void {
-            for (int i = idxPP*16; i < (idxPP+1)*16; ++i) {
-                const FigureSparse& fig = figs[i];
-                if (fig.type == Figure::Type::Unset)
-                    continue;
-
-                // flip board
-                int posY = fig.posY;
-                if (idxMe == 1 && idxPP == 1)
-                    posY = 7-posY;
-                if (idxMe == 1 && idxPP == 0)
-                    posY = -posY+7;
-
-                data[p_piece_start + t*8*8*6 + (int(fig.type)-1)*8*8 + posY*8+fig.posX] = 1.0f;
+        auto fill_player_piece = [&] (const BitBoard* bits, int p_piece_start, int t) -> void {
+            for (int type = 0; type < 6; ++type) {
+                BitBoard b = idxMe == 1 ? ChessBitBoard::flip(bits[type]) : bits[type]; // flip board
+                float* plane = data.data() + p_piece_start + t*8*8*6 + type*8*8;
+                while (b)
+                    plane[ChessBitBoard::pop(b)] = 1.0f;
             }
         };
 
         const int data_size = noactioncount_start + noactioncount_count;
         data.resize(data_size, 0.0f);
 
-        int t = 0;
+        // planes of the last turns are kept by update, history may be shorter after setBoardFEN
         int idxOp = (idxMe + 1) % 2;
-        const StateSparse* figs = &figures;
-        while (t != T && time-t>=0) {
-            fill_player_piece(*figs, idxMe, p1_piece_start, t);
-            fill_player_piece(*figs, idxOp, p2_piece_start, t);
+        for (int t = 0; t != T && t < historySize(); ++t) {
+            const BitBoard (&bits)[2][6] = boards[(time-t) % T];
+            fill_player_piece(bits[idxMe], p1_piece_start, t);
+            fill_player_piece(bits[idxOp], p2_piece_start, t);
 
-            int count = repetitions(*figs, t);
+            int count = repeated[(time-t) % T];
             std::fill(data.data()+repetition_start+ t*8*8,
                       data.data()+repetition_start+ t*8*8 + std::min<int>(count,2)*8*8,
                       1.0f);
-
-            ++t;
-            if (time-t>=0)
-                figs = &history[history.size()-t];
         }
 
         float p1castleL = 0.0f;
         float p1castleR = 0.0f;
         float p2castleL = 0.0f;
         float p2castleR = 0.0f;
-        {
-            ActCounterType nActions;
-            ActType actions[MaxActions];
-            nActions = getPossibleActions(idxMe, idxMe, actions);
-            for (ActCounterType i = 0; i < nActions; ++i) {
-                ActType& action = actions[i];
-                if (action.type != ActType::Castling)
-                    continue;
-                if (action.fromX < action.toX)
-                    p1castleR = 1.0f;
-                else
-                    p1castleL = 1.0f;
-            }
-            nActions = getPossibleActions(idxMe, idxOp, actions);
-            for (ActCounterType i = 0; i < nActions; ++i) {
-                ActType& action = actions[i];
-                if (action.type != ActType::Castling)
-                    continue;
-                if (action.fromX < action.toX)
-                    p2castleR = 1.0f;
-                else
-                    p2castleL = 1.0f;
-            }
+        if (!isForcedEven()) {
+            // same as castling is in the possible actions, only the player to move is checked for attacks
+            StateBits bits;
+            getStateBits(bits);
+            p1castleL = canCastle(bits, idxMe, true,  idxMe == getPlayer()) ? 1.0f : 0.0f;
+            p1castleR = canCastle(bits, idxMe, false, idxMe == getPlayer()) ? 1.0f : 0.0f;
+            p2castleL = canCastle(bits, idxOp, true,  idxOp == getPlayer()) ? 1.0f : 0.0f;
+            p2castleR = canCastle(bits, idxOp, false, idxOp == getPlayer()) ? 1.0f : 0.0f;
         }
 
         std::fill(data.data()+color_start, data.data() + color_start+color_count, idxMe);
@@ -545,72 +642,45 @@ public:
         }
     }
 
-    void storeGamePolicyDNN(std::vector<float>& game, std::vector<float>& policy) const {
-        //connect socket
-        zmq::socket_t socket(zmq_context, ZMQ_REQ);
-        socket.connect("tcp://localhost:5557");
-
-        //send game
-        zmq::message_t request1(game.size()*sizeof(float));
-        memcpy(request1.data(), game.data(), game.size()*sizeof(float));
-        socket.send(request1);
+    //! Interface, chess has no mirror symmetry, castling differs between the wings, so no sample is added
+    bool mirrorSampleDNN(std::vector<float>&, std::vector<float>&) const {
+        return false;
+    }
 
-        //get the reply
-        char ok[2];
-        zmq::message_t reply;
-        socket.recv(&reply);
-        memcpy(ok, reply.data(), 2);
-        if (ok[0] != 4 || ok[1] != 2)
-            throw std::runtime_error("Could not store gamestate");
+    //! Interface, chess has no mirror symmetry, states are evaluated as they are
+    void setSymmetry(bool) {}
 
-        //send game
-        zmq::message_t request2(policy.size()*sizeof(float));
-        memcpy(request2.data(), policy.data(), policy.size()*sizeof(float));
-        socket.send(request2);
+    //! Send state to dnn of player, result is policy logits and value
+    void evaluateDNN(int idxMe, std::vector<float>& result) const {
+        std::vector<float> state_dnn;
+        getGameStateDNN(state_dnn, idxMe);
 
-        //get the reply
-        socket.recv(&reply);
-        memcpy(ok, reply.data(), 2);
-        if (ok[0] != 4 || ok[1] != 2)
-            throw std::runtime_error("Could not store gamepolicy");
+        std::vector<const std::vector<float>*> states(1, &state_dnn);
+        players.evaluate(idxMe, states, result);
     }
 
     //! Interface, Compute W and P values for MCTS
     //! * \param idxMe ID of player who executes function
     CUDA_CALLABLE_MEMBER void computeMCTS_WP(int idxMe, ActType* actions, ActCounterType nActions, double* P, double& W) const {
-
-        std::vector<float> state_dnn;
-        getGameStateDNN(state_dnn, idxMe);
-
-        if (ports[idxMe] == "0") {
+        if (!players.hasDNN(idxMe)) {
             // compute W based on figure count, no dnn
             W = computeMCTS_W(idxMe);
             for (ActCounterType i = 0; i < nActions; ++i) {
-                int fromY = actions[i].fromY;
-                if (idxMe == 1)
-                    fromY = 7-fromY;// flip board
                 P[i] = 1.0;
             }
             return;
         }
 
-        //connect socket
-        zmq::socket_t socket(zmq_context, ZMQ_REQ);
-        socket.connect(ports[idxMe]);
-
-        //send request
-        zmq::message_t request(state_dnn.size()*sizeof(float));
-        memcpy(request.data(), state_dnn.data(), state_dnn.size()*sizeof(float));
-        socket.send(request);
-
-        //get the reply
-        zmq::message_t reply;
-        socket.recv(&reply);
-        std::vector<float> result(reply.size() / sizeof(float));
-        memcpy(result.data(), reply.data(), reply.size());
+        std::vector<float> result;
+        DNNEvalCache* cache = players.getEvalCache(idxMe);
+        std::uint64_t hash = cache != NULL ? getHash() : 0;
+        if (cache == NULL || !cache->find(hash, result)) {
+            evaluateDNN(idxMe, result);
+            if (cache != NULL && result.size() == 65)
+                cache->insert(hash, result);
+        }
         if (result.size() != 65)
             throw std::runtime_error("Bad Reply");
-        socket.close();
 
         W = result[64];
         double pi_sum = 0;
@@ -627,6 +697,12 @@ public:
         }
     }
 
+    //! Interface, value of a lost game for player idxAi, e.g. the value of a virtual loss
+    //! * \param idxAi ID of player who executes function
+    double getLostValue(int idxAi) const {
+        return players.hasDNN(idxAi) ? -1.0 : 0.0; // computeMCTS_W is between 0-1, dnn between -1 and 1
+    }
+
     //! Interface, Compute win value for MCTreeSearch, between 0-1
     //! * \param idxAi ID of player who executes function
     CUDA_CALLABLE_MEMBER double computeMCTS_W(int idxAi) const {
@@ -669,6 +745,15 @@ public:
         //    return 1.0-win; // opponent is trying to minimalize win rate of current player
     }
 
+    //! Result of the finished game for player idxAi: 1 won, -1 lost, 0 even or not finished
+    int getResult(int idxAi) const {
+        bool lostMe = figures[idxAi*16].type == Figure::Unset;
+        bool lostOp = figures[((idxAi+1)%2)*16].type == Figure::Unset;
+        if (lostMe == lostOp)
+            return 0;
+        return lostOp ? 1 : -1;
+    }
+
     std::string getEndOfGameString() const {
         if (figures[0].type == Figure::Unset && figures[16].type == Figure::Unset)
             return std::string("Even!");
@@ -713,10 +798,24 @@ public:
         return static_cast<std::string>(act);
     }
 
+    ///! Interface of MCTSEngine, long algebraic notation of uci, e.g. e2e4 or e7e8q, game end is 0000
+    static std::string act2move(const ActType& act) {
+        if (act.type == ActType::CheckMate || act.type == ActType::Even)
+            return std::string("0000");
+        std::string str(static_cast<std::string>(act));
+        std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c){ return char(::tolower(c)); });
+        const char promotion[] = {'q', 'r', 'b', 'n'}; // PromoteQ, PromoteR, PromoteB, PromoteK
+        if (act.type >= ActType::PromoteQ && act.type <= ActType::PromoteK)
+            str.push_back(promotion[act.type - ActType::PromoteQ]);
+        return str;
+    }
+
     ///! Test function
     static bool test_actions() {
         zmq::context_t dummy(1);
-        Chess chess(dummy, "", "");
+        ZMQSocketPool sockets(dummy);
+        DNNPlayers players(sockets, "", "");
+        Chess chess(players);
         for(int i = 0; i < 32; ++i) {
             chess.figures[i].type = Figure::Unset;
         }
@@ -739,6 +838,7 @@ public:
         chess.figures[16+8+4].posX = 1;
         chess.figures[16+8+4].posY = 4;
         chess.figures[16+8+4].firstMoved = 2;
+        chess.restartHistory();
         ActType actions[Chess::MaxActions];
         ActCounterType nActions = chess.getPossibleActions(0, 0, actions);
 
@@ -794,6 +894,155 @@ public:
         return true;
     }
 
+    ///! Test function, set up board from FEN string
+    /*!
+    * \details King is placed to index 0, rooks with castling rights to index 2 and 3.
+    *          Other figures take their slot of the initial state, or any free slot of their player.
+    *          Figures which cannot be proven unmoved are marked as moved before time 0.
+    * \return False if the string could not be parsed
+    */
+    bool setBoardFEN(const std::string& fen) {
+        std::istringstream ss(fen);
+        std::string placement, side, castling, passant;
+        int halfmove = 0, fullmove = 1;
+        if (!(ss >> placement >> side >> castling >> passant))
+            return false;
+        ss >> halfmove >> fullmove;
+
+        struct Placed { int x, y, player; Figure::Type type; };
+        std::vector<Placed> placed;
+        const std::string types("?pnbrqk"); // index is Figure::Type
+        int x = 0;
+        int y = 7;
+        for (size_t i = 0; i < placement.size(); ++i) {
+            char c = placement[i];
+            if (c == '/') {
+                --y;
+                x = 0;
+            } else if (std::isdigit(c)) {
+                x += c-'0';
+            } else {
+                size_t type = types.find(char(std::tolower(c)));
+                if (type == std::string::npos || type == 0 || x >= 8 || y < 0)
+                    return false;
+                Placed p = {x++, y, std::isupper(c) ? 0 : 1, Figure::Type(type)};
+                placed.push_back(p);
+            }
+        }
+
+        for (int i = 0; i < 32; ++i) {
+            figures[i] = FigureSparse();
+            figures[i].playerIdx = i/16;
+            figures[i].posX = figures[i].posY = 0;
+            figures[i].firstMoved = 0;
+        }
+        time = 2*(fullmove-1) + (side == "b" ? 1 : 0);
+        timeLastProgress = time - halfmove;
+        timeFirst = time;
+
+        // slots of the initial state for each type
+        const int slotFirst[] = {0, 8, 4, 6, 2, 1, 0};
+        const int slotLast[]  = {0, 15, 5, 7, 3, 1, 0};
+        const char rights[2][2] = {{'Q', 'K'}, {'q', 'k'}};
+        for (int pass = 0; pass < 2; ++pass) {
+            for (size_t i = 0; i < placed.size(); ++i) {
+                const Placed& p = placed[i];
+                const int homeY = p.player == 0 ? 0 : 7;
+                bool canL = castling.find(rights[p.player][0]) != std::string::npos;
+                bool canR = castling.find(rights[p.player][1]) != std::string::npos;
+                bool isCastlingRook = p.type == Figure::Rook && p.y == homeY && ((p.x == 0 && canL) || (p.x == 7 && canR));
+                bool isFixed = p.type == Figure::King || isCastlingRook;
+                if (isFixed != (pass == 0))
+                    continue; // king and castling rooks take their slots first
+                int slot = -1;
+                if (p.type == Figure::King)
+                    slot = 0;
+                else if (isCastlingRook)
+                    slot = p.x == 0 ? 2 : 3;
+                for (int s = slotFirst[p.type]; slot < 0 && s <= slotLast[p.type]; ++s) {
+                    if (figures[p.player*16+s].type == Figure::Unset)
+                        slot = s;
+                }
+                for (int s = 1; slot < 0 && s < 16; ++s) {
+                    if (figures[p.player*16+s].type == Figure::Unset)
+                        slot = s;
+                }
+                if (slot < 0 || figures[p.player*16+slot].type != Figure::Unset)
+                    return false;
+                FigureSparse& fig = figures[p.player*16+slot];
+                fig.type = p.type;
+                fig.posX = p.x;
+                fig.posY = p.y;
+                fig.firstMoved = -1;
+                if (isCastlingRook || (p.type == Figure::King && (canL || canR)))
+                    fig.firstMoved = 0;
+                if (p.type == Figure::Pawn && p.y == (p.player == 0 ? 1 : 6))
+                    fig.firstMoved = 0;
+            }
+        }
+        if (figures[0].type != Figure::King || figures[16].type != Figure::King)
+            return false;
+
+        if (passant != "-") {
+            // pawn passed the square in the last turn
+            int px = passant[0]-'a';
+            int py = passant[1]-'1' + (side == "b" ? 1 : -1);
+            for (int i = 0; i < 32; ++i) {
+                if (figures[i].type == Figure::Pawn && figures[i].posX == px && figures[i].posY == py)
+                    figures[i].firstMoved = time;
+            }
+        }
+        pushHistory();
+        return true;
+    }
+
+    ///! Test function, count leaf nodes of the move tree, game over has no moves
+    static unsigned long long perft(const Chess& chess, int depth) {
+        if (depth == 0)
+            return 1;
+        ActType actions[MaxActions];
+        int player = chess.getPlayer();
+        ActCounterType nActions = chess.getPossibleActions(player, player, actions);
+        if (nActions == 1 && (actions[0].type == ActType::CheckMate || actions[0].type == ActType::Even))
+            return 0;
+        if (depth == 1)
+            return nActions;
+        unsigned long long nodes = 0;
+        for (ActCounterType i = 0; i < nActions; ++i) {
+            Chess next(chess);
+            next.update(actions[i]);
+            nodes += perft(next, depth-1);
+        }
+        return nodes;
+    }
+
+    ///! Test function, compare move generation with reference perft counts
+    /*!
+    * \details Positions and counts from https://www.chessprogramming.org/Perft_Results
+    *          They cover castling, en passant, promotions, pins and checks.
+    */
+    static bool test_perft() {
+        struct Case { const char* fen; int depth; unsigned long long nodes; };
+        const Case cases[] = {
+            {"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", 4, 197281},
+            {"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", 3, 97862},
+            {"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", 4, 43238},
+            {"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", 3, 9467},
+            {"rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8", 3, 62379},
+        };
+        zmq::context_t dummy(1);
+        ZMQSocketPool sockets(dummy);
+        for (size_t i = 0; i < sizeof(cases)/sizeof(cases[0]); ++i) {
+            DNNPlayers players(sockets, "", "");
+            Chess chess(players);
+            if (!chess.setBoardFEN(cases[i].fen))
+                return false;
+            if (perft(chess, cases[i].depth) != cases[i].nodes)
+                return false;
+        }
+        return true;
+    }
+
     ///! Test function
     void setDebugBoard(int m) {
         if (m == 0)
@@ -806,6 +1055,7 @@ public:
             figures[2].type = Figure::Rook;
             figures[3].type = Figure::Rook;
             figures[16+0].type = Figure::King;
+            restartHistory();
             ActType move;
             move = ActType(0,0,5,1);
             update(move);
@@ -840,6 +1090,7 @@ public:
             figures[4].type = Figure::Knight;
             figures[16+0].type = Figure::King;
             figures[16+8].type = Figure::Pawn;
+            restartHistory();
             ActType move;
             move = ActType(4,0,5,0);
             update(move);
@@ -858,6 +1109,7 @@ public:
             figures[16+0].type = Figure::King;
             figures[16+4].type = Figure::Knight;
             figures[16+8+7].type = Figure::Pawn;
+            restartHistory();
             ActType move;
             move = ActType(4,0,5,7);
             update(move);
@@ -914,6 +1166,7 @@ public:
             figures[16+8+7].firstMoved = 2;
 
             time = 2;
+            restartHistory();
         }
 
         if (m == 5) {
@@ -985,6 +1238,7 @@ public:
             figures[16+8+6].firstMoved = 0;
 
             time = 2;
+            restartHistory();
         }
     }
 };
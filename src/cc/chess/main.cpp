@@ -9,6 +9,10 @@
 
 #include "mcts.hpp"
 #include "chess.hpp"
+#include "batchqueue.hpp"
+#include "engine.hpp"
+#include "ponder.hpp"
+#include "rootparallel.hpp"
 
 #ifdef __linux__
 #include <ctime>
@@ -25,10 +29,11 @@ int getSeed() {
 #endif
 
 #ifdef _OPENMP
-typedef MCTS<Chess, MCTSNodeBaseMT<Chess::ActType> > MCTSDef;
+typedef MCTS<Chess, MCTSNodeBaseMT<Chess::ActType>, MCTSStorageArena> MCTSDef;
 #else
-typedef MCTS<Chess, MCTSNodeBase<Chess::ActType> > MCTSDef;
+typedef MCTS<Chess, MCTSNodeBase<Chess::ActType>, MCTSStorageArena> MCTSDef;
 #endif
+typedef MCTSRootParallel<MCTSDef, Chess> RootParallelDef;
 
 Chess::ActType getCmdInput(const Chess& state, int player) {
     bool valid = false;
@@ -91,15 +96,63 @@ int main(int argc, char** argv) {
     auto timestamp = std::time(0);
     unsigned int seed = getSeed();
     unsigned int policyIter[2] = {1600, 1600};
+    unsigned int virtualLoss = 0;
+    unsigned int batchSize = 1;
+    unsigned int batchTimeout = 1000;
+    unsigned int transpositions = 0;
+    unsigned int evalCache = 0;
+    std::string wireName = "dense";
+    std::string evaluatorName = "zmq";
+    unsigned int evalLatency = 0;
+    std::string telemetryPath = "";
+    unsigned int timeLimit = 0;
+    size_t nodeLimit = 0;
+    bool earlyStop = false;
+    unsigned int rollouts = 0;
+    unsigned int rolloutDepth = 0;
+    unsigned int rolloutThreads = 1;
+    unsigned int rootTrees = 1;
+    std::string rootWorkers = "";
+    std::string serveRoot = "";
+    std::string samplesEndpoint = "tcp://localhost:5557";
+    std::string snapshotPath = "";
+    std::string books[2] = {"", ""};
+    bool engineMode = false;
+    bool ponder = false;
 
     if (argc == 2 && (argv[1] == std::string("-h") || argv[1] == std::string("--help"))) {
         std::cout << "Paramaters:" << std::endl;
         std::cout << "deterministic 1 (deterministic, or 0 for stochastic)" << std::endl;
         std::cout << "portW tcp://localhost:5555 (port for DNN decisions)" << std::endl;
         std::cout << "portB tcp://localhost:5555 (port for DNN decisions)" << std::endl;
+        std::cout << "      ipc:///tmp/alpha4_5555 (ipc transport for DNN on the same host, not on Windows)" << std::endl;
         std::cout << "writeTree 0" << std::endl;
         std::cout << "workDir path/" << std::endl;
         std::cout << "seed 123" << std::endl;
+        std::cout << "virtualLoss 0 (virtual visits per node for multithreaded policy, 0 disables)" << std::endl;
+        std::cout << "batchSize 1 (number of states per dnn request, 1 disables batching)" << std::endl;
+        std::cout << "batchTimeout 1000 (max wait in microseconds to fill a batch)" << std::endl;
+        std::cout << "transpositions 0 (log2 of transposition table entries, states share nodes, 0 disables)" << std::endl;
+        std::cout << "evalCache 0 (number of cached dnn results for each player, 0 disables)" << std::endl;
+        std::cout << "wire dense (encoding of dnn requests: dense, compact planes, or half for compact with float16)" << std::endl;
+        std::cout << "evaluator zmq (dnn backend: zmq server at port, synthetic, or onnx, onnx-cuda, onnx-tensorrt with port as model path)" << std::endl;
+        std::cout << "evalLatency 0 (microseconds of each synthetic evaluation)" << std::endl;
+        std::cout << "telemetry path.jsonl (counters of each search as json lines, needs build with BUILD_Telemetry, empty disables)" << std::endl;
+        std::cout << "timeLimit 0 (max milliseconds per move, policy iterations are the upper bound, 0 disables)" << std::endl;
+        std::cout << "nodeLimit 0 (max nodes of the tree of each player, 0 disables)" << std::endl;
+        std::cout << "earlyStop 0 (stop deterministic search when best action cannot change)" << std::endl;
+        std::cout << "rollouts 0 (random playouts of each leaf of players with port 0, 0 evaluates by the heuristic)" << std::endl;
+        std::cout << "rolloutDepth 0 (max actions of a playout, 0 plays until finished)" << std::endl;
+        std::cout << "rolloutThreads 1 (threads of the playouts of one leaf, needs a search with one thread)" << std::endl;
+        std::cout << "rootTrees 1 (independent trees of each player, threads are shared, root statistics are merged)" << std::endl;
+        std::cout << "rootWorkers tcp://host:5560,tcp://host2:5560 (remote trees of each player, empty disables)" << std::endl;
+        std::cout << "serveRoot tcp://*:5560 (run as remote trees of rootWorkers, one per player with its settings)" << std::endl;
+        std::cout << "samples tcp://localhost:5557 (database server of training samples of stochastic games, 0 disables)" << std::endl;
+        std::cout << "snapshot path (binary snapshot of the tree of each player after the game, path_player_0.mcts, empty disables)" << std::endl;
+        std::cout << "book0 path.mcts (snapshot of player0 to warm start its tree, e.g. a searched opening, empty disables)" << std::endl;
+        std::cout << "book1 path.mcts" << std::endl;
+        std::cout << "engine 0 (1 stays resident and answers uci on stdin/stdout, other output goes to stderr)" << std::endl;
+        std::cout << "ponder 0 (ai keeps searching while the opponent thinks, best against a human or a remote opponent)" << std::endl;
         std::cout << "p0 100 (policy iteration for player0, zero for human player)" << std::endl;
         std::cout << "p[1] 100" << std::endl;
         return 0;
@@ -119,6 +172,54 @@ int main(int argc, char** argv) {
             isDeterministic = (val != "0");
         } else if (key == "seed") {
             seed = std::stoi(val);
+        } else if (key == "virtualLoss") {
+            virtualLoss = std::stoi(val);
+        } else if (key == "batchSize") {
+            batchSize = std::stoi(val);
+        } else if (key == "batchTimeout") {
+            batchTimeout = std::stoi(val);
+        } else if (key == "transpositions") {
+            transpositions = std::stoi(val);
+        } else if (key == "evalCache") {
+            evalCache = std::stoi(val);
+        } else if (key == "wire") {
+            wireName = val;
+        } else if (key == "evaluator") {
+            evaluatorName = val;
+        } else if (key == "evalLatency") {
+            evalLatency = std::stoi(val);
+        } else if (key == "telemetry") {
+            telemetryPath = val;
+        } else if (key == "timeLimit") {
+            timeLimit = std::stoi(val);
+        } else if (key == "nodeLimit") {
+            nodeLimit = std::stoull(val);
+        } else if (key == "earlyStop") {
+            earlyStop = (val != "0");
+        } else if (key == "rollouts") {
+            rollouts = std::stoi(val);
+        } else if (key == "rolloutDepth") {
+            rolloutDepth = std::stoi(val);
+        } else if (key == "rolloutThreads") {
+            rolloutThreads = std::stoi(val);
+        } else if (key == "rootTrees") {
+            rootTrees = std::max(std::stoi(val), 1);
+        } else if (key == "rootWorkers") {
+            rootWorkers = val;
+        } else if (key == "serveRoot") {
+            serveRoot = val;
+        } else if (key == "snapshot") {
+            snapshotPath = val;
+        } else if (key == "book0") {
+            books[0] = val;
+        } else if (key == "book1") {
+            books[1] = val;
+        } else if (key == "engine") {
+            engineMode = (val != "0");
+        } else if (key == "ponder") {
+            ponder = (val != "0");
+        } else if (key == "samples") {
+            samplesEndpoint = val;
         } else if (key == "workDir") {
             workDir = val;
         } else if (key == "portW") {
@@ -135,10 +236,34 @@ int main(int argc, char** argv) {
         }
     }
 
+    std::ostream protocol(std::cout.rdbuf()); // uci of the engine, other output goes to stderr
+    if (engineMode)
+        std::cout.rdbuf(std::cerr.rdbuf());
     std::cout << "Seed " << seed << std::endl;
     std::cout << "Port White: " << portWhite << std::endl;
     std::cout << "Port Black: " << portBlack << std::endl;
     std::cout << "Deterministic: " << isDeterministic << std::endl;
+    std::cout << "Virtual Loss: " << virtualLoss << std::endl;
+    std::cout << "Batch Size: " << batchSize << std::endl;
+    std::cout << "Transpositions: " << transpositions << std::endl;
+    std::cout << "Eval Cache: " << evalCache << std::endl;
+    std::cout << "Wire Format: " << wireName << std::endl;
+    std::cout << "Evaluator: " << evaluatorName << std::endl;
+    std::cout << "Telemetry: " << (telemetryPath.empty() ? "Disabled" : telemetryPath) << std::endl;
+    if (!telemetryPath.empty() && !MCTSTelemetry::Enabled)
+        std::cout << "Built without telemetry, no counters are written" << std::endl;
+    std::cout << "Time Limit: " << timeLimit << " ms" << std::endl;
+    std::cout << "Node Limit: " << nodeLimit << " (" << nodeLimit * MCTSDef::getNodeBytes() / (1024*1024) << " MB)" << std::endl;
+    std::cout << "Early Stop: " << earlyStop << std::endl;
+    std::cout << "Rollouts: " << rollouts << " Depth: " << rolloutDepth << " Threads: " << rolloutThreads << std::endl;
+    std::cout << "Root Trees: " << rootTrees << " Workers: " << (rootWorkers.empty() ? "Disabled" : rootWorkers) << std::endl;
+    std::cout << "Samples: " << (isDeterministic || samplesEndpoint == "0" ? "Disabled" : samplesEndpoint) << std::endl;
+    std::cout << "Snapshot: " << (snapshotPath.empty() ? "Disabled" : snapshotPath) << std::endl;
+    for (int p = 0; p < 2; ++p) {
+        if (!books[p].empty())
+            std::cout << "P" << p << " Book: " << books[p] << std::endl;
+    }
+    std::cout << "Engine: " << engineMode << " Ponder: " << ponder << std::endl;
     std::cout << "Results at: " << (writeTree == 0 ? "Disabled" : workDir) << std::endl;
     for (int i = 0; i < 2; ++i) {
         std::cout << "P" << i << " PIter: " << policyIter[i] << std::endl;
@@ -146,27 +271,137 @@ int main(int argc, char** argv) {
 
     // init program
     zmq::context_t zmq_context(16);
+    ZMQSocketPool sockets(zmq_context);
     std::vector<Chess::ActType> history;
-    Chess state(zmq_context, portWhite, portBlack);
+    DNNPlayers players(sockets, portWhite, portBlack); // dnn settings, shared by all copies of state
+    Chess state(players);
+    DNNWireFormat wire(DNNWireFormat::parseMode(wireName), Chess::PlaneSize);
+    players.setWireFormat(0, wire);
+    players.setWireFormat(1, wire);
+    std::unique_ptr<DNNEvaluator> evaluators[2]; // dnn backend for each player
+    std::unique_ptr<DNNBatchQueue> queues[2]; // batched dnn evaluation for each player
+    {
+        const std::string ports[2] = {portWhite, portBlack};
+        for (int p = 0; p < 2; ++p) {
+            if (ports[p] == "0")
+                continue; // no dnn
+            evaluators[p] = createDNNEvaluator(evaluatorName, sockets, ports[p], wire, Chess::PlaneSize+1,
+                                               Chess::PlaneHeight, Chess::PlaneSize/Chess::PlaneHeight, evalLatency);
+            if (batchSize > 1)
+                queues[p].reset(new DNNBatchQueue(*evaluators[p], batchSize, batchTimeout));
+            players.setEvaluator(p, queues[p] ? queues[p].get() : evaluators[p].get());
+        }
+    }
+    std::unique_ptr<DNNEvalCache> caches[2]; // cached dnn results for each player
+    if (evalCache > 0) {
+        const std::string ports[2] = {portWhite, portBlack};
+        for (int p = 0; p < 2; ++p) {
+            if (ports[p] == "0")
+                continue; // no dnn
+            caches[p].reset(new DNNEvalCache(evalCache));
+            players.setEvalCache(p, caches[p].get());
+        }
+    }
+    std::ofstream telemetryFile;
+    std::unique_ptr<MCTSTelemetrySink> telemetry;
+    if (!telemetryPath.empty()) {
+        telemetryFile.open(telemetryPath);
+        telemetry.reset(new MCTSTelemetrySink(telemetryFile));
+    }
+    std::unique_ptr<MCTSRollout<Chess> > rollout; // playouts of pure mcts, shared by all trees
+    if (rollouts > 0)
+        rollout.reset(new MCTSRollout<Chess>(rollouts, rolloutDepth, rolloutThreads, seed));
+    std::unique_ptr<MCTSSampleStream> samples; // training samples of the first tree of each player
+    if (!isDeterministic && samplesEndpoint != "0")
+        samples.reset(new MCTSSampleStream(zmq_context, samplesEndpoint));
+    auto configure = [&](MCTSDef& tree, int p) {
+        tree.setVirtualLoss(virtualLoss, state.getLostValue(p));
+        tree.setTranspositionTable(transpositions);
+        tree.setKeepHistory(writeTree != 0 || !snapshotPath.empty()); // writeResults and snapshot need the whole tree
+        tree.setTimeLimit(timeLimit);
+        tree.setNodeLimit(nodeLimit);
+        tree.setEarlyStop(earlyStop);
+        tree.setTelemetry(telemetry.get(), p == 0 ? "white" : "black");
+        if ((p == 0 ? portWhite : portBlack) == "0")
+            tree.setRollout(rollout.get());
+    };
     std::array<MCTSDef, 2> ai = {seed, seed};
-    if (!state.test_actions()) {
+    std::unique_ptr<RootParallelDef> roots[2]; // root parallel search of each player, ai is its first tree
+    std::vector<MCTSDef*> trees[2]; // local trees of each player
+    for (int p = 0; p < 2; ++p) {
+        configure(ai[p], p);
+        ai[p].setSampleStream(samples.get(), seed);
+        trees[p].push_back(&ai[p]);
+        if (rootTrees == 1 && rootWorkers.empty())
+            continue;
+        roots[p].reset(new RootParallelDef(sockets, ai[p], RootParallelDef::parseWorkers(rootWorkers)));
+        for (unsigned int t = 1; t < rootTrees; ++t) {
+            std::unique_ptr<MCTSDef> tree(new MCTSDef(seed + t));
+            configure(*tree, p);
+            tree->setVerbose(false);
+            trees[p].push_back(tree.get());
+            roots[p]->addTree(std::move(tree));
+        }
+    }
+    for (int p = 0; p < 2; ++p) {
+        if (!books[p].empty())
+            ai[p].loadSnapshot(MCTSSnapshotFile(books[p]));
+    }
+    if (!state.test_actions() || !Chess::test_perft()) {
         std::cout << "Error in logic" << std::endl;
         return -1;
     }
     state.setDebugBoard(0); // zero means no change
+    if (!serveRoot.empty()) {
+        std::cout << "Serving root parallel searches at " << serveRoot << std::endl;
+        ai[0].setVerbose(false);
+        ai[1].setVerbose(false);
+        MCTSRootWorker<MCTSDef, Chess>::serve(zmq_context, serveRoot, {&ai[0], &ai[1]}, state);
+        return 0;
+    }
+    if (engineMode) { // searches of the side to move, trees and evaluators stay hot between positions
+        auto search = [&](int player, const Chess& position, const std::vector<Chess::ActType>& moves, const MCTSEngineLimits& limits) {
+            for (MCTSDef* tree : trees[player])
+                tree->setTimeLimit(limits.movetime != 0 ? limits.movetime : timeLimit);
+            unsigned int iter = limits.iterations != 0 ? limits.iterations : policyIter[player];
+            MCTSEngine<Chess>::Result result;
+            result.action = roots[player] ? roots[player]->execute(player, isDeterministic, position, iter, moves)
+                                          : ai[player].execute(player, isDeterministic, position, iter, moves);
+            result.iterations = roots[player] ? roots[player]->getIterations() : ai[player].getIterations();
+            result.hasPonder = ai[player].getExpectedReply(result.action, result.ponder);
+            return result;
+        };
+        auto newGame = [&]() {
+            for (int p = 0; p < 2; ++p)
+                for (MCTSDef* tree : trees[p])
+                    tree->clear();
+        };
+        auto fen = [](Chess& position, const std::string& str) { return position.setBoardFEN(str); };
+        MCTSEngine<Chess> engine("MCTS Chess", state, protocol, search, newGame, fen);
+        for (int p = 0; p < 2; ++p)
+            for (MCTSDef* tree : trees[p])
+                tree->setStopFlag(engine.getStopFlag());
+        engine.run(std::cin);
+        return 0;
+    }
 
     // execute game
+    MCTSPonder<MCTSDef, Chess> ponderer; // first tree of the last ai move searches on the time of the opponent
     for (int time = 0; !state.isFinished(); ++time) {
         int player = state.getPlayer(time);
         auto t0 = std::chrono::high_resolution_clock::now();
-        Chess::ActType act =   (policyIter[player] == 0)  ?
-                               getCmdInput(state, player) :
-                               ai[player].execute(player,
-                                                  isDeterministic,
-                                                  state,
-                                                  policyIter[player],
-                                                  history);
+        Chess::ActType act;
+        if (policyIter[player] == 0)
+            act = getCmdInput(state, player);
+        else if (roots[player])
+            act = roots[player]->execute(player, isDeterministic, state, policyIter[player], history);
+        else
+            act = ai[player].execute(player, isDeterministic, state, policyIter[player], history);
         auto t1 = std::chrono::high_resolution_clock::now();
+        const MCTSDef* pondering = ponderer.getTree();
+        unsigned int pondered = ponderer.stop(); // move of the opponent has arrived
+        if (pondering != nullptr)
+            std::cout << "P" << (pondering == &ai[0] ? 0 : 1) << " Ponder: " << pondered << " iter" << std::endl;
         std::string actDesc = state.getActionDescription(act);
         state.update(act);
         history.push_back(act);
@@ -176,10 +411,25 @@ int main(int argc, char** argv) {
         std::cout << Chess::act2str(act) << " ";
         std::cout << actDesc << " ";
         std::cout << state.getBoardDescription() << " ";
-        std::cout << std::chrono::duration_cast<std::chrono::seconds>(t1-t0).count() << " sec";
+        if (policyIter[player] != 0)
+            std::cout << (roots[player] ? roots[player]->getIterations() : ai[player].getIterations()) << " iter ";
+        std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(t1-t0).count() << " ms";
         std::cout << std::endl;
+        if (ponder && policyIter[player] != 0 && !state.isFinished())
+            ponderer.start(ai[player], player, state, history);
     }
     std::cout << state.getEndOfGameString() << std::endl;
+    for (int p = 0; !snapshotPath.empty() && p < 2; ++p) {
+        std::ofstream file(snapshotPath + "_player_" + std::to_string(p) + ".mcts", std::ios::binary);
+        ai[p].writeSnapshot(file);
+        std::cout << "P" << p << " Snapshot: " << ai[p].getNodeCount() << " nodes" << std::endl;
+    }
+    if (samples)
+        samples->finish(seed, static_cast<std::uint32_t>(history.size()), state.getResult(0), state.getResult(1));
+    for (int p = 0; p < 2; ++p) {
+        if (caches[p])
+            std::cout << "P" << p << " Eval Cache Hits: " << caches[p]->hits() << " Misses: " << caches[p]->misses() << std::endl;
+    }
 
     // save tree
     for (int p = 0; p < 2; ++p) {
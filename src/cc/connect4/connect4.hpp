@@ -3,10 +3,19 @@
 
 #include <string>
 #include <vector>
+#include <cstdint>
+#include <algorithm>
 #include <sstream>
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 #include <zmq.hpp>
 
+#include "zmqpool.hpp"
+#include "dnnplayers.hpp"
+
 class Connect4 {
 public:
     struct ActType {
@@ -34,46 +43,98 @@ public:
     constexpr static double DirichletAlpha = 1.0 / 7.0; //!< interface
     constexpr static unsigned int MaxActions = 6 * 7; //!< interface
     constexpr static unsigned int MaxChildPerNode = MaxActions; //!< interface
+    constexpr static unsigned int PlaneSize = 6*7; //!< values of one plane of the dnn state, for DNNWireFormat
+    constexpr static unsigned int PlaneHeight = 6; //!< rows of one plane, width is PlaneSize/PlaneHeight
 
 private:
-    enum Figure { White=0, Black=1, Unset=2 };
-    struct Board {
-        Figure board[6*7];
-
-        Figure& operator[](int i) {
-            return board[i];
-        }
-
-        const Figure& operator[](int i) const {
-            return board[i];
-        }
-    };
-
+    //! Stones of both players as bitboards
+    /*!
+     * \details Bit of position x,y is x*7+y, each column has six rows and one empty sentinel bit.
+     *          The sentinel keeps the shifted lines of one column from wrapping into the next column.
+     */
+    typedef std::uint64_t BitBoard;
 
     int time;
-    Board board;
     bool finished[2];
-    std::vector<Board> history;
+    BitBoard stones[2]; //!< stones of players: white, black
+    std::uint_fast8_t height[7]; //!< number of stones in each column
+    std::uint8_t moves[6*7]; //!< undo stack, played column of each turn, fixed size keeps copies of the state cheap
 
-    std::string ports[2]; //!< ports for zeromq socket connections: white, black
-    zmq::context_t& zmq_context; //!< zeromq context for socket connections
+    const DNNPlayers& players; //!< dnn settings of both players, shared by all copies of the state, not owned
+    bool symmetry; //!< evaluate and cache the mirror-canonical form of states
 
     int getXY(int y, int x) const {
         return y*7+x;
     }
 
+    static BitBoard getBit(int x, int y) {
+        return BitBoard(1) << (x*7+y);
+    }
+
+    //! Returns true if bitboard has four connected stones
+    static bool isConnected(BitBoard b) {
+        const int dirs[4] = {1, 7, 6, 8}; // vertical, horizontal, diagonals
+        for (int i = 0; i < 4; ++i) {
+            BitBoard m = b & (b >> dirs[i]);
+            if (m & (m >> (2*dirs[i])))
+                return true;
+        }
+        return false;
+    }
+
+    //! Returns player index of stone at position, 2 if empty
+    int getFigure(const BitBoard* board, int x, int y) const {
+        if (board[0] & getBit(x, y))
+            return 0;
+        if (board[1] & getBit(x, y))
+            return 1;
+        return 2;
+    }
+
+    //! Set value of each stone of bitboard in plane of 6x7 values, mirror flips the columns
+    void fillPlane(BitBoard b, float* plane, bool mirror) const {
+        for (; b != 0; b &= b - 1) {
+#if defined(_MSC_VER)
+            unsigned long bit;
+            _BitScanForward64(&bit, b);
+#else
+            int bit = __builtin_ctzll(b);
+#endif
+            int x = int(bit) / 7;
+            plane[getXY(int(bit) % 7, mirror ? 6-x : x)] = 1.0f;
+        }
+    }
+
+    //! Bitboard with column x moved to column 6-x
+    static BitBoard mirrorBoard(BitBoard b) {
+        BitBoard m = 0;
+        for (int x = 0; x < 7; ++x)
+            m |= ((b >> (x*7)) & 0x7F) << ((6-x)*7);
+        return m;
+    }
+
+    //! Chain last played column and bitboards through the finalizer of splitmix64
+    static std::uint64_t hashBoard(std::uint64_t last, BitBoard white, BitBoard black) {
+        auto mix = [] (std::uint64_t x) -> std::uint64_t {
+            x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+            return x ^ (x >> 31);
+        };
+        return mix(mix(mix(last + 0x9e3779b97f4a7c15ULL) ^ black) ^ white);
+    }
+
 public:
-    //! Set initial state
-    Connect4(zmq::context_t& zmq_context, const std::string& portW, const std::string& portB)
-        : zmq_context(zmq_context)
+    //! Set initial state, players are kept by reference
+    explicit Connect4(const DNNPlayers& players)
+        : players(players)
     {
-        ports[0] = portW;
-        ports[1] = portB;
+        symmetry = false;
 
         time = 0;
         finished[0] = finished[1] = false;
-        for (int i = 0; i < 6*7; ++i)
-            board[i] = Figure::Unset;
+        stones[0] = stones[1] = 0;
+        for (int x = 0; x < 7; ++x)
+            height[x] = 0;
     }
 
     //! Interface
@@ -98,70 +159,66 @@ public:
     ActCounterType getPossibleActions(int idxMe, int idxAi, ActType* actions) const {
         ActCounterType count = 0;
         for(int x = 0; x < 7; ++x) { // left to right
-            if (board[getXY(5, x)] != int(Figure::Unset))
+            if (height[x] == 6)
                 continue; // top element not free
-            for (int y = 0; y < 6; ++y) { // from bottom to top
-                if (board[getXY(y, x)] != Figure::Unset)
-                    continue; // not free
-                actions[count].x = x;
-                actions[count].y = y;
-                ++count;
-                break; // first free element stop
-            }
+            actions[count].x = x;
+            actions[count].y = height[x];
+            ++count;
         }
         return count;
     }
 
+    //! Interface, hash of the state for the transposition table
+    /*!
+    * \details Stones identify the position, the last move is added since the dnn input contains the previous board.
+    *          Last move and bitboards are chained through the finalizer of splitmix64.
+    */
+    std::uint64_t getHash() const {
+        std::uint64_t last = time == 0 ? 7 : moves[time-1];
+        return hashBoard(last, stones[0], stones[1]);
+    }
+
+    //! Hash of the state or of its mirror image, whichever is lower, mirrored and unmirrored states share it
+    /*!
+    * \param mirrored Set if the mirror image is the canonical form, false for symmetric states
+    */
+    std::uint64_t getCanonicalHash(bool& mirrored) const {
+        std::uint64_t last = time == 0 ? 7 : moves[time-1];
+        std::uint64_t hash = hashBoard(last, stones[0], stones[1]);
+        std::uint64_t hashMirror = hashBoard(time == 0 ? 7 : 6-last, mirrorBoard(stones[0]), mirrorBoard(stones[1]));
+        mirrored = hashMirror < hash;
+        return mirrored ? hashMirror : hash;
+    }
+
     //! Interface, Update the game state according to move
     void update(ActType& act) {
         int idxAi = getPlayer();
 
-        auto getPos = [&] (int x, int y, int dx, int dy) -> int { return getXY(y+dy,x+dx); };
-        auto isInsideBoard = [&] (int x, int y, int dx, int dy) -> bool { int xx=x+dx; int yy=y+dy; return 0<=xx && xx<7 && 0<=yy && yy<6; };
-        auto isOwnStone = [&] (int x, int y, int dx, int dy) -> bool { return isInsideBoard(x,y,dx,dy) && board[getPos(x,y,dx,dy)] == Figure(idxAi); };
-
-        auto opNul = [&] (int    ) -> int { return    0; };
-        auto opPos = [&] (int val) -> int { return  val; };
-        auto opNeg = [&] (int val) -> int { return -val; };
-        auto scanLine = [&] (int x, int y, std::function<int (int)> opX, std::function<int (int)> opY) -> bool {
-            int count = 1;
-            for(int n=1; n < 7; ++n) {
-                if (!isOwnStone(x,y,opX(n),opY(n)))
-                    break;
-                ++count;
-            }
-            return count >= 4;
-        };
+        moves[time] = static_cast<std::uint8_t>(act.x);
+        stones[idxAi] |= getBit(act.x, act.y);
+        ++height[act.x];
 
-        int emptyCount = 0;
-        history.push_back(board);
-        board[getXY(act.y, act.x)] = Figure(idxAi);
-
-        for (int y = 0; y < 6; ++y) {
-            for (int x = 0; x < 7; ++x) {
-                if (board[getXY(y, x)] == Figure::Unset)
-                    ++emptyCount;
-                if (board[getXY(y, x)] != idxAi)
-                    continue;
-
-                if (scanLine(x,y,opNul,opPos))
-                    finished[idxAi] = true;
-                if (scanLine(x,y,opPos,opNul))
-                    finished[idxAi] = true;
-                if (scanLine(x,y,opPos,opPos))
-                    finished[idxAi] = true;
-                if (scanLine(x,y,opNeg,opPos))
-                    finished[idxAi] = true;
-            }
-        }
+        // board had no four connected before, so a found line goes through the new stone
+        if (isConnected(stones[idxAi]))
+            finished[idxAi] = true;
 
-        if (emptyCount == 0 && finished[0] == false && finished[1] == false)
+        if (time+1 == 6*7 && finished[0] == false && finished[1] == false)
             finished[0] = finished[1] = true; // even
 
         ++time;
     }
 
-    void getGameStateDNN(std::vector<float>& data, int idxMe) const {
+    //! Revert the last update
+    void undo() {
+        --time;
+        int x = moves[time];
+        --height[x];
+        stones[getPlayer()] &= ~getBit(x, height[x]);
+        finished[0] = finished[1] = false; // game was not finished before last move
+    }
+
+    //! Interface, dnn input of player idxMe, mirror encodes the mirror image of the state
+    void getGameStateDNN(std::vector<float>& data, int idxMe, bool mirror = false) const {
         const int T = 2;
         const int p1_piece_start = 0;
         const int p1_piece_count = T * 6 * 7;
@@ -174,22 +231,20 @@ public:
 
         int t = 0;
         int idxOp = (idxMe + 1) % 2;
-        const Board* game = &board;
+        BitBoard game[2] = {stones[0], stones[1]};
+        std::uint_fast8_t gameHeight[7];
+        std::copy(height, height+7, gameHeight);
         while (t != T && time-t>=0) {
-            for (int y = 0; y < 6; ++y) {
-                for (int x = 0; x < 7; ++x) {
-                    if (game->board[getXY(y, x)] == idxMe) {
-                        data[0*6*7+t*6*7+getXY(y, x)] = 1.0;
-                    }
-                    if (game->board[getXY(y, x)] == idxOp) {
-                        data[T*6*7+t*6*7+getXY(y, x)] = 1.0;
-                    }
-                }
-            }
+            // planes are set from the bits of the stones, without testing every position
+            fillPlane(game[idxMe], data.data()+p1_piece_start+t*6*7, mirror);
+            fillPlane(game[idxOp], data.data()+p2_piece_start+t*6*7, mirror);
 
             ++t;
-            if (time-t>=0)
-                game = &history[history.size()-t];
+            if (time-t>=0) { // remove move of time-t to get previous board
+                int x = moves[time-t];
+                --gameHeight[x];
+                game[getPlayer(time-t)] &= ~getBit(x, gameHeight[x]);
+            }
         }
         std::fill(data.data()+color_start, data.data()+color_start+color_count, idxMe);
     }
@@ -203,40 +258,45 @@ public:
         }
     }
 
-    void storeGamePolicyDNN(std::vector<float>& game, std::vector<float>& policy) const {
-        //connect socket
-        zmq::socket_t socket(zmq_context, ZMQ_REQ);
-        socket.connect("tcp://localhost:5557");
-
-        //send game
-        zmq::message_t request1(game.size()*sizeof(float));
-        memcpy(request1.data(), game.data(), game.size()*sizeof(float));
-        socket.send(request1);
-
-        //get the reply
-        char ok[2];
-        zmq::message_t reply;
-        socket.recv(&reply);
-        memcpy(ok, reply.data(), 2);
-        if (ok[0] != 4 || ok[1] != 2)
-            throw std::runtime_error("Could not store gamestate");
-
-        //send game
-        zmq::message_t request2(policy.size()*sizeof(float));
-        memcpy(request2.data(), policy.data(), policy.size()*sizeof(float));
-        socket.send(request2);
-
-        //get the reply
-        socket.recv(&reply);
-        memcpy(ok, reply.data(), 2);
-        if (ok[0] != 4 || ok[1] != 2)
-            throw std::runtime_error("Could not store gamepolicy");
+    //! Interface, turn a sample of getGameStateDNN and getPolicyTrainDNN into the sample of the mirror image
+    /*!
+    * \details Each plane is 6 rows of 7 columns, the columns of each row are reversed.
+    * \return False if the state is symmetric, i.e. the mirrored sample equals the sample
+    */
+    bool mirrorSampleDNN(std::vector<float>& state, std::vector<float>& policy) const {
+        // previous board is part of the state, last stone must be in the center column
+        bool symmetric = mirrorBoard(stones[0]) == stones[0] && mirrorBoard(stones[1]) == stones[1] &&
+                         (time == 0 || moves[time-1] == 3);
+        if (symmetric)
+            return false;
+        for (size_t row = 0; row + 7 <= state.size(); row += 7)
+            std::reverse(state.begin()+row, state.begin()+row+7);
+        for (size_t row = 0; row + 7 <= policy.size(); row += 7)
+            std::reverse(policy.begin()+row, policy.begin()+row+7);
+        return true;
+    }
+
+    //! Evaluate and cache states in their mirror-canonical form, policy is mirrored back, disabled by default
+    /*!
+    * \details Mirrored states share their cache entry, so the cache answers both with one evaluation.
+    */
+    void setSymmetry(bool enable) {
+        symmetry = enable;
+    }
+
+    //! Send state to dnn of player, result is policy logits and value
+    void evaluateDNN(int idxMe, std::vector<float>& result, bool mirror = false) const {
+        std::vector<float> state_dnn;
+        getGameStateDNN(state_dnn, idxMe, mirror);
+
+        std::vector<const std::vector<float>*> states(1, &state_dnn);
+        players.evaluate(idxMe, states, result);
     }
 
     //! Interface, Compute W and P values for MCTS
     //! * \param idxMe ID of player who executes function
     void computeMCTS_WP(int idxMe, ActType* actions, ActCounterType nActions, double* P, double& W) const {
-        if (ports[idxMe] == "0") {
+        if (!players.hasDNN(idxMe)) {
             // compute W only on end results, no dnn
             W = computeMCTS_W(idxMe);
             for (ActCounterType i = 0; i < nActions; ++i) {
@@ -245,32 +305,27 @@ public:
             return;
         }
 
-        std::vector<float> state_dnn;
-        getGameStateDNN(state_dnn, idxMe);
-
-        //connect socket
-        zmq::socket_t socket(zmq_context, ZMQ_REQ);
-        socket.connect(ports[idxMe]);
-
-        //send request
-        zmq::message_t request(state_dnn.size()*sizeof(float));
-        memcpy(request.data(), state_dnn.data(), state_dnn.size()*sizeof(float));
-        socket.send(request);
-
-        //get the reply
-        zmq::message_t reply;
-        socket.recv(&reply);
-        std::vector<float> result(reply.size() / sizeof(float));
-        memcpy(result.data(), reply.data(), reply.size());
+        std::vector<float> result;
+        bool mirror = false; // result is of the mirror image
+        std::uint64_t hash = 0;
+        DNNEvalCache* cache = players.getEvalCache(idxMe);
+        if (symmetry)
+            hash = getCanonicalHash(mirror);
+        else if (cache != NULL)
+            hash = getHash();
+        if (cache == NULL || !cache->find(hash, result)) {
+            evaluateDNN(idxMe, result, mirror);
+            if (cache != NULL && result.size() == 6*7+1)
+                cache->insert(hash, result);
+        }
         if (result.size() != 6*7+1)
             throw std::runtime_error("Bad Reply");
-        socket.close();
 
         W = result[6*7];
         double pi_sum = 0;
         for (ActCounterType i = 0; i < nActions; ++i) {
             ActType& act = actions[i];
-            P[i] = exp(result[getXY(act.y, act.x)]); //softmax
+            P[i] = exp(result[getXY(act.y, mirror ? 6-act.x : act.x)]); //softmax
             pi_sum += P[i];
         }
         // apply softmax on valid actions
@@ -279,6 +334,13 @@ public:
         }
     }
 
+    //! Interface, value of a lost game for player idxAi, e.g. the value of a virtual loss
+    //! * \param idxAi ID of player who executes function
+    double getLostValue(int idxAi) const {
+        (void)idxAi;
+        return -1.0; // computeMCTS_W and dnn are between -1 and 1
+    }
+
     double computeMCTS_W(int idxAi) const {
         int idxOp = (idxAi + 1) % 2;
         if (finished[idxAi])
@@ -288,6 +350,14 @@ public:
         return 0.0;
     }
 
+    //! Result of the finished game for player idxAi: 1 won, -1 lost, 0 even or not finished
+    int getResult(int idxAi) const {
+        int idxOp = (idxAi + 1) % 2;
+        if (finished[idxAi] == finished[idxOp])
+            return 0;
+        return finished[idxAi] ? 1 : -1;
+    }
+
     std::string getEndOfGameString() const {
         if (finished[0] && finished[1])
             return std::string("Even!");
@@ -303,7 +373,7 @@ public:
         std::stringstream str;
         for (int y = 5; y >= 0; --y) { // from top to bottom
             for(int x = 0; x < 7; ++x) { // left to right
-                str << "| " << figstr[board[getXY(y, x)]] << " ";
+                str << "| " << figstr[getFigure(stones, x, y)] << " ";
             }
             str << "|" << std::endl;
         }
@@ -314,6 +384,11 @@ public:
     static std::string act2str(ActType& act) {
         return static_cast<std::string>(act);
     }
+
+    ///! Interface of MCTSEngine, column of the stone 1..7
+    static std::string act2move(const ActType& act) {
+        return std::string(1, char(act.x)+'1');
+    }
 };
 
 #endif // CONNECT4_HPP
@@ -0,0 +1,81 @@
+#ifndef DNNPLAYERS_HPP
+#define DNNPLAYERS_HPP
+
+#include <string>
+#include <vector>
+
+#include "zmqpool.hpp"
+#include "evaluator.hpp"
+#include "evalcache.hpp"
+#include "wireformat.hpp"
+
+//! DNN settings of both players of a game, shared by all states of the problem
+/*!
+ * \details States are copied in each policy iteration, they hold the settings by reference, as the socket pool.
+ *          So a copy of a state does not copy the ports, which are longer than the small string buffer.
+ *          Settings are changed before the search, threads of the search only read them.
+ *          Each game needs its own settings if its players use other evaluators or caches than other games.
+ * \author adamp87
+*/
+class DNNPlayers {
+    ZMQSocketPool& sockets; //!< pooled socket connections, not owned
+    std::string ports[2]; //!< ports for zeromq socket connections: white, black
+    bool dnn[2]; //!< port is not "0": white, black
+    DNNEvaluator* evaluators[2]; //!< optional backend of dnn evaluation, e.g. DNNBatchQueue: white, black, not owned
+    DNNEvalCache* caches[2]; //!< optional cache of dnn results: white, black, not owned
+    DNNWireFormat wires[2]; //!< encoding of dnn requests without evaluator: white, black
+
+    DNNPlayers(const DNNPlayers&) = delete;
+
+public:
+    //! Settings of players at ports, port "0" means pure mcts without dnn
+    DNNPlayers(ZMQSocketPool& sockets, const std::string& portW, const std::string& portB)
+        : sockets(sockets)
+    {
+        ports[0] = portW;
+        ports[1] = portB;
+        for (int p = 0; p < 2; ++p) {
+            dnn[p] = ports[p] != "0";
+            evaluators[p] = NULL;
+            caches[p] = NULL;
+        }
+    }
+
+    //! Player is evaluated by dnn, otherwise by the heuristic of the problem
+    bool hasDNN(int idxPlayer) const {
+        return dnn[idxPlayer];
+    }
+
+    //! Evaluate dnn of player by a backend, e.g. a shared batch queue, NULL sends each state to the port of player
+    void setEvaluator(int idxPlayer, DNNEvaluator* evaluator) {
+        evaluators[idxPlayer] = evaluator;
+    }
+
+    //! Cache dnn results of player, NULL evaluates each state
+    void setEvalCache(int idxPlayer, DNNEvalCache* cache) {
+        caches[idxPlayer] = cache;
+    }
+
+    //! Cache of player, NULL if disabled
+    DNNEvalCache* getEvalCache(int idxPlayer) const {
+        return caches[idxPlayer];
+    }
+
+    //! Encoding of requests sent without evaluator, DNNEvaluatorZMQ has its own
+    void setWireFormat(int idxPlayer, const DNNWireFormat& wire) {
+        wires[idxPlayer] = wire;
+    }
+
+    //! Send states to dnn of player, result is a row of policy logits and value per state
+    void evaluate(int idxPlayer, const std::vector<const std::vector<float>*>& states, std::vector<float>& result) const {
+        if (evaluators[idxPlayer] != NULL) {
+            // e.g. batch queue parks thread until batch is evaluated
+            evaluators[idxPlayer]->evaluate(states, result);
+        } else {
+            //send request, get the reply
+            wires[idxPlayer].exchange(sockets, ports[idxPlayer], states, result);
+        }
+    }
+};
+
+#endif // DNNPLAYERS_HPP
@@ -0,0 +1,336 @@
+#ifndef ENGINE_HPP
+#define ENGINE_HPP
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+
+//! Limits of one search, requested by go
+struct MCTSEngineLimits {
+    unsigned int iterations; //!< policy iterations, zero uses the setting of the player
+    unsigned int movetime; //!< max milliseconds, zero uses the setting of the player
+    bool infinite; //!< search until stop
+};
+
+//! Resident engine process, speaks UCI on a stream, e.g. stdin and stdout
+/*!
+ * \details Commands: uci, isready, ucinewgame, position startpos|fen ... [moves ...], go, stop, ponderhit, quit.
+ *          go takes movetime, nodes (policy iterations), wtime, btime, winc, binc, movestogo, infinite and ponder.
+ *          A search with a time and without nodes runs until the time is spent, without both it takes the settings of the player.
+ *          go ponder searches the position with the expected move of the opponent until stop or ponderhit,
+ *          at ponderhit the search continues with the limits of go on the same tree, so the pondered visits are kept.
+ *          bestmove tells the expected reply as ponder move, if the search callback knows it.
+ *          Moves are written by act2move of the problem, e.g. e2e4 and e7e8q in chess or the column 1..7 in Connect4,
+ *          so the same protocol drives both problems, position fen needs a parser of the problem.
+ *          Searches run on a worker thread, so stop and isready are answered while searching, each search ends with bestmove.
+ *          Other commands wait for the bestmove of the running search, only an infinite search is stopped by them.
+ *          Trees are owned by the caller, search and newGame are callbacks, the stop flag is shared with the trees.
+ *          A position which continues the previous one keeps the trees, any other position starts a new game.
+ *          So trees, evaluators and caches stay hot between searches, only ucinewgame and other positions release trees.
+ * \author adamp87
+*/
+template <class TProblem>
+class MCTSEngine {
+public:
+    typedef typename TProblem::ActType ActType;
+
+    //! Action and policy iterations of one search
+    struct Result {
+        ActType action;
+        unsigned int iterations;
+        bool hasPonder; //!< ponder is set
+        ActType ponder; //!< expected reply of the opponent, e.g. MCTS::getExpectedReply
+    };
+
+    typedef std::function<Result(int player, const TProblem& state, const std::vector<ActType>& history, const MCTSEngineLimits& limits)> SearchFunction;
+    typedef std::function<void()> NewGameFunction;
+    typedef std::function<bool(TProblem& state, const std::string& fen)> FENFunction;
+
+    constexpr static unsigned int MoveOverhead = 50; //!< milliseconds kept for the protocol when the clock is given
+    constexpr static unsigned int MovesToGo = 30; //!< expected moves of the game, if go does not tell
+
+private:
+    const std::string name;
+    const TProblem initial; //!< state of startpos
+    SearchFunction search;
+    NewGameFunction newGame;
+    FENFunction fen; //!< empty if the problem has no fen
+
+    std::unique_ptr<TProblem> state; //!< state of the current position
+    std::vector<ActType> history; //!< actions from the base position to state
+    std::string base; //!< startpos or fen of the current position
+
+    std::ostream& out;
+    std::mutex outLock; //!< lines of the worker and the reader are not mixed
+    std::atomic<bool> stopping; //!< set by stop and ponderhit, read by the trees, see MCTS::setStopFlag
+    bool infinite; //!< running search ends only by stop, or ponderhit when pondering
+    std::mutex stopLock; //!< guards stopRequested and ponderHit
+    bool stopRequested; //!< stop of the running search
+    bool ponderHit; //!< opponent played the pondered move
+    std::condition_variable stopped; //!< wakes an infinite search which has spent its budget
+    std::thread worker;
+
+    MCTSEngine(const MCTSEngine&) = delete;
+
+    void send(const std::string& line) {
+        std::lock_guard<std::mutex> guard(outLock);
+        out << line << std::endl;
+    }
+
+    //! Stop the running search and wait for its bestmove
+    void stop() {
+        {
+            std::lock_guard<std::mutex> guard(stopLock);
+            stopRequested = true;
+            stopping = true;
+        }
+        stopped.notify_all();
+        if (worker.joinable())
+            worker.join();
+    }
+
+    //! Pondered move was played, search on the clock
+    void ponderhit() {
+        {
+            std::lock_guard<std::mutex> guard(stopLock);
+            ponderHit = true;
+            stopping = true; // ends the search of ponder, the worker searches again
+        }
+        stopped.notify_all();
+    }
+
+    //! Wait for the bestmove of the running search, an infinite search is stopped
+    void finish() {
+        if (infinite)
+            stop();
+        else if (worker.joinable())
+            worker.join();
+    }
+
+    //! Find the legal action written as move
+    bool parseMove(const std::string& move, ActType& act) const {
+        ActType actions[TProblem::MaxActions];
+        int player = state->getPlayer();
+        auto nActions = state->getPossibleActions(player, player, actions);
+        for (decltype(nActions) i = 0; i < nActions; ++i) {
+            if (TProblem::act2move(actions[i]) == move) {
+                act = actions[i];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //! position startpos|fen ... [moves ...]
+    void position(std::istringstream& tokens) {
+        std::string token;
+        std::string nextBase;
+        tokens >> token;
+        if (token == "fen") {
+            while (tokens >> token && token != "moves")
+                nextBase += (nextBase.empty() ? "" : " ") + token;
+        } else if (token == "startpos") {
+            nextBase = token;
+            tokens >> token; // moves
+        } else {
+            send("info string unknown position " + token);
+            return;
+        }
+
+        std::unique_ptr<TProblem> next(new TProblem(initial));
+        if (nextBase != "startpos" && (!fen || !fen(*next, nextBase))) {
+            send("info string invalid fen " + nextBase);
+            return;
+        }
+        state.swap(next);
+        std::vector<ActType> nextHistory;
+        while (tokens >> token) {
+            ActType act;
+            if (!parseMove(token, act)) {
+                send("info string illegal move " + token);
+                break;
+            }
+            state->update(act);
+            nextHistory.push_back(act);
+        }
+
+        // trees are rooted in the history, they are kept if the position continues it
+        bool continues = nextBase == base && nextHistory.size() >= history.size() &&
+                         std::equal(history.begin(), history.end(), nextHistory.begin());
+        if (!continues)
+            newGame();
+        base = nextBase;
+        history.swap(nextHistory);
+    }
+
+    //! Milliseconds of a search of player from the clock, zero if go has no clock
+    static unsigned int budget(unsigned int time, unsigned int inc, unsigned int movestogo) {
+        if (time == 0)
+            return 0;
+        unsigned int share = time / std::max(movestogo, 1u) + inc * 3 / 4;
+        unsigned int latest = time > MoveOverhead ? time - MoveOverhead : 1;
+        return std::max(std::min(share, latest), 1u);
+    }
+
+    //! Search on the worker thread, send its bestmove
+    void work(int player, const MCTSEngineLimits& limits, bool ponder) {
+        auto t0 = std::chrono::steady_clock::now();
+        Result result;
+        if (ponder) {
+            MCTSEngineLimits unlimited = {std::numeric_limits<unsigned int>::max(), 0, true};
+            result = search(player, *state, history, unlimited);
+            std::unique_lock<std::mutex> guard(stopLock);
+            stopped.wait(guard, [this] { return stopRequested || ponderHit; });
+            if (!stopRequested) { // clock of the engine runs from ponderhit
+                stopping = false;
+                guard.unlock();
+                t0 = std::chrono::steady_clock::now();
+                result = search(player, *state, history, limits);
+            }
+        } else {
+            result = search(player, *state, history, limits);
+        }
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+        if (limits.infinite) { // bestmove is sent after stop
+            std::unique_lock<std::mutex> guard(stopLock);
+            stopped.wait(guard, [this] { return stopRequested; });
+        }
+        std::stringstream info;
+        info << "info nodes " << result.iterations << " time " << ms
+             << " nps " << (ms != 0 ? result.iterations * 1000ull / ms : result.iterations);
+        send(info.str());
+        send("bestmove " + TProblem::act2move(result.action) +
+             (result.hasPonder ? " ponder " + TProblem::act2move(result.ponder) : std::string()));
+    }
+
+    //! go [movetime ms] [nodes n] [wtime ms] [btime ms] [winc ms] [binc ms] [movestogo n] [infinite] [ponder]
+    void go(std::istringstream& tokens) {
+        MCTSEngineLimits limits = {0, 0, false};
+        bool ponder = false;
+        unsigned int time[2] = {0, 0};
+        unsigned int inc[2] = {0, 0};
+        unsigned int movestogo = MovesToGo;
+        std::string token;
+        while (tokens >> token) {
+            if (token == "infinite" || token == "ponder") {
+                limits.infinite = limits.infinite || token == "infinite";
+                ponder = ponder || token == "ponder";
+                continue;
+            }
+            unsigned int value = 0;
+            if (!(tokens >> value))
+                break;
+            if (token == "movetime")
+                limits.movetime = std::max(value, 1u);
+            else if (token == "nodes")
+                limits.iterations = std::max(value, 1u);
+            else if (token == "wtime")
+                time[0] = std::max(value, 1u);
+            else if (token == "btime")
+                time[1] = std::max(value, 1u);
+            else if (token == "winc")
+                inc[0] = value;
+            else if (token == "binc")
+                inc[1] = value;
+            else if (token == "movestogo")
+                movestogo = value;
+        }
+        const int player = state->getPlayer();
+        if (limits.movetime == 0)
+            limits.movetime = budget(time[player], inc[player], movestogo);
+        if (limits.movetime != 0 && limits.iterations == 0)
+            limits.iterations = std::numeric_limits<unsigned int>::max(); // time is the limit
+        if (limits.infinite) {
+            limits.iterations = std::numeric_limits<unsigned int>::max();
+            limits.movetime = 0;
+        }
+        if (state->isFinished()) {
+            send("bestmove 0000");
+            return;
+        }
+
+        stopping = false;
+        stopRequested = false;
+        ponderHit = false;
+        infinite = limits.infinite || ponder;
+        worker = std::thread(&MCTSEngine::work, this, player, limits, ponder);
+    }
+
+public:
+    //! Engine of the problem
+    /*!
+    * \param name Name sent to uci
+    * \param initial State of startpos, copied
+    * \param out Stream of the protocol, e.g. stdout, other output of the program should be on another stream
+    * \param search Runs the search of player on the trees, it should stop when getStopFlag is set
+    * \param newGame Releases the trees, e.g. MCTS::clear
+    * \param fen Sets a state from fen, empty if the problem has none
+    */
+    MCTSEngine(const std::string& name, const TProblem& initial, std::ostream& out,
+               SearchFunction search, NewGameFunction newGame, FENFunction fen = FENFunction())
+        : name(name), initial(initial), search(search), newGame(newGame), fen(fen),
+          state(new TProblem(initial)), base("startpos"), out(out), stopping(false), infinite(false), stopRequested(false), ponderHit(false)
+    {}
+
+    ~MCTSEngine() {
+        stop();
+    }
+
+    //! Flag of the trees to stop the running search, see MCTS::setStopFlag
+    const std::atomic<bool>* getStopFlag() const {
+        return &stopping;
+    }
+
+    //! Answer commands of in until quit or end of the stream
+    void run(std::istream& in) {
+        std::string line;
+        while (std::getline(in, line)) {
+            std::istringstream tokens(line);
+            std::string command;
+            tokens >> command;
+            if (command == "uci") {
+                send("id name " + name);
+                send("id author adamp87");
+                send("option name Ponder type check default false");
+                send("uciok");
+            } else if (command == "isready") {
+                send("readyok");
+            } else if (command == "ucinewgame") {
+                finish();
+                state.reset(new TProblem(initial));
+                history.clear();
+                base = "startpos";
+                newGame();
+            } else if (command == "position") {
+                finish();
+                position(tokens);
+            } else if (command == "go") {
+                finish();
+                go(tokens);
+            } else if (command == "stop") {
+                stop();
+            } else if (command == "ponderhit") {
+                ponderhit();
+            } else if (command == "setoption") {
+                // Ponder only tells that the gui sends go ponder, other settings are parameters of the program
+            } else if (command == "quit") {
+                break;
+            } else if (!command.empty()) {
+                send("info string unknown command " + command);
+            }
+        }
+        stop();
+    }
+};
+
+#endif // ENGINE_HPP
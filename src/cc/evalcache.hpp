@@ -0,0 +1,112 @@
+#ifndef EVALCACHE_HPP
+#define EVALCACHE_HPP
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include <iterator>
+#include <algorithm>
+#include <unordered_map>
+
+//! Bounded cache of DNN results keyed by the hash of the evaluated state
+/*!
+ * \details Stores the raw reply of the dnn server, i.e. policy logits and value, so a hit skips encoding and the round trip.
+ *          Entries are split into shards by the high bits of the key, each shard is an LRU list guarded by its own mutex.
+ *          When a shard is full, its least recently used entry is replaced.
+ *          The key must cover everything the dnn input depends on, e.g. getHash of the problem.
+ *          A cache belongs to one dnn and one perspective (idxMe), since the reply depends on both.
+ *          It must be owned outside of the problem, because problem states are copied for each policy iteration.
+ * \author adamp87
+*/
+class DNNEvalCache {
+    typedef std::pair<std::uint64_t, std::vector<float> > Entry;
+
+    //! Part of the cache with its own lock
+    struct Shard {
+        std::mutex lock; //!< guards lru and index
+        std::list<Entry> lru; //!< entries, most recently used first
+        std::unordered_map<std::uint64_t, std::list<Entry>::iterator> index; //!< position of key in lru
+    };
+
+    size_t capacity; //!< max number of entries per shard
+    std::vector<std::unique_ptr<Shard> > shards;
+    std::atomic<std::uint64_t> nHits;
+    std::atomic<std::uint64_t> nMisses;
+
+    DNNEvalCache(const DNNEvalCache&) = delete;
+
+    Shard& getShard(std::uint64_t key) {
+        // low bits are used by the buckets of the map
+        return *shards[static_cast<size_t>(key >> 32) % shards.size()];
+    }
+
+public:
+    //! Create cache
+    /*!
+    * \param size Max number of cached results
+    * \param nShards Number of independently locked parts, should be above the number of threads
+    */
+    DNNEvalCache(size_t size, size_t nShards = 64)
+        : nHits(0), nMisses(0)
+    {
+        nShards = std::max<size_t>(std::min(nShards, size), 1);
+        capacity = std::max<size_t>(size / nShards, 1);
+        for (size_t i = 0; i < nShards; ++i) {
+            shards.emplace_back(new Shard());
+            shards.back()->index.reserve(capacity);
+        }
+    }
+
+    //! Copy cached result of key to result, return false if not cached, thread-safe
+    bool find(std::uint64_t key, std::vector<float>& result) {
+        Shard& shard = getShard(key);
+        {
+            std::lock_guard<std::mutex> guard(shard.lock);
+            auto it = shard.index.find(key);
+            if (it != shard.index.end()) {
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second); // mark as recently used
+                result = it->second->second;
+                nHits.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        nMisses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    //! Store result of key, replaces least recently used entry of a full shard, thread-safe
+    void insert(std::uint64_t key, const std::vector<float>& result) {
+        Shard& shard = getShard(key);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) { // evaluated by another thread in the meantime
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+            return;
+        }
+        if (shard.lru.size() < capacity) {
+            shard.lru.emplace_front(key, result);
+        } else { // reuse memory of the oldest entry
+            shard.lru.splice(shard.lru.begin(), shard.lru, std::prev(shard.lru.end()));
+            shard.index.erase(shard.lru.front().first);
+            shard.lru.front().first = key;
+            shard.lru.front().second = result;
+        }
+        shard.index[key] = shard.lru.begin();
+    }
+
+    //! Number of found results
+    std::uint64_t hits() const {
+        return nHits.load();
+    }
+
+    //! Number of results not found
+    std::uint64_t misses() const {
+        return nMisses.load();
+    }
+};
+
+#endif // EVALCACHE_HPP
@@ -0,0 +1,234 @@
+#ifndef EVALUATOR_HPP
+#define EVALUATOR_HPP
+
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#include "zmqpool.hpp"
+#include "wireformat.hpp"
+
+#ifdef MCTS_ONNXRUNTIME
+#include <onnxruntime_cxx_api.h>
+#endif
+
+//! Backend of dnn evaluations, called by computeMCTS_WP of the problems
+/*!
+ * \details States are dnn inputs of getGameStateDNN, result is one row of policy logits and value per state.
+ *          Evaluators are owned outside of the problem and shared by its copies, evaluate must be thread-safe.
+ *          Problems without evaluator send each state to their port by zeromq, as DNNEvaluatorZMQ does.
+ * \author adamp87
+*/
+class DNNEvaluator {
+public:
+    virtual ~DNNEvaluator() {}
+
+    //! Evaluate states of equal size, result is the concatenated rows of the states
+    virtual void evaluate(const std::vector<const std::vector<float>*>& states, std::vector<float>& result) = 0;
+};
+
+//! Evaluation by the dnn server at port, e.g. pyExecute.py
+class DNNEvaluatorZMQ : public DNNEvaluator {
+    ZMQSocketPool& sockets; //!< connected sockets, shared with other users
+    std::string port; //!< port of the dnn server
+    DNNWireFormat wire; //!< encoding of requests and replies
+
+public:
+    DNNEvaluatorZMQ(ZMQSocketPool& sockets, const std::string& port, const DNNWireFormat& wire = DNNWireFormat())
+        : sockets(sockets), port(port), wire(wire)
+    {}
+
+    void evaluate(const std::vector<const std::vector<float>*>& states, std::vector<float>& result) override {
+        wire.exchange(sockets, port, states, result);
+    }
+};
+
+//! Deterministic evaluation without dnn, measures search throughput apart from zeromq and python
+/*!
+ * \details Row of a state is derived from the hash of its values, so repeated searches build the same trees.
+ *          Logits of policy and the value are uniform in [-1, 1].
+ *          Each call sleeps latency microseconds, as a remote or gpu inference of one batch would block its thread.
+ * \author adamp87
+*/
+class DNNEvaluatorSynthetic : public DNNEvaluator {
+    size_t rowSize; //!< values of the result of one state, e.g. 65 for chess
+    std::chrono::microseconds latency; //!< time of each call
+    std::uint64_t seed;
+
+    static std::uint64_t mix(std::uint64_t x) {
+        x += 0x9e3779b97f4a7c15ULL; // splitmix64
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+public:
+    //! Create evaluator of problem with results of rowSize values, policy and value
+    /*!
+    * \param rowSize Values of the result of one state
+    * \param latency Time of each call in microseconds, 0 returns immediately
+    * \param seed Changes the results of all states
+    */
+    DNNEvaluatorSynthetic(size_t rowSize, unsigned int latency = 0, std::uint64_t seed = 0)
+        : rowSize(rowSize), latency(latency), seed(seed)
+    {}
+
+    void evaluate(const std::vector<const std::vector<float>*>& states, std::vector<float>& result) override {
+        result.resize(states.size() * rowSize);
+        for (size_t s = 0; s < states.size(); ++s) {
+            std::uint64_t hash = mix(seed);
+            for (float value : *states[s]) {
+                std::uint32_t bits;
+                memcpy(&bits, &value, sizeof(bits));
+                hash = mix(hash ^ bits);
+            }
+            for (size_t i = 0; i < rowSize; ++i) // upper 24 bits are exact as float
+                result[s*rowSize + i] = float(mix(hash + i) >> 40) / float(1 << 23) - 1.0f;
+        }
+        if (latency.count() > 0)
+            std::this_thread::sleep_for(latency);
+    }
+};
+
+#ifdef MCTS_ONNXRUNTIME
+
+//! In-process evaluation of an onnx model with ONNX Runtime, optionally on cuda or tensorrt
+/*!
+ * \details Model has one input of shape (batch, planes, height, width), the layout of getGameStateDNN.
+ *          Outputs are flattened per state and concatenated to its row, e.g. policy (batch, 64) and value (batch, 1).
+ *          Run of a session is thread-safe, threads of a search evaluate concurrently or through DNNBatchQueue.
+ *          Enabled by the define MCTS_ONNXRUNTIME (cmake BUILD_OnnxRuntime).
+ * \author adamp87
+*/
+class DNNEvaluatorOnnx : public DNNEvaluator {
+    Ort::Env env;
+    Ort::Session session;
+    std::int64_t height;
+    std::int64_t width;
+    std::string inputName;
+    std::vector<std::string> outputNames;
+
+    static Ort::SessionOptions createOptions(const std::string& provider, int threads) {
+        Ort::SessionOptions options;
+        options.SetIntraOpNumThreads(threads);
+        options.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_ALL);
+        if (provider == "tensorrt") {
+            OrtTensorRTProviderOptionsV2* trt = nullptr; // defaults of the installed version
+            Ort::ThrowOnError(Ort::GetApi().CreateTensorRTProviderOptions(&trt));
+            options.AppendExecutionProvider_TensorRT_V2(*trt);
+            Ort::GetApi().ReleaseTensorRTProviderOptions(trt);
+        }
+        if (provider == "tensorrt" || provider == "cuda") {
+            OrtCUDAProviderOptions cuda; // fallback of nodes unsupported by tensorrt
+            options.AppendExecutionProvider_CUDA(cuda);
+        } else if (provider != "cpu") {
+            throw std::invalid_argument("Unknown onnx provider: " + provider);
+        }
+        return options;
+    }
+
+public:
+    //! Load model
+    /*!
+    * \param path Onnx model file
+    * \param height Rows of each plane, e.g. 8 for chess, 6 for connect4
+    * \param width Columns of each plane
+    * \param provider cpu, cuda or tensorrt
+    * \param threads Threads of ONNX Runtime for each run on cpu
+    */
+    DNNEvaluatorOnnx(const std::string& path, std::int64_t height, std::int64_t width,
+                     const std::string& provider = "cpu", int threads = 1)
+        : env(ORT_LOGGING_LEVEL_WARNING, "mcts"), session(nullptr), height(height), width(width)
+    {
+        Ort::SessionOptions options = createOptions(provider, threads);
+#ifdef _WIN32
+        std::wstring widePath(path.begin(), path.end());
+        session = Ort::Session(env, widePath.c_str(), options);
+#else
+        session = Ort::Session(env, path.c_str(), options);
+#endif
+        Ort::AllocatorWithDefaultOptions allocator;
+        if (session.GetInputCount() != 1)
+            throw std::runtime_error("Onnx model needs one input: " + path);
+        inputName = session.GetInputNameAllocated(0, allocator).get();
+        for (size_t i = 0; i < session.GetOutputCount(); ++i)
+            outputNames.push_back(session.GetOutputNameAllocated(i, allocator).get());
+    }
+
+    void evaluate(const std::vector<const std::vector<float>*>& states, std::vector<float>& result) override {
+        const size_t stateSize = states[0]->size();
+        const std::int64_t batch = static_cast<std::int64_t>(states.size());
+        if (stateSize % (height*width) != 0)
+            throw std::runtime_error("State size is not a multiple of the plane size");
+        std::vector<float> input(states.size() * stateSize);
+        for (size_t i = 0; i < states.size(); ++i) {
+            if (states[i]->size() != stateSize)
+                throw std::runtime_error("States of a batch differ in size");
+            memcpy(input.data() + i*stateSize, states[i]->data(), stateSize*sizeof(float));
+        }
+
+        const std::int64_t shape[4] = {batch, std::int64_t(stateSize) / (height*width), height, width};
+        Ort::MemoryInfo memory = Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault);
+        Ort::Value tensor = Ort::Value::CreateTensor<float>(memory, input.data(), input.size(), shape, 4);
+        const char* inputs[1] = {inputName.c_str()};
+        std::vector<const char*> outputs;
+        for (const std::string& name : outputNames)
+            outputs.push_back(name.c_str());
+        std::vector<Ort::Value> values = session.Run(Ort::RunOptions{nullptr}, inputs, &tensor, 1,
+                                                     outputs.data(), outputs.size());
+
+        std::vector<size_t> sizes; // values of each output for one state
+        size_t rowSize = 0;
+        for (Ort::Value& value : values) {
+            sizes.push_back(value.GetTensorTypeAndShapeInfo().GetElementCount() / states.size());
+            rowSize += sizes.back();
+        }
+        result.resize(states.size() * rowSize);
+        for (size_t s = 0; s < states.size(); ++s) {
+            float* row = result.data() + s*rowSize;
+            for (size_t o = 0; o < values.size(); ++o) {
+                memcpy(row, values[o].GetTensorData<float>() + s*sizes[o], sizes[o]*sizeof(float));
+                row += sizes[o];
+            }
+        }
+    }
+};
+
+#endif // MCTS_ONNXRUNTIME
+
+//! Create backend by name: zmq or synthetic, onnx, onnx-cuda or onnx-tensorrt, where port is the path of the model
+/*!
+* \param sockets Pool of connected sockets, used by zmq
+* \param port Port of the dnn server or path of the model
+* \param wire Encoding of requests and replies, used by zmq
+* \param rowSize Values of the result of one state, used by synthetic
+* \param height Rows of each plane, used by onnx
+* \param width Columns of each plane, used by onnx
+* \param latency Time of each call in microseconds, used by synthetic
+*/
+inline std::unique_ptr<DNNEvaluator> createDNNEvaluator(const std::string& name, ZMQSocketPool& sockets, const std::string& port,
+                                                        const DNNWireFormat& wire, size_t rowSize,
+                                                        std::int64_t height, std::int64_t width, unsigned int latency) {
+    if (name == "zmq")
+        return std::unique_ptr<DNNEvaluator>(new DNNEvaluatorZMQ(sockets, port, wire));
+    if (name == "synthetic")
+        return std::unique_ptr<DNNEvaluator>(new DNNEvaluatorSynthetic(rowSize, latency));
+    if (name == "onnx" || name == "onnx-cuda" || name == "onnx-tensorrt") {
+#ifdef MCTS_ONNXRUNTIME
+        std::string provider = name == "onnx" ? "cpu" : name.substr(5);
+        return std::unique_ptr<DNNEvaluator>(new DNNEvaluatorOnnx(port, height, width, provider));
+#else
+        (void)height;
+        (void)width;
+        throw std::invalid_argument("Built without ONNX Runtime, see BUILD_OnnxRuntime");
+#endif
+    }
+    throw std::invalid_argument("Unknown evaluator: " + name);
+}
+
+#endif // EVALUATOR_HPP
@@ -1,16 +1,140 @@
 #ifndef MCTS_HPP
 #define MCTS_HPP
 
+#include <cmath>
 #include <mutex>
 #include <atomic>
+#include <chrono>
 #include <vector>
 #include <memory>
 #include <limits>
 #include <random>
 #include <numeric>
 #include <iostream>
+#include <thread>
 #include <algorithm>
 #include <functional>
+#include <stdexcept>
+#include <type_traits>
+
+#include "ucbkernel.hpp"
+#include "selection.hpp"
+#include "random.hpp"
+#include "rollout.hpp"
+#include "telemetry.hpp"
+#include "samplestream.hpp"
+#include "snapshot.hpp"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+//! Atomic double for the values of nodes
+/*!
+ * \details Addition is the wait-free fetch_add of C++20 if the standard library provides it,
+ *          otherwise a compare-and-swap loop, which retries while other threads update the same node.
+ */
+class MCTSAtomicDouble {
+    std::atomic<double> value;
+
+public:
+    MCTSAtomicDouble() : value(0) {}
+    operator double() const {
+        return value;
+    }
+    void operator+=(double val) {
+#if defined(__cpp_lib_atomic_float)
+        value.fetch_add(val);
+#else
+        double prev = value;
+        while (!value.compare_exchange_weak(prev, prev + val)) {} // prev is reloaded on failure
+#endif
+    }
+    void operator-=(double val) {
+        *this += -val;
+    }
+};
+
+//! Atomic fixed point number for the values of nodes, alternative of MCTSAtomicDouble
+/*!
+ * \details Value is stored as integer with 32 fractional bits, addition is a wait-free integer fetch_add on every standard.
+ *          Each addition is rounded to 2^-32, the total must stay within +-2^31, e.g. visits times max value of a game.
+ *          Adding and removing the same value cancels exactly, as virtual loss does.
+ */
+class MCTSAtomicFixed {
+    std::atomic<std::int64_t> value;
+
+    constexpr static double Scale = 4294967296.0; //!< 2^32
+
+    static std::int64_t toFixed(double val) {
+        return static_cast<std::int64_t>(std::llround(val * Scale));
+    }
+
+public:
+    MCTSAtomicFixed() : value(0) {}
+    operator double() const {
+        return static_cast<double>(value.load()) / Scale;
+    }
+    void operator+=(double val) {
+        value.fetch_add(toFixed(val));
+    }
+    void operator-=(double val) {
+        value.fetch_sub(toFixed(val));
+    }
+};
+
+//! Expansion state of single-thread MCTS::Node implementation
+class MCTSExpansion {
+    bool expanded;
+
+public:
+    MCTSExpansion() : expanded(false) {}
+
+    //! Childs have been added by policy
+    bool isExpanded() const { return expanded; }
+
+    //! Claim expansion of the leaf, no other thread can hold it
+    bool begin() { return true; }
+
+    //! Publish childs of the leaf
+    void end() { expanded = true; }
+
+    //! Wait for the thread which holds the expansion, never called on single thread
+    void wait() const {}
+};
+
+//! Lock-free expansion state of multi-thread MCTS::Node implementation
+/*!
+ * \details A leaf is claimed by one thread with compare-and-swap, it adds the childs and publishes them with release order.
+ *          Threads which lose the claim wait until the childs are published, instead of blocking on a mutex of the node.
+ *          Expansion takes one evaluation, so the waiting threads yield instead of spinning on the core of the expanding thread.
+ *          Reading an expanded state with acquire order makes the childs visible without any lock.
+ */
+class MCTSExpansionMT {
+    enum : std::uint8_t { Leaf, Expanding, Expanded };
+    std::atomic<std::uint8_t> state;
+
+public:
+    MCTSExpansionMT() : state(Leaf) {}
+
+    //! Childs have been added by policy, readable without lock
+    bool isExpanded() const { return state.load(std::memory_order_acquire) == Expanded; }
+
+    //! Claim expansion of the leaf, false if another thread holds or finished it
+    bool begin() {
+        std::uint8_t expected = Leaf;
+        return state.compare_exchange_strong(expected, Expanding, std::memory_order_acquire, std::memory_order_acquire);
+    }
+
+    //! Publish childs of the leaf, releases the claim
+    void end() { state.store(Expanded, std::memory_order_release); }
+
+    //! Wait for the thread which holds the expansion
+    void wait() const {
+        while (!isExpanded())
+            std::this_thread::yield();
+    }
+};
 
 //! Base class for single-thread MCTS::Node implementation
 template <typename T_Act>
@@ -18,16 +142,11 @@ struct MCTSNodeBase {
     typedef T_Act ActType;
     typedef std::uint_fast32_t CountType;
 
-    //! Dummy LockGuard, helps to keep policy transparent
-    class LockGuard {
-    public:
-        LockGuard(MCTSNodeBase<T_Act>&) {}
-    };
-
-    CountType   N;      //!< state visit count
-    double      W;      //!< total value of state
-    double      P;      //!< prior probability to select action
-    T_Act       action; //!< action that takes to state, e.g. card played out
+    CountType       N;          //!< state visit count
+    double          W;          //!< total value of state
+    double          P;          //!< prior probability to select action
+    T_Act           action;     //!< action that takes to state, e.g. card played out
+    MCTSExpansion   expansion;  //!< childs have been added by policy
 
     MCTSNodeBase(const T_Act& action)
         : N(0), W(0.0), P(0.0), action(action)
@@ -35,44 +154,492 @@ struct MCTSNodeBase {
 };
 
 //! Base class for multi-thread MCTS::Node implementation
-template <typename T_Act>
+/*!
+ * \details Statistics are updated with atomic operations and leaves are expanded lock-free, see MCTSExpansionMT.
+ *          T_Value is the atomic type of the value, MCTSAtomicDouble or MCTSAtomicFixed.
+ */
+template <typename T_Act, class T_Value = MCTSAtomicDouble>
 struct MCTSNodeBaseMT {
     typedef T_Act ActType;
     typedef std::uint_fast32_t CountType;
+    typedef T_Value ValueType;
+
+    std::atomic<CountType>  N;          //!< state visit count
+    T_Value                 W;          //!< total value of state
+    double                  P;          //!< prior probability to select action
+    T_Act                   action;     //!< action that takes to state, e.g. card played out
+    MCTSExpansionMT         expansion;  //!< childs have been added by policy, readable without lock
+
+    MCTSNodeBaseMT(const T_Act& action)
+        : N(0), P(0.0), action(action)
+    { }
+};
+
+//! Base class for multi-thread MCTS::Node implementation, statistics are stored in arrays of the parent
+/*!
+ * \details Selection reads N, W and P of every child, with separate node objects each child is a cache miss.
+ *          Storage policy MCTSStorageSoA keeps the statistics of the childs of one expansion as structure of arrays,
+ *          the node only references its own entries, so the tree search updates them as in MCTSNodeBaseMT.
+ *          Counts are 32 bits, so the selection can load and convert several of them with one instruction.
+ *          Values are doubles for the same reason, MCTSAtomicFixed cannot be used here.
+ *          Root is allocated by the storage as well, it has its own block of one node.
+ */
+template <typename T_Act>
+struct MCTSNodeBaseSoA {
+    typedef T_Act ActType;
+    typedef std::uint32_t CountType;
+    typedef MCTSAtomicDouble ValueType;
+
+    std::atomic<CountType>& N;  //!< state visit count, entry of the array of the parent
+    ValueType&              W;  //!< total value of state, entry of the array of the parent
+    double&                 P;  //!< prior probability to select action, entry of the array of the parent
+    T_Act                   action;     //!< action that takes to state, e.g. card played out
+    MCTSExpansionMT         expansion;  //!< childs have been added by policy, readable without lock
+
+    MCTSNodeBaseSoA(const T_Act& action, std::atomic<CountType>& N, ValueType& W, double& P)
+        : N(N), W(W), P(P), action(action)
+    {
+        static_assert(sizeof(std::atomic<CountType>) == sizeof(CountType), "Counts are read as plain array");
+        static_assert(sizeof(ValueType) == sizeof(double), "Values are read as plain array");
+    }
+};
+
+//! Node storage policy, each child is allocated separately on the heap
+template <class TNode>
+class MCTSStorageHeap {
+public:
+    constexpr static bool ContiguousStats = false; //!< interface, statistics of childs are not stored as arrays
+    constexpr static bool MovableNodes = true; //!< interface, a subtree can be moved to another parent and the rest released
+
+    //! Child container of a node, interface
+    class Childs {
+        friend class MCTSStorageHeap;
+        std::vector<std::unique_ptr<TNode> > nodes; //!< store childs as unique pointers
 
-    //! LockGuard inherited from std, constructor takes node
-    class LockGuard : public std::lock_guard<std::mutex> {
     public:
-        LockGuard(MCTSNodeBaseMT<T_Act>& node)
-            : std::lock_guard<std::mutex>(node.lock)
-        {}
+        size_t size() const { return nodes.size(); }
+        TNode* operator[](size_t i) const { return nodes[i].get(); }
+    };
+
+private:
+    std::atomic<size_t> nodeCount; //!< number of allocated nodes
+
+    static size_t count(const Childs& childs) {
+        size_t n = 0;
+        for (size_t i = 0; i < childs.nodes.size(); ++i) {
+            if (childs.nodes[i])
+                n += 1 + count(childs.nodes[i]->childs);
+        }
+        return n;
+    }
+
+public:
+    MCTSStorageHeap() : nodeCount(0) {}
+
+    //! Add childs to container, returns pointer to the first of them, interface
+    template <typename ActType>
+    TNode* add(Childs& childs, const ActType* actions, size_t count) {
+        if (count == 0)
+            return nullptr;
+        nodeCount.fetch_add(count, std::memory_order_relaxed);
+        size_t first = childs.nodes.size();
+        for (size_t i = 0; i < count; ++i) {
+            childs.nodes.push_back(std::unique_ptr<TNode>(new TNode(actions[i])));
+        }
+        return childs.nodes[first].get();
+    }
+
+    //! Move child i of src to the empty container dst with its subtree, src keeps an empty entry, interface of MovableNodes
+    void move(Childs& dst, Childs& src, size_t i) {
+        dst.nodes.push_back(std::move(src.nodes[i]));
+    }
+
+    //! Free the nodes of childs and their subtrees, e.g. the rest of the tree after move, interface of MovableNodes
+    /*!
+    * \details Thread-safe if no other thread uses these nodes, the tree can be searched meanwhile.
+    */
+    void release(Childs& childs) {
+        size_t n = count(childs);
+        childs.nodes.clear();
+        nodeCount.fetch_sub(n, std::memory_order_relaxed);
+    }
+
+    //! Number of allocated nodes, interface
+    size_t size() const {
+        return nodeCount.load(std::memory_order_relaxed);
+    }
+
+    //! Release every node allocated by the storage, interface
+    void clear() {}
+};
+
+//! Raw memory of one arena per OpenMP thread, used by the arena storage policies
+/*!
+ * \details Each OpenMP thread owns an arena, so allocation does not take any global lock.
+ *          An arena is a list of chunks, blocks are cut from the last chunk with a bump pointer.
+ *          Threads out of range share the last arena under a lock.
+ *          Blocks are never freed one by one, all memory is released by clear() or on destruction.
+ * \author adamp87
+*/
+class MCTSThreadArenas {
+public:
+    typedef void (*Destroy)(void* block, size_t count); //!< destructs count objects at the start of block
+
+    constexpr static size_t Alignment = 16; //!< alignment of each block
+
+private:
+    //! Block with non-trivially destructible objects
+    struct Block {
+        void* data;
+        size_t count;
+        Destroy destroy;
     };
 
-    //! Workaround, until C20 standard enables atomic operations for double
-    class MyAtomicDouble {
-        std::atomic<double> value;
+    //! Memory of one thread
+    /*!
+    * \details Padded by a cache line to avoid false sharing between threads.
+    *          Not declared over-aligned, since std::vector does not allocate over-aligned types before C++17.
+    */
+    struct Arena {
+        std::vector<char*> chunks; //!< allocated raw memory
+        std::vector<Block> blocks; //!< blocks to destruct before release
+        size_t used; //!< number of bytes used in last chunk
+        size_t capacity; //!< number of bytes in last chunk
+        char padding[64];
+
+        Arena() : used(0), capacity(0) {}
+    };
+
+    size_t chunkBytes; //!< minimum size of a chunk
+    std::vector<Arena> arenas; //!< one arena per thread, last one is shared for threads out of range
+    std::mutex sharedLock; //!< guards shared arena
+
+    static void* allocate(Arena& arena, size_t bytes, size_t chunkBytes, Destroy destroy, size_t count) {
+        bytes = (bytes + Alignment - 1) / Alignment * Alignment;
+        if (arena.used + bytes > arena.capacity) {
+            size_t capacity = std::max(bytes, chunkBytes);
+            arena.chunks.push_back(static_cast<char*>(::operator new(capacity)));
+            arena.used = 0;
+            arena.capacity = capacity;
+        }
+        void* block = arena.chunks.back() + arena.used;
+        arena.used += bytes;
+        if (destroy != nullptr) {
+            Block b = {block, count, destroy};
+            arena.blocks.push_back(b);
+        }
+        return block;
+    }
+
+public:
+    static int getThreadId() {
+#ifdef _OPENMP
+        return omp_get_thread_num();
+#else
+        return 0;
+#endif
+    }
+
+    static int getMaxThreads() {
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+
+    explicit MCTSThreadArenas(size_t chunkBytes) : chunkBytes(chunkBytes), arenas(getMaxThreads() + 1) {}
+    MCTSThreadArenas(const MCTSThreadArenas&) = delete;
+    MCTSThreadArenas(MCTSThreadArenas&& other) : chunkBytes(other.chunkBytes), arenas(std::move(other.arenas)) {
+        other.arenas.resize(getMaxThreads() + 1);
+    }
+
+    ~MCTSThreadArenas() {
+        clear();
+    }
+
+    //! Get memory on the arena of the calling thread, objects are constructed by the caller
+    /*!
+    * \param bytes Size of the block
+    * \param destroy Called on clear for the objects of the block, nullptr if they are trivially destructible
+    * \param count Number of objects of the block passed to destroy
+    */
+    void* allocate(size_t bytes, Destroy destroy = nullptr, size_t count = 0) {
+        size_t tid = static_cast<size_t>(getThreadId());
+        if (tid + 1 < arenas.size())
+            return allocate(arenas[tid], bytes, chunkBytes, destroy, count);
+        std::lock_guard<std::mutex> guard(sharedLock);
+        return allocate(arenas.back(), bytes, chunkBytes, destroy, count);
+    }
+
+    //! Destruct objects of all blocks and release memory
+    void clear() {
+        for (auto it = arenas.begin(); it != arenas.end(); ++it) {
+            Arena& arena = *it;
+            for (auto bt = arena.blocks.begin(); bt != arena.blocks.end(); ++bt) {
+                bt->destroy(bt->data, bt->count);
+            }
+            for (auto ct = arena.chunks.begin(); ct != arena.chunks.end(); ++ct) {
+                ::operator delete(*ct);
+            }
+            arena.blocks.clear();
+            arena.chunks.clear();
+            arena.used = 0;
+            arena.capacity = 0;
+        }
+    }
+};
+
+//! Node storage policy, childs of one expansion are allocated as one contiguous block from per-thread arenas
+/*!
+ * \details Nodes are never freed one by one, the whole tree is released by clear() or on destruction.
+ *          Childs of a node must be added at once, i.e. a node is expanded only one time.
+ * \author adamp87
+*/
+template <class TNode>
+class MCTSStorageArena {
+public:
+    constexpr static size_t ChunkNodes = 4096; //!< minimum number of nodes per chunk
+    constexpr static bool ContiguousStats = false; //!< interface, statistics of childs are not stored as arrays
+    constexpr static bool MovableNodes = false; //!< interface, nodes are freed only all at once
+
+    //! Child container of a node, interface
+    class Childs {
+        friend class MCTSStorageArena;
+        TNode* nodes; //!< first child of the contiguous block
+        size_t count; //!< number of childs in the block
 
     public:
-        MyAtomicDouble() : value(0) {}
-        operator double() const {
-            return value;
+        Childs() : nodes(nullptr), count(0) {}
+        size_t size() const { return count; }
+        TNode* operator[](size_t i) const { return nodes + i; }
+    };
+
+private:
+    MCTSThreadArenas arenas; //!< memory of the nodes
+    std::atomic<size_t> nodeCount; //!< number of constructed nodes
+
+    static void destroy(void* block, size_t count) {
+        for (size_t i = 0; i < count; ++i)
+            static_cast<TNode*>(block)[i].~TNode();
+    }
+
+public:
+    MCTSStorageArena() : arenas(ChunkNodes * sizeof(TNode)), nodeCount(0) {}
+    MCTSStorageArena(const MCTSStorageArena&) = delete;
+    MCTSStorageArena(MCTSStorageArena&& other) : arenas(std::move(other.arenas)), nodeCount(other.size()) {
+        other.nodeCount = 0;
+    }
+
+    //! Add childs to container, returns pointer to the first of them, interface
+    template <typename ActType>
+    TNode* add(Childs& childs, const ActType* actions, size_t count) {
+        if (childs.count != 0)
+            throw std::logic_error("Arena storage expands a node only once");
+        if (count == 0)
+            return nullptr;
+
+        bool trivial = std::is_trivially_destructible<TNode>::value;
+        TNode* block = static_cast<TNode*>(arenas.allocate(count * sizeof(TNode), trivial ? nullptr : &destroy, count));
+        for (size_t i = 0; i < count; ++i) {
+            new (block + i) TNode(actions[i]);
         }
-        void operator+=(double& val) {
-            double prev = value;
-            double next = prev + val;
-            while (!value.compare_exchange_weak(prev, next)) {}
+        childs.nodes = block;
+        childs.count = count;
+        nodeCount.fetch_add(count, std::memory_order_relaxed);
+        return block;
+    }
+
+    //! Number of constructed nodes, interface
+    size_t size() const {
+        return nodeCount.load(std::memory_order_relaxed);
+    }
+
+    //! Release every node allocated by the storage, interface
+    void clear() {
+        arenas.clear();
+        nodeCount = 0;
+    }
+};
+
+//! Node storage policy, arena storage which keeps the statistics of childs as structure of arrays
+/*!
+ * \details One expansion allocates a block of the nodes, followed by the arrays of N, W and P of the same childs.
+ *          Nodes reference their entries, see MCTSNodeBaseSoA, which is the only supported node base.
+ *          Selection scans the arrays of a node instead of all child nodes, which is vectorized by MCTSKernelUCB.
+ * \author adamp87
+*/
+template <class TNode>
+class MCTSStorageSoA {
+public:
+    constexpr static size_t ChunkNodes = 4096; //!< minimum number of nodes per chunk
+    constexpr static bool ContiguousStats = true; //!< interface, N, W and P of childs are arrays starting at the first child
+    constexpr static bool MovableNodes = false; //!< interface, nodes are freed only all at once
+
+    //! Child container of a node, interface
+    class Childs {
+        friend class MCTSStorageSoA;
+        TNode* nodes; //!< first child of the contiguous block
+        size_t count; //!< number of childs in the block
+
+    public:
+        Childs() : nodes(nullptr), count(0) {}
+        size_t size() const { return count; }
+        TNode* operator[](size_t i) const { return nodes + i; }
+    };
+
+private:
+    MCTSThreadArenas arenas; //!< memory of the nodes and statistics
+    std::atomic<size_t> nodeCount; //!< number of constructed nodes
+
+    static size_t alignUp(size_t bytes) {
+        return (bytes + MCTSThreadArenas::Alignment - 1) / MCTSThreadArenas::Alignment * MCTSThreadArenas::Alignment;
+    }
+
+    static void destroy(void* block, size_t count) {
+        for (size_t i = 0; i < count; ++i)
+            static_cast<TNode*>(block)[i].~TNode();
+    }
+
+public:
+    MCTSStorageSoA() : arenas(ChunkNodes * sizeof(TNode)), nodeCount(0) {}
+    MCTSStorageSoA(const MCTSStorageSoA&) = delete;
+    MCTSStorageSoA(MCTSStorageSoA&& other) : arenas(std::move(other.arenas)), nodeCount(other.size()) {
+        other.nodeCount = 0;
+    }
+
+    //! Add childs to container, returns pointer to the first of them, interface
+    template <typename ActType>
+    TNode* add(Childs& childs, const ActType* actions, size_t count) {
+        typedef typename TNode::CountType CountType;
+        typedef typename TNode::ValueType ValueType;
+        if (childs.count != 0)
+            throw std::logic_error("SoA storage expands a node only once");
+        if (count == 0)
+            return nullptr;
+
+        // nodes, counts, values, priors
+        size_t offsetN = alignUp(count * sizeof(TNode));
+        size_t offsetW = alignUp(offsetN + count * sizeof(std::atomic<CountType>));
+        size_t offsetP = alignUp(offsetW + count * sizeof(ValueType));
+        size_t bytes = offsetP + count * sizeof(double);
+
+        bool trivial = std::is_trivially_destructible<TNode>::value;
+        char* data = static_cast<char*>(arenas.allocate(bytes, trivial ? nullptr : &destroy, count));
+        TNode* nodes = reinterpret_cast<TNode*>(data);
+        std::atomic<CountType>* N = reinterpret_cast<std::atomic<CountType>*>(data + offsetN);
+        ValueType* W = reinterpret_cast<ValueType*>(data + offsetW);
+        double* P = reinterpret_cast<double*>(data + offsetP);
+        for (size_t i = 0; i < count; ++i) {
+            new (N + i) std::atomic<CountType>(0);
+            new (W + i) ValueType();
+            P[i] = 0.0;
+            new (nodes + i) TNode(actions[i], N[i], W[i], P[i]);
         }
+        childs.nodes = nodes;
+        childs.count = count;
+        nodeCount.fetch_add(count, std::memory_order_relaxed);
+        return nodes;
+    }
+
+    //! Number of constructed nodes, interface
+    size_t size() const {
+        return nodeCount.load(std::memory_order_relaxed);
+    }
+
+    //! Release every node allocated by the storage, interface
+    void clear() {
+        arenas.clear();
+        nodeCount = 0;
+    }
+};
+
+//! Lock-free hash map from state hash to expanded node, shared by all threads
+/*!
+ * \details Fixed number of entries with linear probing, an entry is claimed by compare-and-swap on its key.
+ *          Entries are never removed or replaced, if the probed entries are taken, the node is not stored.
+ *          A node is inserted after its childs are added, so found nodes can be traversed right away.
+ *          Nodes are owned by the storage policy, the table must be cleared together with the tree.
+ * \author adamp87
+*/
+template <class TNode>
+class MCTSTranspositionTable {
+    constexpr static size_t MaxProbe = 16; //!< number of entries checked for a key
+
+    struct Entry {
+        std::atomic<std::uint64_t> key; //!< hash of state, zero if entry is free
+        std::atomic<TNode*> node; //!< expanded node of state, set after key is claimed
     };
 
-    std::atomic<CountType>  N;      //!< state visit count
-    MyAtomicDouble          W;      //!< total value of state
-    double                  P;      //!< prior probability to select action
-    T_Act                   action; //!< action that takes to state, e.g. card played out
-    std::mutex              lock;   //!< mutex for thread-safe policy
+    std::unique_ptr<Entry[]> entries;
+    size_t mask; //!< number of entries minus one, power of two
 
-    MCTSNodeBaseMT(const T_Act& action)
-        : N(0), P(0.0), action(action)
-    { }
+    static std::uint64_t getKey(std::uint64_t hash) {
+        return hash != 0 ? hash : 1; // zero marks free entries
+    }
+
+public:
+    MCTSTranspositionTable() : mask(0) {}
+
+    //! Allocate 2^log2Size entries, zero disables the table
+    void resize(unsigned int log2Size) {
+        entries.reset(log2Size != 0 ? new Entry[size_t(1) << log2Size] : nullptr);
+        mask = log2Size != 0 ? (size_t(1) << log2Size) - 1 : 0;
+        clear();
+    }
+
+    bool enabled() const {
+        return entries != nullptr;
+    }
+
+    //! Remove all entries
+    void clear() {
+        for (size_t i = 0; enabled() && i <= mask; ++i) {
+            entries[i].key = 0;
+            entries[i].node = nullptr;
+        }
+    }
+
+    //! Get node of state, nullptr if not found or table is disabled, thread-safe
+    TNode* find(std::uint64_t hash) const {
+        if (!enabled())
+            return nullptr;
+        std::uint64_t key = getKey(hash);
+        for (size_t i = 0; i < MaxProbe; ++i) {
+            const Entry& entry = entries[(key + i) & mask];
+            std::uint64_t stored = entry.key;
+            if (stored == key)
+                return entry.node; // nullptr while inserting thread has not stored the node yet
+            if (stored == 0)
+                return nullptr;
+        }
+        return nullptr;
+    }
+
+    //! Store node of state, first node of a state is kept, thread-safe
+    void insert(std::uint64_t hash, TNode* node) {
+        if (!enabled())
+            return;
+        std::uint64_t key = getKey(hash);
+        for (size_t i = 0; i < MaxProbe; ++i) {
+            Entry& entry = entries[(key + i) & mask];
+            std::uint64_t stored = 0;
+            if (entry.key.compare_exchange_strong(stored, key)) {
+                entry.node = node;
+                return;
+            }
+            if (stored == key)
+                return; // state was expanded by another thread in the meantime
+        }
+    }
+};
+
+//! Visits and value of one child of the root, root parallel searches sum them over their trees
+template <typename T_Act>
+struct MCTSRootStat {
+    T_Act           action;     //!< action of the child
+    std::uint64_t   N;          //!< number of visits
+    double          W;          //!< total value
 };
 
 //! Monte Carlo tree search to apply AI
@@ -83,59 +650,113 @@ struct MCTSNodeBaseMT {
  *          History must be handled by the main program.
  *          The tree search does not know the exact problem it solves.
  *          Interfacing with the problem is done by template interfaces.
+ *          Memory of the nodes is managed by the storage policy TStorage.
+ *          After catchup, the tree is re-rooted onto the current state, nodes of actions not played are released.
+ *          Heap storage moves the kept subtree to the root, other storages keep it in place until the released nodes dominate,
+ *          then the subtree is copied to a new storage, the rest of the old tree is released on a background thread.
+ *          Optionally, states reached through different actions share one node by a transposition table.
+ *          The problem then returns a hash of everything its actions and evaluation depend on.
+ *          Hash must differ between a state and its successors, e.g. by including the turn, so the graph has no cycles.
+ *          Search runs policyIter iterations, it stops earlier if a time or node limit is reached,
+ *          or optionally if the most visited child cannot be overtaken by the remaining iterations.
+ *          Childs are selected by the policy TSelection, e.g. PUCT, UCT with first play urgency or Gumbel at root.
+ *          Dirichlet noise of the root priors is drawn once per search, not per iteration.
+ *          Random numbers come from counter-based streams of the seed, one per thread and search, see MCTSRandomStreams.
  * \author adamp87
 */
-template <class TProblem, class TNodeBase>
+template <class TProblem, class TNodeBase, template <class> class TStorage = MCTSStorageHeap,
+          template <class> class TSelection = MCTSSelectDefault>
 class MCTS {
 
     //! One node with childs, interface
     class Node : public TNodeBase {
+    public:
+        typedef typename TNodeBase::ActType ActType;
+
     private:
         friend class MCTS;
-        typedef typename TNodeBase::ActType ActType;
+        friend class TStorage<Node>;
 
-        std::vector<std::unique_ptr<Node> > childs; //!< store childs as unique pointers
+        typename TStorage<Node>::Childs childs; //!< childs are owned by the storage policy
+        Node* transposition; //!< expanded node of the same state, its childs and statistics are shared
 
-        Node(const ActType& action) : TNodeBase(action) {}
+        //! Storage policy passes the entries of the statistics arrays to node bases which reference them
+        template <typename... TStats>
+        Node(const ActType& action, TStats&... stats) : TNodeBase(action, stats...), transposition(nullptr) {}
         Node(const Node&) = delete;
 
-        //! Add child node
-        Node* add(const ActType& action) {
-            // init leaf node
-            std::unique_ptr<Node> child(new Node(action));
-
-            childs.push_back(std::move(child));
-            return childs.back().get();
-        }
-
         //! Get number of childs
         size_t size() const { return childs.size(); }
 
+        //! Get child at index
+        Node* child(size_t i) const { return childs[i]; }
+
         //! Can be used for debug
         size_t getNodeId() const {
             return reinterpret_cast<size_t>(this);
         }
     };
 
-    typedef typename Node* NodePtr;
-    typedef typename TNodeBase::LockGuard LockGuard;
+    typedef Node* NodePtr;
     typedef typename TNodeBase::ActType ActType;
     typedef typename TNodeBase::CountType CountType;
-    typedef typename std::uint_fast32_t ActCounterType;
+    typedef std::uint_fast32_t ActCounterType;
+    typedef TSelection<TProblem> Selection;
+
+public:
+    typedef MCTSRootStat<ActType> RootStat;
 
 private:
-    std::unique_ptr<Node> root; //!< root of the tree
-    std::default_random_engine generator; //!< random generator
+    std::unique_ptr<TStorage<Node> > storage; //!< memory of the nodes
+    typename TStorage<Node>::Childs rootSlot; //!< holds the first root of the storage, root is allocated by the storage as the others
+    NodePtr root; //!< root of the tree, a node below the first root after re-rooting in place
+    size_t compactNodes; //!< nodes of the storage after the last copy, re-rooting in place copies when it grew by CompactGrowth
+    size_t rootTime; //!< length of the history at root, nonzero after re-rooting
+    std::uint64_t rootHash; //!< MCTSSnapshotHeader::hashHistory of the history at root, zero at the initial state
+    NodePtr searchRoot; //!< node of the state of the last search, its childs hold the root statistics
+    bool keepHistory; //!< do not re-root, keep played history for writeResults
+    std::thread releaser; //!< releases the nodes of the previous root
+    std::uint64_t seed; //!< key of all random streams of the tree
+    std::uint64_t searches; //!< number of searches, each search draws from its own streams
+    MCTSRandomStreams random; //!< stream of each thread in the current search
+    CountType virtualLoss; //!< number of virtual visits added to a node while a thread is below, zero disables
+    double virtualLossW; //!< value of one virtual visit, e.g. value of a lost game
+    MCTSTranspositionTable<Node> transpositions; //!< expanded nodes by state hash, disabled by default
+    std::chrono::milliseconds timeLimit; //!< max duration of one search, zero disables
+    size_t nodeLimit; //!< max number of nodes in the tree, zero disables
+    bool earlyStop; //!< stop when the most visited child of root cannot be overtaken
+    unsigned int iterations; //!< number of policy iterations of the last search
+    bool verbose; //!< print statistics of root childs after each search
+    MCTSSampleStream* samples; //!< destination of training samples of stochastic moves, not owned, null disables
+    std::uint32_t sampleGame; //!< id of the game of the samples
+    bool mirrorSamples; //!< also send the sample of the mirror image, see mirrorSampleDNN of the problem
+    std::vector<std::pair<ActType, double> > policyPi; //!< visit distribution of root childs of the last stochastic search
+    MCTSTelemetry telemetry; //!< counters of the last search, empty if compiled out
+    MCTSTelemetrySink* telemetrySink; //!< destination of the counters after each search, not owned, null disables
+    std::string telemetryLabel; //!< identifies the lines of this search
+    const MCTSRollout<TProblem>* rollout; //!< random playouts evaluate the leafs instead of the problem, not owned, null disables
+    const std::atomic<bool>* stopFlag; //!< set by another thread to stop the running search, not owned, null disables
+
+    std::vector<double> rootNoise; //!< dirichlet noise of the root priors in this search, empty if not used
+    std::unique_ptr<MCTSSequentialHalving> halving; //!< root selection in this search, if the policy selects root by halving
+
+    constexpr static std::uint64_t MoveStream = std::uint64_t(1) << 32; //!< stream id of the selection of moves, above thread ids
+    constexpr static size_t CompactGrowth = 4; //!< storage with this many times its nodes after the last copy is compacted
+    constexpr static size_t CompactMinNodes = size_t(1) << 16; //!< smaller storages are not compacted
 
 private:
     //! Walk the tree according to the history of the problem
     NodePtr catchup(const TProblem& state, const std::vector<ActType>& history) {
-        NodePtr node = root.get();
+        if (history.size() < rootTime || (rootTime != 0 && MCTSSnapshotHeader::hashHistory(history, rootTime) != rootHash))
+            reset(); // history of another game, root is ahead of it or on other moves, e.g. a book of another opening
+        NodePtr node = getRoot();
 
-        for (size_t time = 0; time < history.size(); ++time) {
+        for (size_t time = rootTime; time < history.size(); ++time) {
+            if (node->transposition != nullptr)
+                node = node->transposition; // childs are stored at the shared node
             bool found = false;
-            for (auto it = node->childs.begin(); it != node->childs.end(); ++it) {
-                NodePtr child = it->get();
+            for (size_t i = 0; i < node->size(); ++i) {
+                NodePtr child = node->child(i);
                 if (child->action == history[time]) {
                     node = child;
                     found = true;
@@ -143,66 +764,280 @@ private:
                 }
             }
             if (!found) { // no child, update tree according to history
-                node = node->add(history[time]);
+                node = storage->add(node->childs, &history[time], 1);
             }
         }
+        if (node->transposition != nullptr)
+            node = node->transposition;
         return node;
     }
 
+    //! Make subroot the root of the tree, release all other nodes
+    /*!
+    * \details If the storage has MovableNodes and there are no transpositions, subtree of subroot is moved, see moveRoot.
+    *          Otherwise subroot becomes the root in place, nodes of actions not played stay in the storage until it is compacted.
+    *          So re-rooting takes no time in proportion to the subtree, links of transpositions stay valid.
+    *          Storage is compacted when it grew by CompactGrowth since the last copy, or when it fills half of the node limit,
+    *          then the subtree is copied to a new storage, since arena storage cannot free parts of the tree.
+    *          The copy takes time in proportion to the subtree, with transpositions also a state update per expanded node,
+    *          the growth keeps its cost per added node constant.
+    *          Old root and storage are released on a background thread, so it is not part of the move latency.
+    *          Links of transpositions are not copied, the table is filled again with the expanded nodes of the subtree.
+    */
+    NodePtr reroot(NodePtr subroot, const TProblem& state, const std::vector<ActType>& history) {
+        const size_t time = history.size();
+        if (subroot == getRoot())
+            return subroot;
+        rootTime = time;
+        rootHash = MCTSSnapshotHeader::hashHistory(history, time);
+        halving.reset(); // schedule of the old root
+        if (!transpositions.enabled() && moveRoot(subroot, history, std::integral_constant<bool, TStorage<Node>::MovableNodes>())) {
+            root = searchRoot = rootSlot[0];
+            return getRoot();
+        }
+        const size_t nodes = storage->size();
+        const bool compact = nodes > CompactGrowth * std::max(compactNodes, size_t(CompactMinNodes)) ||
+                             (nodeLimit != 0 && nodes >= nodeLimit / 2);
+        if (!compact) {
+            root = searchRoot = subroot;
+            return getRoot();
+        }
+
+        std::unique_ptr<TStorage<Node> > nextStorage(new TStorage<Node>());
+        typename TStorage<Node>::Childs nextSlot;
+        NodePtr nextRoot = nextStorage->add(nextSlot, &subroot->action, 1);
+        transpositions.clear();
+        copyTree(subroot, nextRoot, *nextStorage, state);
+
+        release();
+        storage.swap(nextStorage);
+        rootSlot = std::move(nextSlot);
+        root = searchRoot = rootSlot[0];
+        compactNodes = storage->size();
+        return getRoot();
+    }
+
+    //! Storage cannot move nodes, subtree is kept in place or copied
+    bool moveRoot(NodePtr, const std::vector<ActType>&, std::false_type) {
+        return false;
+    }
+
+    //! Move subroot with its subtree out of its parent into a new root slot, release the rest of the tree in the background
+    /*!
+    * \details Nodes are not copied, only the parent of subroot on the history is looked up.
+    *          Subtree must not link transpositions, they may be in the released part.
+    */
+    bool moveRoot(NodePtr subroot, const std::vector<ActType>& history, std::true_type) {
+        NodePtr parent = nullptr;
+        size_t idx = 0;
+        NodePtr node = getRoot();
+        for (size_t time = rootTime; time < history.size(); ++time) {
+            parent = node;
+            for (idx = 0; idx < node->size() && !(node->child(idx)->action == history[time]); ++idx) {}
+            if (idx == node->size())
+                return false; // catchup adds each played child, not expected
+            node = node->child(idx);
+        }
+        if (node != subroot || parent == nullptr)
+            return false;
+
+        typedef typename TStorage<Node>::Childs Slot;
+        Slot nextSlot;
+        storage->move(nextSlot, parent->childs, idx);
+        if (releaser.joinable())
+            releaser.join(); // one release at a time
+        TStorage<Node>* nodes = storage.get(); // kept, release and the destructor join the thread before it changes
+        releaser = std::thread([nodes] (Slot oldSlot) {
+            nodes->release(oldSlot);
+        }, std::move(rootSlot));
+        rootSlot = std::move(nextSlot);
+        return true;
+    }
+
+    //! Copy statistics and childs of src to dst, state is the state of src
+    void copyTree(const NodePtr src, NodePtr dst, TStorage<Node>& dstStorage, const TProblem& state) {
+        dst->N = static_cast<CountType>(src->N);
+        dst->W += src->W;
+        dst->P = src->P;
+        if (src->transposition != nullptr)
+            return; // linked leaf, expanded again by policy
+        if (src->expansion.isExpanded())
+            dst->expansion.end();
+        if (src->size() == 0)
+            return;
+
+        std::vector<ActType> actions(src->size());
+        for (size_t i = 0; i < src->size(); ++i)
+            actions[i] = src->child(i)->action;
+        dstStorage.add(dst->childs, actions.data(), actions.size());
+        if (transpositions.enabled())
+            transpositions.insert(state.getHash(), dst);
+
+        for (size_t i = 0; i < src->size(); ++i) {
+            if (!transpositions.enabled()) {
+                copyTree(src->child(i), dst->child(i), dstStorage, state);
+                continue;
+            }
+            TProblem next(state); // state is needed only for the hash
+            next.update(actions[i]);
+            copyTree(src->child(i), dst->child(i), dstStorage, next);
+        }
+    }
+
+    //! Release current tree on the background thread
+    void release() {
+        if (releaser.joinable())
+            releaser.join(); // one release at a time
+        typedef typename TStorage<Node>::Childs Slot;
+        releaser = std::thread([] (Slot oldSlot, std::unique_ptr<TStorage<Node> > oldStorage) {
+            oldSlot = Slot(); // childs of heap storage are owned by their parents
+            oldStorage.reset();
+        }, std::move(rootSlot), std::move(storage));
+        rootSlot = Slot();
+    }
+
+    //! Replace tree with an empty root
+    void reset() {
+        release();
+        storage.reset(new TStorage<Node>());
+        ActType act; // artifical root, doesnt hold valid action
+        storage->add(rootSlot, &act, 1);
+        root = searchRoot = rootSlot[0];
+        compactNodes = storage->size();
+        rootTime = 0;
+        rootHash = 0;
+        transpositions.clear();
+        halving.reset();
+    }
+
+    NodePtr getRoot() const {
+        return root;
+    }
+
+    //! Write counters of the last search to the sink, if telemetry is compiled in and set
+    void writeTelemetry(int idxAi, size_t time) const {
+        if (MCTSTelemetry::Enabled && telemetrySink != nullptr)
+            telemetrySink->write(telemetry.json(telemetryLabel, time, idxAi, storage->size()));
+    }
+
     //! Applies the policy step of the Tree Search
     NodePtr policy(const NodePtr subRoot, TProblem& state, int idxAi, std::vector<NodePtr>& visited_nodes, double& W) {
         NodePtr node = subRoot;
-        visited_nodes.push_back(node); // store subroot as policy
-
-        //dirchlet
-        double ratio = 0.75; // ratio of noise for root priors
-        std::vector<double> dirichlet(node->size());
-        computeDirichlet(dirichlet);
+        visit(node, visited_nodes); // store subroot as policy
+        bool root = true; // next selection is of a root child
 
         while (!state.isFinished()) {
 
-            if (node->N == 0) { // leaf node, N will be increased by backprop
-                LockGuard guard(*node); (void)guard; // thread-safe scope on current leaf node
-                if (node->size() == 0) { // enter if have no child
-                    double P[TProblem::MaxActions];
-                    ActType actions[TProblem::MaxActions];
-
-                    ActCounterType nActions = state.getPossibleActions(idxAi, state.getPlayer(), actions);
-                    state.computeMCTS_WP(idxAi, actions, nActions, P, W);
-                    for (ActCounterType i = 0; i < nActions; ++i) { // add all child nodes as leaf nodes
-                        NodePtr n = node->add(actions[i]);
-                        n->P = P[i];
+            if (!node->expansion.isExpanded()) { // leaf node, N can be already increased by virtual loss
+                if (!node->expansion.begin()) {
+                    auto t0 = telemetry.now();
+                    node->expansion.wait(); // another thread adds the childs
+                    telemetry.addWait(t0);
+                } else if (node->size() == 0) { // enter if have no child
+                    std::uint64_t hash = transpositions.enabled() ? state.getHash() : 0;
+                    NodePtr known = transpositions.find(hash);
+                    if (known == nullptr || known == node) {
+                        double P[TProblem::MaxActions];
+                        ActType actions[TProblem::MaxActions];
+
+                        ActCounterType nActions = state.getPossibleActions(idxAi, state.getPlayer(), actions);
+                        auto t0 = telemetry.now();
+                        state.computeMCTS_WP(idxAi, actions, nActions, P, W);
+                        if (rollout != nullptr)
+                            W = rollout->evaluate(idxAi, state, random.local()); // priors are kept
+                        telemetry.addEvaluation(t0);
+                        telemetry.addExpanded();
+                        storage->add(node->childs, actions, nActions); // add all child nodes as leaf nodes
+                        for (ActCounterType i = 0; i < nActions; ++i) {
+                            node->child(i)->P = P[i];
+                        }
+                        transpositions.insert(hash, node);
+                        node->expansion.end();
+                        return node;
                     }
-                    return node;
+                    node->transposition = known; // state was expanded through other actions, no evaluation needed
+                    telemetry.addTransposition();
+                    node->expansion.end();
+                } else {
+                    node->expansion.end(); // childs were added by catchup
                 }
             }
 
+            if (node->transposition != nullptr) { // continue on the shared node, state is the same
+                node = node->transposition;
+                visit(node, visited_nodes);
+                continue;
+            }
+
             // node fully expanded
             // set node to best leaf
-            NodePtr best = node; // init
-            double best_val = -std::numeric_limits<double>::max();
-            double subRootVisitSqrt = sqrt(std::max(static_cast<ActCounterType>(node->N), (ActCounterType)1));
-            for (size_t i = 0; i < node->childs.size(); ++i) {
-                NodePtr child = node->childs[i].get();
-                const size_t idx = i % dirichlet.size(); // index not goes outofbounds for child notes
-                double val = getUCB(child, subRootVisitSqrt, ratio, dirichlet[idx], TProblem::UCT_C);
-                if (best_val < val) {
-                    best = child;
-                    best_val = val;
-                }
+            NodePtr best;
+            if (root && halving && halving->size() == node->size() && node->size() != 0) {
+                const NodePtr parent = node;
+                best = node->child(halving->select([parent] (size_t i, double& N, double& W) {
+                    N = static_cast<double>(parent->child(i)->N);
+                    W = parent->child(i)->W;
+                }));
+            } else {
+                // root priors are mixed with the noise of this search, childs do not need it
+                const bool noisy = root && rootNoise.size() == node->size();
+                best = selectChild(node, Selection::parent(node->N, node->W), noisy ? 0.75 : 1.0, noisy ? rootNoise.data() : nullptr,
+                                   std::integral_constant<bool, TStorage<Node>::ContiguousStats>());
             }
-            ratio = 1.0; // child nodes do not need dirichlet noise for priors
+            root = false;
             node = best;
-            visited_nodes.push_back(node);
+            visit(node, visited_nodes);
             state.update(node->action);
         }
 
         //evaluate board win value also on terminating nodes
+        auto t0 = telemetry.now();
         state.computeMCTS_WP(idxAi, NULL, 0, NULL, W);
+        telemetry.addEvaluation(t0);
 
         return node;
     }
 
+    //! Returns the child with the highest value of the selection policy, node itself if it has no childs
+    NodePtr selectChild(NodePtr node, const typename Selection::Parent& parent, double ratio, const double* noise, std::false_type) const {
+        NodePtr best = node; // init
+        double best_val = -std::numeric_limits<double>::max();
+        for (size_t i = 0; i < node->size(); ++i) {
+            const Node& child = *node->child(i);
+            double val = Selection::value(static_cast<std::uint32_t>(child.N), child.W, child.P,
+                                          noise != nullptr ? noise[i] : 0.0, ratio, parent);
+            if (best_val < val) {
+                best = node->child(i);
+                best_val = val;
+            }
+        }
+        return best;
+    }
+
+    //! Returns the child with the highest value of the selection policy computed on the statistics arrays of the childs
+    NodePtr selectChild(NodePtr node, const typename Selection::Parent& parent, double ratio, const double* noise, std::true_type) const {
+        if (node->size() == 0)
+            return node;
+        const Node& first = *node->child(0);
+        size_t best = Selection::argmax(node->size(),
+                                        reinterpret_cast<const CountType*>(&first.N),
+                                        reinterpret_cast<const double*>(&first.W),
+                                        &first.P,
+                                        noise,
+                                        ratio,
+                                        parent);
+        return node->child(best);
+    }
+
+    //! Store node as visited, apply virtual loss to steer other threads to other paths
+    void visit(NodePtr node, std::vector<NodePtr>& visited_nodes) const {
+        visited_nodes.push_back(node);
+        if (virtualLoss != 0) {
+            node->N += virtualLoss;
+            node->W += virtualLoss * virtualLossW;
+        }
+    }
+
     //! Applies the backprop step of the Tree Search
     void backprop(std::vector<NodePtr>& visited_nodes, double W) const {
         // backprop results to visited nodes
@@ -210,52 +1045,92 @@ private:
             Node& node = *(*it);
             node.N++;
             node.W += W;
+            if (virtualLoss != 0) { // revert virtual loss applied by policy
+                node.N -= virtualLoss;
+                node.W -= virtualLoss * virtualLossW;
+            }
+        }
+    }
+
+    //! Returns true if the owner of the stop flag stops the search
+    bool isStopped() const {
+        return stopFlag != nullptr && stopFlag->load(std::memory_order_relaxed);
+    }
+
+    //! Returns true if search should stop after done iterations
+    bool isBudgetSpent(const NodePtr subroot, unsigned int done, unsigned int policyIter,
+                       std::chrono::steady_clock::time_point start, bool isDeterministic) const {
+        if (nodeLimit != 0 && storage->size() >= nodeLimit)
+            return true;
+
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        if (timeLimit.count() != 0 && elapsed >= timeLimit)
+            return true;
+
+        if (!earlyStop || !isDeterministic || halving)
+            return false; // stochastic selection needs the distribution of all visits, halving its schedule
+
+        double remaining = policyIter - done;
+        if (timeLimit.count() != 0 && elapsed.count() != 0) { // estimate iterations in the remaining time
+            double rate = done / static_cast<double>(elapsed.count());
+            remaining = std::min(remaining, rate * (timeLimit - elapsed).count());
         }
+        CountType best = 0;
+        CountType second = 0;
+        for (size_t i = 0; i < subroot->size(); ++i) {
+            CountType n = subroot->child(i)->N;
+            if (best < n) {
+                second = best;
+                best = n;
+            } else if (second < n) {
+                second = n;
+            }
+        }
+        return best - second > remaining;
     }
 
-    //! Compute Dirichlet distribution
-    void computeDirichlet(std::vector<double>& dirichlet) const {
+    //! Start sequential halving of the root childs for the remaining iterations of the search, lost is the lowest value
+    void beginHalving(const NodePtr subroot, unsigned int budget, double lost, std::true_type) {
+        std::vector<double> P(subroot->size());
+        for (size_t i = 0; i < P.size(); ++i)
+            P[i] = subroot->child(i)->P;
+        halving.reset(new MCTSSequentialHalving());
+        halving->begin(P.data(), P.size(), budget, Selection::Considered, lost, random.local());
+    }
+
+    //! Root is selected as the other levels
+    void beginHalving(const NodePtr, unsigned int, double, std::false_type) {}
+
+    //! Compute Dirichlet distribution of size childs, drawn from the stream of the calling thread
+    void computeDirichlet(std::vector<double>& dirichlet, size_t size) {
+        dirichlet.resize(size);
         std::gamma_distribution<double> distribution(TProblem::DirichletAlpha);
-        std::generate(std::begin(dirichlet), std::end(dirichlet), std::bind(distribution, generator));
+        MCTSRandom& generator = random.local();
+        for (double& value : dirichlet)
+            value = distribution(generator);
         double sum = std::accumulate(std::begin(dirichlet), std::end(dirichlet), 0.0);
         std::transform (std::begin(dirichlet), std::end(dirichlet),
                         std::begin(dirichlet), std::bind2nd(std::divides<double>(), sum));
     }
 
-    //! Returns the value of a node for tree search evaluation
-    double getUCB(const NodePtr& _node, double subRootVisitSqrt, double ratio, double dnoise, double c) const {
-        const Node& node = *_node;
-        double p = ratio * node.P + (1.0-ratio) * dnoise;
-        double n = static_cast<double>(node.N) + std::numeric_limits<double>::epsilon();
-        double q = node.W / n;
-        double u = p * (subRootVisitSqrt/(1+n));
-
-        double val = q + c*u;
-        return val;
-    }
-
-    ActType selectMoveDeterministic(NodePtr node) {
-        NodePtr most_ptr = node; // init
-        CountType most_visit = 0;
-        for (auto it = node->childs.begin(); it != node->childs.end(); ++it) {
-            NodePtr child = it->get();
-            if (most_visit < child->N) {
-                most_ptr = child;
-                most_visit = child->N;
+    ActType selectMoveDeterministic(const std::vector<RootStat>& stats) const {
+        size_t most = 0;
+        std::uint64_t most_visit = 0;
+        for (size_t i = 0; i < stats.size(); ++i) {
+            if (most_visit < stats[i].N) {
+                most = i;
+                most_visit = stats[i].N;
             }
         }
-        return most_ptr->action;
+        return stats[most].action;
     }
 
-    ActType selectMoveStochastic(NodePtr node, double tau, std::vector<std::pair<ActType, double> >& piAction) {
+    ActType selectMoveStochastic(const std::vector<RootStat>& stats, double tau, std::vector<std::pair<ActType, double> >& piAction) {
         std::vector<double> pi;
-        std::vector<NodePtr> childs;
 
         // collect and compute pi
-        for (auto it = node->childs.begin(); it != node->childs.end(); ++it) {
-            NodePtr child = it->get();
-            pi.push_back(pow(child->N, 1.0/tau));
-            childs.push_back(child);
+        for (size_t i = 0; i < stats.size(); ++i) {
+            pi.push_back(pow(stats[i].N, 1.0/tau));
         }
 
         // normalize
@@ -265,20 +1140,248 @@ private:
 
         // store pi/action for dataset
         for (size_t i = 0; i < pi.size(); ++i) {
-            piAction.push_back(std::make_pair(childs[i]->action, pi[i]));
+            piAction.push_back(std::make_pair(stats[i].action, pi[i]));
         }
 
-        // select
+        // select, own stream of the search, so the move does not depend on the iterations of the threads
+        MCTSRandom generator(seed, searches, MoveStream);
         std::discrete_distribution<int> distribution(pi.begin(), pi.end());
         int select = distribution(generator);
-        return childs[select]->action;
+        return stats[select].action;
     }
 
 public:
     //! Construct tree
-    MCTS(unsigned int seed = 0) : generator(seed) {
-        // artifical root, doesnt hold valid action
-        root.reset(new Node(ActType()));
+    MCTS(unsigned int seed = 0)
+        : storage(new TStorage<Node>()), rootTime(0), rootHash(0), searchRoot(nullptr), keepHistory(false), seed(seed), searches(0), virtualLoss(0), virtualLossW(0.0),
+          timeLimit(0), nodeLimit(0), earlyStop(false), iterations(0), verbose(true), samples(nullptr), sampleGame(0), mirrorSamples(false),
+          telemetrySink(nullptr), rollout(nullptr), stopFlag(nullptr) {
+        ActType act; // artifical root, doesnt hold valid action
+        storage->add(rootSlot, &act, 1);
+        root = searchRoot = rootSlot[0];
+        compactNodes = storage->size();
+    }
+
+    MCTS(MCTS&&) = default;
+
+    ~MCTS() {
+        if (releaser.joinable())
+            releaser.join();
+    }
+
+    //! Keep nodes of the played history and their siblings, needed by writeResults
+    /*!
+    * \param keep If false, execute re-roots the tree onto the current state and releases the other nodes
+    */
+    void setKeepHistory(bool keep) {
+        keepHistory = keep;
+    }
+
+    //! Enable virtual loss for tree parallel policy
+    /*!
+    * \param count Number of virtual visits added to each node on the path, zero disables virtual loss
+    * \param value Value of one virtual visit, should be the value of a lost game from the view of the ai
+    */
+    void setVirtualLoss(CountType count, double value) {
+        virtualLoss = count;
+        virtualLossW = value;
+    }
+
+    //! Enable transposition table, states reached through different actions share one node
+    /*!
+    * \param log2Size Table has 2^log2Size entries, zero disables the table
+    * \note Requires TProblem::getHash, must be set before the first execute
+    */
+    void setTranspositionTable(unsigned int log2Size) {
+        transpositions.resize(log2Size);
+    }
+
+    //! Limit the duration of each search
+    /*!
+    * \param milliseconds Search stops after this duration, zero disables the limit
+    */
+    void setTimeLimit(unsigned int milliseconds) {
+        timeLimit = std::chrono::milliseconds(milliseconds);
+    }
+
+    //! Limit the number of nodes, i.e. the memory of the tree
+    /*!
+    * \param nodes Search stops when tree has this many nodes, zero disables the limit
+    * \note Memory of one node is getNodeBytes, childs of heap storage add some overhead
+    */
+    void setNodeLimit(size_t nodes) {
+        nodeLimit = nodes;
+    }
+
+    //! Stop deterministic search when the most visited child cannot be overtaken by the remaining iterations
+    void setEarlyStop(bool enable) {
+        earlyStop = enable;
+    }
+
+    //! Print statistics of root childs after each search, enabled by default
+    void setVerbose(bool enable) {
+        verbose = enable;
+    }
+
+    //! Send state and policy of each stochastic move to stream as samples of game, null disables
+    /*!
+    * \details Caller finishes the game on the stream, callers storing the samples itself see getPolicy.
+    */
+    void setSampleStream(MCTSSampleStream* stream, std::uint32_t game) {
+        samples = stream;
+        sampleGame = game;
+    }
+
+    //! Send the mirrored sample of each stochastic move too, problems without symmetry add none
+    void setMirrorSamples(bool enable) {
+        mirrorSamples = enable;
+    }
+
+    //! Write counters of each search as a json line, see MCTSTelemetry
+    /*!
+    * \param sink Destination of the lines, may be shared by many searches, null disables
+    * \param label Added to each line to tell searches apart, e.g. game and player
+    * \note Without the define MCTS_TELEMETRY counters are compiled out and no lines are written
+    */
+    void setTelemetry(MCTSTelemetrySink* sink, const std::string& label = std::string()) {
+        telemetrySink = sink;
+        telemetryLabel = label;
+    }
+
+    //! Evaluate leafs by random playouts, e.g. in pure mcts without dnn, see MCTSRollout
+    /*!
+    * \param playouts Shared by the trees of all players, not owned, null evaluates by computeMCTS_WP
+    */
+    void setRollout(const MCTSRollout<TProblem>* playouts) {
+        rollout = playouts;
+    }
+
+    //! Stop searches when flag is set, e.g. by stop of MCTSEngine
+    /*!
+    * \details Flag is read before each iteration, the search returns after the iterations in flight.
+    *          First iteration always runs, so the root has statistics to select a move.
+    * \param flag Owned by the caller, null disables
+    */
+    void setStopFlag(const std::atomic<bool>* flag) {
+        stopFlag = flag;
+    }
+
+    //! Release the whole tree, e.g. for a new game
+    void clear() {
+        reset();
+    }
+
+    //! Number of policy iterations of the last search
+    unsigned int getIterations() const {
+        return iterations;
+    }
+
+    //! Actions of root childs and their probability to be played in the last search, empty if it was deterministic
+    const std::vector<std::pair<ActType, double> >& getPolicy() const {
+        return policyPi;
+    }
+
+    //! Number of nodes in the tree
+    size_t getNodeCount() const {
+        return storage->size();
+    }
+
+    //! Size of one node in bytes
+    static size_t getNodeBytes() {
+        return sizeof(Node);
+    }
+
+    //! Write the tree as binary snapshot, e.g. an opening book, see MCTSSnapshotHeader
+    /*!
+    * \details Nodes are collected breadth-first without recursion, then written in blocks.
+    *          Tree must not be searched at the same time.
+    */
+    void writeSnapshot(std::ostream& stream) const {
+        typedef MCTSSnapshotNode<ActType> Record;
+        static_assert(std::is_trivially_copyable<ActType>::value, "Actions are written as raw bytes");
+
+        std::vector<NodePtr> order(1, getRoot()); // breadth-first, childs of a node are contiguous
+        for (size_t i = 0; i < order.size(); ++i) {
+            NodePtr node = order[i];
+            if (node->transposition != nullptr)
+                continue; // linked leaf
+            for (size_t c = 0; c < node->size(); ++c)
+                order.push_back(node->child(c));
+        }
+
+        MCTSSnapshotHeader header = MCTSSnapshotHeader::create(sizeof(Record), sizeof(ActType));
+        header.nodeCount = order.size();
+        header.rootTime = rootTime;
+        header.rootHash = rootHash;
+        header.iterations = static_cast<std::uint64_t>(getRoot()->N);
+        stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        std::vector<Record> block;
+        block.reserve(4096);
+        std::uint64_t next = 1; // index of the first child of the next node with childs
+        for (size_t i = 0; i < order.size(); ++i) {
+            NodePtr node = order[i];
+            const bool linked = node->transposition != nullptr;
+            Record record = Record(); // value initialization also zeroes the padding
+            record.N = static_cast<std::uint64_t>(node->N);
+            record.W = node->W;
+            record.P = node->P;
+            record.count = linked ? 0 : static_cast<std::uint16_t>(node->size());
+            record.first = record.count != 0 ? static_cast<std::uint32_t>(next) : 0;
+            record.flags = !linked && node->expansion.isExpanded() ? Record::Expanded : 0;
+            record.action = node->action;
+            next += record.count;
+            block.push_back(record);
+            if (block.size() == block.capacity() || i + 1 == order.size()) {
+                stream.write(reinterpret_cast<const char*>(block.data()), block.size()*sizeof(Record));
+                block.clear();
+            }
+        }
+        if (!stream)
+            throw std::runtime_error("Could not write tree snapshot");
+    }
+
+    //! Replace the tree by a snapshot, e.g. an opening book searched from the initial state
+    /*!
+    * \details Snapshot must be written by a tree of the same problem and player, values are from its view.
+    *          Its root must be on the history of the game, otherwise the first search resets the tree, see catchup.
+    *          Nodes are not added to the transposition table, they are searched as a tree.
+    */
+    void loadSnapshot(const MCTSSnapshotFile& file) {
+        typedef MCTSSnapshotNode<ActType> Record;
+        const MCTSSnapshotHeader& header = file.header();
+        const Record* records = file.nodes<ActType>();
+        if (header.nodeCount == 0)
+            throw std::runtime_error("Tree snapshot has no root");
+
+        reset();
+        std::vector<NodePtr> nodes(header.nodeCount, nullptr);
+        std::vector<ActType> actions;
+        nodes[0] = getRoot();
+        std::uint64_t next = 1;
+        for (std::uint64_t i = 0; i < header.nodeCount; ++i) {
+            const Record& record = records[i];
+            NodePtr node = nodes[i];
+            node->N = static_cast<CountType>(record.N);
+            node->W += record.W;
+            node->P = record.P;
+            if (record.flags & Record::Expanded)
+                node->expansion.end();
+            if (record.count == 0)
+                continue;
+            if (record.first != next || next + record.count > header.nodeCount)
+                throw std::runtime_error("Tree snapshot is not breadth-first");
+            actions.resize(record.count);
+            for (std::uint16_t c = 0; c < record.count; ++c)
+                actions[c] = records[next + c].action;
+            storage->add(node->childs, actions.data(), actions.size());
+            for (std::uint16_t c = 0; c < record.count; ++c)
+                nodes[next + c] = node->child(c);
+            next += record.count;
+        }
+        rootTime = header.rootTime;
+        rootHash = header.rootHash;
+        compactNodes = storage->size(); // a book is compacted when the game grew it
     }
 
     //! Execute a search on the current state for the ai, return the action
@@ -287,11 +1390,51 @@ public:
                     const TProblem& cstate,
                     unsigned int policyIter,
                     const std::vector<ActType>& history)
+    {
+        std::vector<RootStat> stats;
+        search(idxAi, isDeterministic, cstate, policyIter, history);
+        getRootStatistics(stats);
+        ActType action = selectMove(idxAi, isDeterministic, cstate, history.size(), stats);
+        getHalvingChoice(action); // samples keep the visit distribution of selectMove
+        return action;
+    }
+
+    //! Search the current state for the ai without selecting a move, see getRootStatistics
+    /*!
+    * \details Deterministic search of a state with one action returns after expanding the root.
+    */
+    void search(int idxAi,
+                bool isDeterministic,
+                const TProblem& cstate,
+                unsigned int policyIter,
+                const std::vector<ActType>& history)
     {
         // walk tree according to history
         NodePtr subroot = catchup(cstate, history);
-
+        if (!keepHistory)
+            subroot = reroot(subroot, cstate, history);
+
+        auto start = std::chrono::steady_clock::now();
+        iterations = 1;
+        policyPi.clear();
+        halving.reset();
+        rootNoise.clear();
+        ++searches;
+#ifdef _OPENMP
+        random.begin(seed, searches, omp_get_max_threads());
+#else
+        random.begin(seed, searches, 1);
+#endif
+        const NodePtr linked = subroot->transposition != nullptr ? subroot->transposition : subroot;
+        if (Selection::RootNoise && linked->size() != 0)
+            computeDirichlet(rootNoise, linked->size()); // root was expanded by a previous search
+#ifdef _OPENMP
+        telemetry.begin(omp_get_max_threads());
+#else
+        telemetry.begin(1);
+#endif
         { // make sure root is expanded before multithreaded execution
+            auto busy = telemetry.now();
             double W = 0;
             TProblem state(cstate); // NOTE: copy of state is mandatory
             std::vector<NodePtr> policyNodes;
@@ -301,36 +1444,151 @@ public:
 
             // backpropagation of policy node
             backprop(policyNodes, W);
+            telemetry.addIteration(policyNodes.size()-1);
+            telemetry.addBusy(busy);
+            if (subroot->transposition != nullptr)
+                subroot = subroot->transposition; // state was expanded through other actions
+            searchRoot = subroot;
 
             // only one choice, dont think
             if (subroot->size() == 1 && isDeterministic) {
-                NodePtr child = subroot->childs[0].get();
-                return child->action;
+                writeTelemetry(idxAi, history.size());
+                return;
             }
+
+            if (Selection::RootNoise && rootNoise.size() != subroot->size())
+                computeDirichlet(rootNoise, subroot->size()); // root was expanded by the first iteration
+            if (subroot->size() != 0 && policyIter > 1)
+                beginHalving(subroot, policyIter - 1, cstate.getLostValue(idxAi), std::integral_constant<bool, Selection::RootHalving>());
         }
 
-        #pragma omp parallel for schedule(dynamic, 6)
-        for (int i = 1; i < (int)policyIter; ++i) { // signed int to support omp2 for msvc
-            double W = 0;
-            TProblem state(cstate); // NOTE: copy of state is mandatory
-            std::vector<NodePtr> policyNodes;
+        // each thread takes iterations until all are started or a limit stops the search
+        std::atomic<unsigned int> started(1);
+        std::atomic<unsigned int> done(1);
+        std::atomic<bool> stop(false);
+        #pragma omp parallel
+        {
+            auto busy = telemetry.now();
+            while (!stop && !isStopped() && started++ < policyIter) {
+                double W = 0;
+                TProblem state(cstate); // NOTE: copy of state is mandatory
+                std::vector<NodePtr> policyNodes;
+
+                // selection and expansion
+                NodePtr node = policy(subroot, state, idxAi, policyNodes, W);
+
+                // backpropagation of policy node
+                backprop(policyNodes, W);
+                telemetry.addIteration(policyNodes.size()-1);
+
+                // checked after each iteration, with a slow dnn a few iterations already overrun a time limit
+                unsigned int count = ++done;
+                if (isBudgetSpent(subroot, count, policyIter, start, isDeterministic))
+                    stop = true;
+            }
+            telemetry.addBusy(busy);
+        }
+        iterations = done;
+        writeTelemetry(idxAi, history.size());
+    }
 
-            // selection and expansion
-            NodePtr node = policy(subroot, state, idxAi, policyNodes, W);
+    //! Visits and values of the childs of the state of the last search
+    void getRootStatistics(std::vector<RootStat>& stats) const {
+        stats.clear();
+        for (size_t i = 0; i < searchRoot->size(); ++i) {
+            NodePtr child = searchRoot->child(i);
+            RootStat stat;
+            stat.action = child->action;
+            stat.N = static_cast<std::uint64_t>(child->N);
+            stat.W = child->W;
+            if (halving && halving->size() == searchRoot->size()) { // visits follow the schedule, report its selections
+                std::uint64_t selected = halving->getSelected(i);
+                stat.W = stat.N != 0 ? stat.W * selected / stat.N : 0.0;
+                stat.N = selected;
+            }
+            stats.push_back(stat);
+        }
+    }
 
-            // backpropagation of policy node
-            backprop(policyNodes, W);
+    //! Best remaining candidate of the sequential halving of the last search, see MCTSSequentialHalving::getBest
+    /*!
+    * \details Gumbel selection plays this child instead of the most visited one, also in stochastic games,
+    *          the gumbel variables drawn at root are its exploration.
+    *          Root parallel searches select by the merged visits, each tree has drawn other gumbel variables.
+    * \return False if root was not selected by halving, e.g. with PUCT or if root has one child
+    */
+    bool getHalvingChoice(ActType& action) const {
+        if (!halving || halving->size() != searchRoot->size() || searchRoot->size() == 0)
+            return false;
+        const NodePtr parent = searchRoot;
+        action = parent->child(halving->getBest([parent] (size_t i, double& N, double& W) {
+            N = static_cast<double>(parent->child(i)->N);
+            W = parent->child(i)->W;
+        }))->action;
+        return true;
+    }
+
+    //! Most visited reply to act in the tree of the last search, e.g. the move to ponder on
+    /*!
+    * \return False if act is no child of the state of the last search or it has no visited childs
+    */
+    bool getExpectedReply(const ActType& act, ActType& reply) const {
+        for (size_t i = 0; i < searchRoot->size(); ++i) {
+            NodePtr child = searchRoot->child(i);
+            if (!(child->action == act))
+                continue;
+            if (child->transposition != nullptr)
+                child = child->transposition;
+            CountType most = 0;
+            for (size_t j = 0; j < child->size(); ++j) {
+                if (most < child->child(j)->N) {
+                    most = child->child(j)->N;
+                    reply = child->child(j)->action;
+                }
+            }
+            return most != 0;
+        }
+        return false;
+    }
+
+    //! Add statistics of another tree of the same state, childs unknown to stats are appended
+    static void mergeRootStatistics(std::vector<RootStat>& stats, const std::vector<RootStat>& other) {
+        for (const RootStat& stat : other) {
+            bool found = false;
+            for (RootStat& known : stats) {
+                if (known.action == stat.action) {
+                    known.N += stat.N;
+                    known.W += stat.W;
+                    found = true;
+                    break;
+                }
+            }
+            if (!found)
+                stats.push_back(stat);
         }
+    }
+
+    //! Select the action of the search from root statistics, e.g. merged over the trees of a root parallel search
+    /*!
+    * \param time Length of the history, stochastic moves are greedier late in the game
+    * \param stats Childs of the state, e.g. of getRootStatistics
+    */
+    ActType selectMove(int idxAi, bool isDeterministic, const TProblem& cstate, size_t time, const std::vector<RootStat>& stats) {
+        if (stats.empty())
+            throw std::logic_error("No root statistics to select a move from");
 
         if (isDeterministic) {
-            ActType action = selectMoveDeterministic(subroot);
-
-            for (auto it = subroot->childs.begin(); it != subroot->childs.end(); ++it) {
-                NodePtr child = it->get();
-                std::cout << TProblem::act2str(child->action) << "; "
-                          << "W: " << child->W << "; "
-                          << "N: " << child->N << "; "
-                          << "Q: " << child->W/child->N
+            if (stats.size() == 1)
+                return stats[0].action; // only one choice
+
+            ActType action = selectMoveDeterministic(stats);
+
+            for (size_t i = 0; verbose && i < stats.size(); ++i) {
+                RootStat child = stats[i]; // act2str takes a reference
+                std::cout << TProblem::act2str(child.action) << "; "
+                          << "W: " << child.W << "; "
+                          << "N: " << child.N << "; "
+                          << "Q: " << child.W/child.N
                           << std::endl;
             }
 
@@ -338,25 +1596,30 @@ public:
 
         } else { // stochastic
             double tau = 1.0;
-            if (history.size()>60)
+            if (time>60)
                 tau = 0.05;
             std::vector<float> stateDNN;
             std::vector<float> policyDNN;
-            std::vector<std::pair<ActType, double> > piAction;
-
-            ActType action = selectMoveStochastic(subroot, tau, piAction);
-            cstate.getGameStateDNN(stateDNN, idxAi);
-            cstate.getPolicyTrainDNN(policyDNN, idxAi, piAction);
-            cstate.storeGamePolicyDNN(stateDNN, policyDNN);
+            std::vector<std::pair<ActType, double> >& piAction = policyPi;
+
+            piAction.clear();
+            ActType action = selectMoveStochastic(stats, tau, piAction);
+            if (samples != nullptr) {
+                cstate.getGameStateDNN(stateDNN, idxAi);
+                cstate.getPolicyTrainDNN(policyDNN, idxAi, piAction);
+                samples->add(sampleGame, static_cast<std::uint32_t>(time), idxAi, stateDNN, policyDNN);
+                if (mirrorSamples && cstate.mirrorSampleDNN(stateDNN, policyDNN))
+                    samples->add(sampleGame, static_cast<std::uint32_t>(time), idxAi, stateDNN, policyDNN);
+            }
 
-            for (size_t i = 0; i < subroot->childs.size(); ++i) {
+            for (size_t i = 0; verbose && i < stats.size(); ++i) {
                 double pi = piAction[i].second;
-                NodePtr child = subroot->childs[i].get();
-                std::cout << TProblem::act2str(child->action) << "; "
+                RootStat child = stats[i]; // act2str takes a reference
+                std::cout << TProblem::act2str(child.action) << "; "
                           << "Pi: " << pi << "; "
-                          << "W: " << child->W << "; "
-                          << "N: " << child->N << "; "
-                          << "Q: " << child->W/child->N
+                          << "W: " << child.W << "; "
+                          << "N: " << child.N << "; "
+                          << "Q: " << child.W/child.N
                           << std::endl;
             }
 
@@ -384,27 +1647,32 @@ public:
         stream << std::endl;
 
 
-        for (auto it = next->childs.begin(); it != next->childs.end(); ++it) {
-            NodePtr child = it->get();
+        for (size_t i = 0; i < next->size(); ++i) {
+            NodePtr child = next->child(i);
             writeBranchNodes(branch+1, next, child, time, maxIter, opponent, stream);
         }
     }
 
     template <typename T>
     void writeResults(const TProblem& state, int idxAi, float maxIter, const std::vector<ActType>& history, T& stream) {
+        if (rootTime != 0)
+            throw std::logic_error("Tree was re-rooted, writeResults requires setKeepHistory(true)");
+
         stream << "Branch;ID;ParentID;Time;Actions;Opponent;Select;Visit;Win";
         stream << std::endl;
         stream << "0;0;0;0;ROOT;0;0;0;0";
         stream << std::endl;
 
-        NodePtr parent = root.get();
-        NodePtr child = root.get();
+        NodePtr parent = getRoot();
+        NodePtr child = getRoot();
         for (size_t time = 0; time < history.size() ; ++time) {
             ActType act = history[time];
+            if (parent->transposition != nullptr)
+                parent = parent->transposition;
             int opponent = state.getPlayer(time) != idxAi ? 1 : 0;
 
-            for (auto it = parent->childs.begin(); it != parent->childs.end(); ++it) {
-                NodePtr next = it->get();
+            for (size_t i = 0; i < parent->size(); ++i) {
+                NodePtr next = parent->child(i);
 
                 if (next->action == act) {
                     child = next; // set child to selected node
@@ -0,0 +1,83 @@
+#ifndef PONDER_HPP
+#define PONDER_HPP
+
+#include <limits>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <exception>
+
+//! Search on the time of the opponent, one tree at a time
+/*!
+ * \details After its move, a tree keeps searching the state of the opponent on a background thread.
+ *          When the move of the opponent arrives, the search is stopped by the stop flag of the tree, see MCTS::setStopFlag,
+ *          it returns after the iterations in flight, so the tree is not changed after stop.
+ *          The next search of the tree catches up with the move, its subtree with the pondered visits becomes the subroot.
+ *          Pondering runs until stop or a time or node limit of the tree, it does not select moves or send samples.
+ *          Threads of pondering compete with the search of the opponent, if it runs in the same process.
+ * \author adamp87
+*/
+template <class TMCTS, class TProblem>
+class MCTSPonder {
+    typedef typename TProblem::ActType ActType;
+
+    TMCTS* tree; //!< tree of the running search, null if idle
+    std::atomic<bool> stopping; //!< stop flag of the tree while pondering
+    std::thread worker;
+    std::exception_ptr error; //!< of the search, thrown by stop
+
+    MCTSPonder(const MCTSPonder&) = delete;
+
+public:
+    MCTSPonder() : tree(nullptr), stopping(false) {}
+
+    ~MCTSPonder() {
+        if (worker.joinable()) {
+            stopping = true;
+            worker.join();
+            tree->setStopFlag(nullptr);
+        }
+    }
+
+    //! Search state of the opponent of idxAi on tree in the background, state and history are copied
+    void start(TMCTS& tree, int idxAi, const TProblem& state, const std::vector<ActType>& history) {
+        stop();
+        this->tree = &tree;
+        stopping = false;
+        tree.setStopFlag(&stopping);
+        worker = std::thread([this, idxAi, state, history] () {
+            try {
+                this->tree->search(idxAi, false, state, std::numeric_limits<unsigned int>::max(), history);
+            } catch (...) {
+                error = std::current_exception();
+            }
+        });
+    }
+
+    //! Tree of the running search, null if idle
+    const TMCTS* getTree() const {
+        return tree;
+    }
+
+    //! Stop the search of the previous start, the tree can search again
+    /*!
+    * \return Policy iterations of pondering, zero if idle
+    */
+    unsigned int stop() {
+        if (!worker.joinable())
+            return 0;
+        stopping = true;
+        worker.join();
+        tree->setStopFlag(nullptr);
+        unsigned int iterations = tree->getIterations();
+        tree = nullptr;
+        if (error) {
+            std::exception_ptr e = error;
+            error = nullptr;
+            std::rethrow_exception(e);
+        }
+        return iterations;
+    }
+};
+
+#endif // PONDER_HPP
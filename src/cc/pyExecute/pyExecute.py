@@ -1,4 +1,6 @@
 import os
+import time
+import struct
 import threading
 import subprocess
 from argparse import ArgumentParser
@@ -9,6 +11,7 @@ import tensorflow as tf
 from tqdm import tqdm
 
 from Alpha4.database import Database
+from Alpha4.replay import ReplayBuffer
 from Alpha4.model_rt import DNNPredictRT as Predict
 from Alpha4.logger import get_logger, add_file_logger
 from Alpha4.connect4 import Connect4 as Problem
@@ -67,168 +70,384 @@ def debug_state(state, policy):
     print("NOAC min:{1:4.2f}, max:{1:4.2f}".format(np.min(data), np.max(data)))
 
 
-class DNNStatePolicyHandler(threading.Thread, Database):
-    def __init__(self, log, datafilepath_hdf, dims_state, dims_policy, zmq_context, port="5557"):
-        threading.Thread.__init__(self)
-        Database.__init__(self, log, datafilepath_hdf, dims_state, dims_policy)
-        self.socket = zmq_context.socket(zmq.REP)
-        self.socket.bind("tcp://*:{0}".format(port))
+SAMPLE_MAGIC = b'MCSS'
+SAMPLE_VERSION = 1
+SAMPLE_KIND_END = 1
+SAMPLE_FRAME = struct.Struct('=4sHBBIIIIbbxx')  # SampleFrame of samplestream.hpp
 
-        self.dims_state = dims_state
-        self.dims_policy = dims_policy
-        self.data_state = []
-        self.data_policy = []
 
-    def store_and_reset(self, game_idx, game_result):
-        self.store(game_idx, self.data_state, self.data_policy, game_result)
+class DNNStatePolicyHandler(threading.Thread, ReplayBuffer):
+    """
+    Stores the training samples streamed by MCTSSampleStream of the CPP MCTS, see samplestream.hpp.
+    Samples of a game are collected until its end frame, then stored at once with the result as value.
+    """
+    def __init__(self, log, path, dims_state, dims_policy, zmq_context, port="5557", window=0):
+        threading.Thread.__init__(self)
+        ReplayBuffer.__init__(self, log, path, dims_state, dims_policy, window)
+        self.socket = zmq_context.socket(zmq.PULL)
+        self.socket.bind("tcp://*:{0}".format(port))
 
-        self.datafile.flush()
-        self.data_state.clear()
-        self.data_policy.clear()
+        self.state_size = int(np.prod(dims_state))
+        self.policy_size = int(np.prod(dims_policy))
+        self.games = {}  # game id: list of (player, state, policy)
+
+    def store_game(self, game_id, result):
+        samples = self.games.pop(game_id, [])
+        if not samples:
+            return
+        players = np.array([sample[0] for sample in samples])
+        # NCWH to NWHC, once for all samples of the game
+        state = np.stack([sample[1] for sample in samples])
+        state.shape = (len(samples), self.dims_state[2], self.dims_state[0], self.dims_state[1])
+        policy = np.stack([sample[2] for sample in samples])
+        policy.shape = (len(samples), self.dims_policy[2], self.dims_policy[0], self.dims_policy[1])
+        state = np.transpose(state, axes=(0, 2, 3, 1))
+        policy = np.transpose(policy, axes=(0, 2, 3, 1))
+        value = np.array(result, dtype=np.float32)[players]
+
+        self.store(self.get_game_count() + 1, state, policy, value)
 
     def run(self):
-        def send_ok(socket):
-            #  Send reply back to client
-            dummy = np.ones(2, dtype=np.int8)
-            dummy[0] = 4
-            dummy[1] = 2
-            data = np.array(dummy).tobytes()
-            socket.send(data)
-
         while True:
             try:
-                #  receive state
-                message = self.socket.recv()
-                state = np.frombuffer(message, dtype=np.float32)
-                state.shape = (self.dims_state[2], self.dims_state[0], self.dims_state[1])
-                send_ok(self.socket)
-
-                # receive policy
-                message = self.socket.recv()
-                policy = np.frombuffer(message, dtype=np.float32)
-                policy.shape = (self.dims_policy[2], self.dims_policy[0], self.dims_policy[1])
-                send_ok(self.socket)
-
-                # NCWH to NWHC
-                state = np.transpose(state, axes=(1, 2, 0))
-                policy = np.transpose(policy, axes=(1, 2, 0))
-
-                self.data_state.append(state)
-                self.data_policy.append(policy)
+                message = self.socket.recv(copy=False).buffer
+                magic, version, kind, player, game_id, move, state_size, policy_size, res_white, res_black = \
+                    SAMPLE_FRAME.unpack_from(message)
+                if magic != SAMPLE_MAGIC or version != SAMPLE_VERSION:
+                    self.log.error("Dropped message, not a sample stream: {0}".format(bytes(message[:4])))
+                    continue
+                if kind == SAMPLE_KIND_END:
+                    self.log.debug("Game {0} finished after {1} moves, result {2}".format(
+                        game_id, move, [res_white, res_black]))
+                    self.store_game(game_id, [res_white, res_black])
+                    continue
+                if state_size != self.state_size or policy_size != self.policy_size:
+                    self.log.error("Dropped sample of game {0}, dimensions differ from the problem".format(game_id))
+                    continue
+
+                data = np.frombuffer(message, dtype=np.float32, offset=SAMPLE_FRAME.size)
+                self.games.setdefault(game_id, []).append((player, data[:state_size], data[state_size:]))
             except zmq.error.ContextTerminated:
                 self.socket.close()
                 return
 
 
+def get_endpoint(args, port):
+    """Endpoint of a local server for the CPP MCTS, ipc avoids the tcp stack on the same host"""
+    if args.ipc:
+        return "ipc:///tmp/alpha4_{0}".format(port)
+    return "tcp://localhost:{0}".format(port)
+
+
+WIRE_MAGIC = b'MC\xc1\xff'  # NaN as float32, dense states never start with it
+WIRE_VERSION = 1
+WIRE_FLAG_HALF = 1
+
+
+def decode_states(message, state_size):
+    """
+    Decodes a request of the CPP MCTS, either dense float32 states or the compact format of wireformat.hpp.
+    Expansion is vectorized over all planes of all states of the request.
+
+    :return: state: Array of shape (states, state_size), NCWH of each state
+    :return: flags: Flags of the compact format for the reply, None for dense
+    """
+    if message[:4] != WIRE_MAGIC:
+        state = np.frombuffer(message, dtype=np.float32)
+        state.shape = (-1, state_size)
+        return state, None
+
+    version, flags, n_states, n_planes, plane_size = struct.unpack_from('=HHIII', message, 4)
+    if version != WIRE_VERSION or n_planes * plane_size != state_size:
+        raise ValueError("Compact request does not match the server, version {0}".format(version))
+    header_size = 20
+    kinds = np.frombuffer(message, dtype=np.uint8, count=n_states * n_planes, offset=header_size)
+    value_bytes = 2 if flags & WIRE_FLAG_HALF else 4
+    bit_bytes = (plane_size + 7) // 8
+    length = np.array([0, 4, bit_bytes, plane_size * value_bytes])[kinds]  # zero, constant, bits, values
+    offset = header_size + kinds.size + np.concatenate(([0], np.cumsum(length)[:-1]))
+
+    buf = np.frombuffer(message, dtype=np.uint8)
+    planes = np.zeros((kinds.size, plane_size), dtype=np.float32)
+    idx = np.nonzero(kinds == 1)[0]
+    if idx.size:
+        planes[idx] = buf[offset[idx, None] + np.arange(4)].copy().view(np.float32)
+    idx = np.nonzero(kinds == 2)[0]
+    if idx.size:
+        bits = np.unpackbits(buf[offset[idx, None] + np.arange(bit_bytes)], axis=1, bitorder='little')
+        planes[idx] = bits[:, :plane_size]
+    idx = np.nonzero(kinds == 3)[0]
+    if idx.size:
+        values = buf[offset[idx, None] + np.arange(plane_size * value_bytes)].copy()
+        planes[idx] = values.view(np.float16 if value_bytes == 2 else np.float32)
+    return planes.reshape((n_states, state_size)), flags
+
+
+def encode_reply(data, flags):
+    """Encodes rows of policy and value in the format of the request, see decode_states"""
+    if flags is None:
+        return data.astype(np.float32).tobytes()
+    dtype = np.float16 if flags & WIRE_FLAG_HALF else np.float32
+    header = WIRE_MAGIC + struct.pack('=HHII', WIRE_VERSION, flags & WIRE_FLAG_HALF, data.shape[0], data.shape[1])
+    return header + data.astype(dtype).tobytes()
+
+
+class BatchStats:
+    """Latency and occupancy of the batches of a DNNPredict server, logged every interval batches"""
+    def __init__(self, log, name, batch_size, interval=1000):
+        self.log = log
+        self.name = name
+        self.batch_size = batch_size
+        self.interval = interval
+        self.reset()
+
+    def reset(self):
+        self.batches = 0
+        self.states = 0
+        self.requests = 0
+        self.wait = 0.0  # seconds from first request of a batch until the prediction starts
+        self.predict = 0.0  # seconds of the predictions
+        self.max_latency = 0.0  # seconds from first request until the replies are sent
+
+    def add(self, requests, states, wait, predict, latency):
+        self.batches += 1
+        self.requests += requests
+        self.states += states
+        self.wait += wait
+        self.predict += predict
+        self.max_latency = max(self.max_latency, latency)
+        if self.batches == self.interval:
+            self.log.info("DNN {0}: {1:.1f} states/batch, occupancy {2:.0f}%, {3:.1f} requests/batch, "
+                          "wait {4:.2f} ms, predict {5:.2f} ms, max latency {6:.2f} ms".format(
+                              self.name, self.states / self.batches,
+                              100.0 * self.states / (self.batches * self.batch_size),
+                              self.requests / self.batches, 1000.0 * self.wait / self.batches,
+                              1000.0 * self.predict / self.batches, 1000.0 * self.max_latency))
+            self.reset()
+
+
 class DNNPredict(threading.Thread, Predict):
-    def __init__(self, input_dim, output_dim, zmq_context, port="5555"):
+    """
+    Inference server for the CPP MCTS.
+    With batch_size 1 it is a REP socket, each request is predicted on its own.
+    With a larger batch_size it is a ROUTER socket, requests of many clients are gathered into one prediction.
+    A batch is predicted when it holds batch_size states or max_wait milliseconds passed since its first request.
+    Clients are unchanged REQ sockets, a request can hold several concatenated states in both modes.
+    """
+    def __init__(self, log, input_dim, output_dim, zmq_context, port="5555", ipc=False, batch_size=1, max_wait=2.0):
         threading.Thread.__init__(self)
-        Predict.__init__(self, input_dim, output_dim)
-        self.socket = zmq_context.socket(zmq.REP)
+        Predict.__init__(self, log, input_dim, output_dim)
+        self.batch_size = batch_size
+        self.max_wait = max_wait
+        self.socket = zmq_context.socket(zmq.ROUTER if batch_size > 1 else zmq.REP)
         self.socket.bind("tcp://*:{0}".format(port))
+        if ipc:
+            self.socket.bind("ipc:///tmp/alpha4_{0}".format(port))
         self.port = port
+        self.stats = BatchStats(log, port, batch_size)
+
+    def predict_states(self, states):
+        """
+        Predict decoded states of NCWH layout, returns one row of policy and value for each state.
+        Requests are decoded, stacked and transposed by numpy on the host, the model gets one array of the batch.
+        Requests arrive as bytes in host memory and DNNPredictLite only takes numpy arrays, so one decoder serves all
+        backends. The batch is copied to the device once, by the predict_batch of the backend.
+        """
+        state = np.concatenate(states) if len(states) > 1 else states[0]
+        state = state.reshape((-1, self.input_dim[2], self.input_dim[0], self.input_dim[1]))
+        state = np.transpose(state, axes=(0, 2, 3, 1))  # NCWH to NWHC
+        batch = state.shape[0]
+
+        # predict
+        value, policy = self.predict_batch(state)
+
+        # NWHC to NCWH
+        policy.shape = (batch, ) + tuple(self.output_dim)
+        policy = np.transpose(policy, axes=(0, 3, 1, 2))
+        policy.shape = (batch, policy.size // batch)
+
+        policy_size = self.output_dim[0]*self.output_dim[1]*self.output_dim[2]
+        data = np.empty((batch, policy_size+1), dtype=np.float32)
+        data[:, :policy_size] = policy
+        data[:, policy_size] = value
+        return data
 
     def run(self):
+        if self.batch_size > 1:
+            self.run_batched()
+            return
+        state_size = self.input_dim[0] * self.input_dim[1] * self.input_dim[2]
         while True:
             try:
-                # get state
+                # get states, a request can hold a batch of concatenated states
                 message = self.socket.recv()
-                state = np.frombuffer(message, dtype=np.float32)
-                state.shape = (1, self.input_dim[2], self.input_dim[0], self.input_dim[1])
-                state = np.transpose(state, axes=(0, 2, 3, 1))  # NCWH to NWHC
+                t0 = time.perf_counter()
+                state, flags = decode_states(message, state_size)
+                data = self.predict_states([state])
+                t1 = time.perf_counter()
 
-                # predict
-                value, policy = self.predict(state)
+                # send prediction, one row for each state
+                self.socket.send(encode_reply(data, flags))
+                self.stats.add(1, data.shape[0], 0.0, t1 - t0, time.perf_counter() - t0)
 
-                # NWHC to NCWH
-                policy.shape = self.output_dim
-                policy = np.transpose(policy, axes=(2, 0, 1))
-                policy.shape = (policy.size, )
+            except zmq.error.ContextTerminated:
+                self.socket.close()
+                return
 
-                # send prediction
-                data = np.empty((1, self.output_dim[0]*self.output_dim[1]*self.output_dim[2]+1), dtype=np.float32)
-                data[0, :self.output_dim[0]*self.output_dim[1]*self.output_dim[2]] = policy
-                data[0, self.output_dim[0]*self.output_dim[1]*self.output_dim[2]] = value
-                data = np.array(data).tobytes()
-                self.socket.send(data)
+    def run_batched(self):
+        state_size = self.input_dim[0] * self.input_dim[1] * self.input_dim[2]
+        poller = zmq.Poller()
+        poller.register(self.socket, zmq.POLLIN)
+        while True:
+            try:
+                # first request starts the batch, a request of a REQ client is: identity, empty frame, states
+                frames = self.socket.recv_multipart()
+                t0 = time.perf_counter()
+                deadline = t0 + self.max_wait / 1000.0
+                envelopes = [frames[:-1]]
+                requests = [decode_states(frames[-1], state_size)]
+                count = requests[0][0].shape[0]
+                while count < self.batch_size:
+                    timeout = deadline - time.perf_counter()
+                    if timeout <= 0 or not poller.poll(timeout * 1000.0):
+                        break  # send partial batch
+                    frames = self.socket.recv_multipart()
+                    envelopes.append(frames[:-1])
+                    requests.append(decode_states(frames[-1], state_size))
+                    count += requests[-1][0].shape[0]
+
+                t1 = time.perf_counter()
+                data = self.predict_states([state for state, _ in requests])
+                t2 = time.perf_counter()
+
+                # scatter rows to the clients in order of their requests, each in the format of its request
+                row = 0
+                for envelope, (state, flags) in zip(envelopes, requests):
+                    n = state.shape[0]
+                    self.socket.send_multipart(envelope + [encode_reply(data[row:row+n], flags)])
+                    row += n
+                self.stats.add(len(requests), count, t1 - t0, t2 - t1, time.perf_counter() - t0)
 
             except zmq.error.ContextTerminated:
                 self.socket.close()
                 return
 
 
-def execute_game(log, cmd_args):
-    last_line = ""
-    process = subprocess.Popen(cmd_args, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
-    while process.poll() is None:
-        while True:
-            output = process.stdout.readline().decode()
-            if not output:
-                break
-            output = output.replace('\n', '')  # remove newline
-            output = output.replace('\r', '')  # remove newline
-            last_line = output
-            log.debug(output)
-
-    if last_line == "White Wins!":
-        game_result = [1, -1]
-    elif last_line == "Black Wins!":
-        game_result = [-1, 1]
-    elif last_line == "Even!":
-        game_result = [0, 0]
-    else:
-        log.error("Error on game result")
-        return [0, 0]
-    return game_result
+def read_games(stream, dims_state, dims_policy):
+    """
+    Reads the binary stream of the CPP SelfPlay, yields one finished game at a time.
+    Record layout is documented in selfplay.hpp.
+
+    :return: header: Dict of game, moves, result (white, black), swapped, truncated
+    :return: state: Input state tensors of the samples, NWHC
+    :return: policy: Output policy tensors of the samples, NWHC
+    :return: value: Result of the game for the player to move of each sample
+    """
+    def read(size):
+        data = b''
+        while len(data) < size:
+            chunk = stream.read(size - len(data))
+            if not chunk:
+                raise EOFError("Self-play stream ended within a record")
+            data += chunk
+        return data
+
+    magic = stream.read(4)
+    if magic != b'MCSP':
+        raise ValueError("No self-play stream, got: {0}".format(magic))
+    version, state_size, policy_size = struct.unpack('=III', read(12))
+    if version != 1:
+        raise ValueError("Unknown self-play stream version: {0}".format(version))
+    if state_size != np.prod(dims_state) or policy_size != np.prod(dims_policy):
+        raise ValueError("Self-play stream does not match the dimensions of the problem")
+
+    while True:
+        record = stream.read(16)
+        if not record:
+            return
+        if len(record) < 16:
+            record += read(16 - len(record))
+        game, moves, samples, res_white, res_black, swapped, truncated = struct.unpack('=IIIbbBB', record)
+        header = dict(game=game, moves=moves, result=[res_white, res_black],
+                      swapped=bool(swapped), truncated=bool(truncated))
+
+        data = np.frombuffer(read(samples * (state_size + policy_size + 1) * 4), dtype=np.float32)
+        data.shape = (samples, state_size + policy_size + 1)
+        state = data[:, :state_size].reshape((samples, dims_state[2], dims_state[0], dims_state[1]))
+        policy = data[:, state_size:state_size+policy_size].reshape((samples, dims_policy[2], dims_policy[0], dims_policy[1]))
+        value = data[:, -1]
+
+        # NCWH to NWHC
+        state = np.transpose(state, axes=(0, 2, 3, 1))
+        policy = np.transpose(policy, axes=(0, 2, 3, 1))
+        yield header, state, policy, value
+
+
+def read_tree_snapshot(path):
+    """
+    Maps a binary tree snapshot of the CPP MCTS (writeSnapshot, snapshot.hpp) without reading it.
+    Nodes are breadth-first, childs of node i are nodes[first[i]:first[i]+count[i]], root is node 0.
+
+    :return: header: Dict of node_count, root_time, iterations, root_hash (FNV-1a of the raw bytes of the moves to root)
+    :return: nodes: Structured array of N, W, P, first, count, flags and action (raw bytes of the problem)
+    """
+    with open(path, 'rb') as file:
+        magic, version, node_bytes, action_bytes, node_count, root_time, iterations, root_hash = \
+            struct.unpack('=4sIIIQQQQ', file.read(48))
+    if magic != b'MCTT' or version != 2:
+        raise ValueError("No tree snapshot: {0}".format(path))
+    dtype = np.dtype({'names': ['N', 'W', 'P', 'first', 'count', 'flags', 'action'],
+                      'formats': ['<u8', '<f8', '<f8', '<u4', '<u2', '<u2', 'V{0}'.format(action_bytes)],
+                      'offsets': [0, 8, 16, 24, 28, 30, 32], 'itemsize': node_bytes})
+    nodes = np.memmap(path, dtype=dtype, mode='r', offset=48, shape=(node_count,))
+    header = dict(node_count=node_count, root_time=root_time, iterations=iterations, root_hash=root_hash)
+    return header, nodes
+
+
+def execute_games(log, args, port_a, port_b, games, deterministic, policy_iter):
+    """
+    Plays games concurrently in one CPP SelfPlay process, dnn A plays white in even, dnn B in odd games.
+    Yields the games in order of completion, see read_games.
+    """
+    seed = np.random.randint(0, np.iinfo(np.int32).max, 1, dtype=int)[0]
+    cmd_args = [args.path_to_selfplay, "game", "connect4", "games", str(games),
+                "concurrent", str(args.concurrent_games), "batchSize", str(args.batch_size),
+                "portA", get_endpoint(args, port_a), "portB", get_endpoint(args, port_b),
+                "seed", str(seed), "deterministic", "1" if deterministic else "0",
+                "iter", str(policy_iter), "out", "-"]
+    process = subprocess.Popen(cmd_args, stdout=subprocess.PIPE)  # settings and summary are printed to stderr
+    try:
+        for record in read_games(process.stdout, Problem.dims_state, Problem.dims_policy):
+            log.debug("Game {0} finished after {1} moves, result {2}".format(
+                record[0]["game"], record[0]["moves"], record[0]["result"]))
+            yield record
+    finally:
+        process.stdout.close()
+        if process.wait() != 0:
+            log.error("Self-play exited with code {0}".format(process.returncode))
 
 
 def self_play(log, args, best_model, curr_model, database):
     log.info("Playing")
     total_games = database.get_game_count()
-    for self_play_idx in tqdm(range(total_games+1, args.self_plays+total_games+1)):
-        log.debug("Executing self play id: {0}".format(self_play_idx))
-        if np.random.randint(0, 2, 1, dtype=int)[0] == 0:
-            p_white = best_model.port
-            p_black = curr_model.port
-        else:
-            p_white = curr_model.port
-            p_black = best_model.port
-        p_white = "tcp://localhost:{0}".format(p_white)
-        p_black = "tcp://localhost:{0}".format(p_black)
-        seed = np.random.randint(0, np.iinfo(np.int32).max, 1, dtype=int)[0]
-
-        cmd_args = [args.path_to_exe, "portW", p_white, "portB", p_black,
-                    "seed", str(seed), "deterministic", "0", "p0", "800", "p1", "800"]
-        game_result = execute_game(log, cmd_args)
-        database.store_and_reset(self_play_idx, game_result)
+    games = execute_games(log, args, best_model.port, curr_model.port, args.self_plays, False, 800)
+    for header, state, policy, value in tqdm(games, total=args.self_plays):
+        database.store(total_games + 1 + header["game"], state, policy, value)
 
 
 def evaluate(log, args, best_model, curr_model):
     log.info("Evaluating")
     scores = np.array([0, 0], dtype=np.int)  # best, current
-    for game_idx in tqdm(range(args.eval_plays)):
-        if np.random.randint(0, 2, 1, dtype=int)[0] == 0:
-            idx_best = 0
-            idx_curr = 1
-            p_white = best_model.port
-            p_black = curr_model.port
-        else:
-            idx_best = 1
-            idx_curr = 0
-            p_white = curr_model.port
-            p_black = best_model.port
-        p_white = "tcp://localhost:{0}".format(p_white)
-        p_black = "tcp://localhost:{0}".format(p_black)
-
-        cmd_args = [args.path_to_exe, "portW", p_white, "portB", p_black,
-                    "deterministic", "1", "p0", "1600", "p1", "1600"]
-        game_result = execute_game(log, cmd_args)
-        if game_result[idx_best] == 1:
+    games = execute_games(log, args, best_model.port, curr_model.port, args.eval_plays, True, 1600)
+    for header, _, _, _ in tqdm(games, total=args.eval_plays):
+        idx_best = 1 if header["swapped"] else 0  # best model is dnn A
+        idx_curr = 1 - idx_best
+        if header["result"][idx_best] == 1:
             scores[0] += 1
-            log.debug("Evaluation game {0} result: best wins".format(game_idx))
-        if game_result[idx_curr] == 1:
+            log.debug("Evaluation game {0} result: best wins".format(header["game"]))
+        if header["result"][idx_curr] == 1:
             scores[1] += 1
-            log.debug("Evaluation game {0} result: current wins".format(game_idx))
+            log.debug("Evaluation game {0} result: current wins".format(header["game"]))
     log.info("Result of evaluation: best wins {0}, current wins {1}".format(scores[0], scores[1]))
     decision = scores[1] > args.eval_plays * 0.55  # is current player won more than 55% of all games
     return decision
@@ -236,8 +455,9 @@ def evaluate(log, args, best_model, curr_model):
 
 def main():
     # chess_dims = (119, 8, 8)
-    db_name = Problem.name+'.hdf'
+    db_name = Problem.name+'_replay'
     exe_name = "Connect4"
+    selfplay_name = "SelfPlay"
     dims_state = Problem.dims_state
     dims_policy = Problem.dims_policy
     os.environ['TF_CPP_MIN_LOG_LEVEL'] = '3'  # Tensorflow logging level
@@ -250,17 +470,31 @@ def main():
     parser.add_argument("--self_plays", type=int, default=120, help="Number of self play games to execute")
     parser.add_argument("--eval_plays", type=int, default=100, help="Number of evaluation play games to execute")
     parser.add_argument("--path_to_exe", type=str, default=exe_name, help="Path to CPP MCTS exe")
-    parser.add_argument("--path_to_database", type=str, default=db_name, help="Path to HDF database")
+    parser.add_argument("--path_to_selfplay", type=str, default=selfplay_name, help="Path to CPP SelfPlay exe")
+    parser.add_argument("--concurrent_games", type=int, default=16, help="Number of games played at the same time")
+    parser.add_argument("--batch_size", type=int, default=0,
+                        help="Number of states per DNN request of SelfPlay, 0 derives it from the concurrent games")
+    parser.add_argument("--path_to_database", type=str, default=db_name, help="Path to replay buffer directory")
+    parser.add_argument("--replay_window", type=int, default=0,
+                        help="Number of recent iterations whose samples are trained on, 0 uses all")
+    parser.add_argument("--import_hdf", type=str, default="", help="Append the samples of a former HDF database")
     parser.add_argument("--train_epochs", type=int, default=300, help="Number of epochs for training")
+    parser.add_argument("--ipc", action='store_true', help="Connect CPP MCTS with ipc instead of tcp, not on Windows")
+    parser.add_argument("--dnn_batch_size", type=int, default=1,
+                        help="States per prediction gathered from all clients, 1 answers each request separately")
+    parser.add_argument("--dnn_max_wait", type=float, default=2.0,
+                        help="Max milliseconds to fill a batch of the DNN server after its first request")
     parser.add_argument("--train_sample_size", type=int, default=256, help="Number of game states to use for training")
     args = parser.parse_args()
 
     log = get_logger()
     add_file_logger(log, os.path.join(args.root_dir, 'data', 'connect4.log'))
-    if args.path_to_database == 'connect4.hdf':
-        args.path_to_database = os.path.join(args.root_dir, 'data', 'connect4.hdf')
+    if args.path_to_database == db_name:
+        args.path_to_database = os.path.join(args.root_dir, 'data', db_name)
     if args.path_to_exe == 'Connect4':
         args.path_to_exe = os.path.join(args.root_dir, 'build', 'release', 'Connect4')
+    if args.path_to_selfplay == 'SelfPlay':
+        args.path_to_selfplay = os.path.join(args.root_dir, 'build', 'release', 'SelfPlay')
 
     log.info("TensorFlow V: {0}, CUDA: {1}".format(tf.__version__, tf.test.is_built_with_cuda()))
     for gpu in tf.config.list_physical_devices('GPU'):
@@ -268,9 +502,15 @@ def main():
         tf.config.experimental.set_memory_growth(gpu, True)
 
     context = zmq.Context(1)
-    best_model = DNNPredict(dims_state, dims_policy, context, port="5555")
-    curr_model = DNNPredict(dims_state, dims_policy, context, port="5556")
-    database = DNNStatePolicyHandler(log, args.path_to_database, dims_state, dims_policy, context, port="5557")
+    best_model = DNNPredict(log, dims_state, dims_policy, context, port="5555", ipc=args.ipc,
+                            batch_size=args.dnn_batch_size, max_wait=args.dnn_max_wait)
+    curr_model = DNNPredict(log, dims_state, dims_policy, context, port="5556", ipc=args.ipc,
+                            batch_size=args.dnn_batch_size, max_wait=args.dnn_max_wait)
+    database = DNNStatePolicyHandler(log, args.path_to_database, dims_state, dims_policy, context, port="5557",
+                                     window=args.replay_window)
+    if args.import_hdf:
+        database.import_database(Database(log, args.import_hdf, dims_state, dims_policy))
+        log.info("Imported {0} samples from {1}".format(database.get_state_count(), args.import_hdf))
 
     if not os.path.isdir(os.path.join(args.root_dir, 'models', 'best_0')):
         best_model.save(os.path.join(args.root_dir, 'models', 'best_0'))
@@ -281,7 +521,7 @@ def main():
 
     # Test Code
     # curr_model.load_weight(os.path.join(project_dir, 'models', 'save_1', 'weights'))
-    # value, policy = curr_model.model.model.predict(np.array(database.datafile["state"]), batch_size=512)
+    # value, policy = curr_model.model.model.predict(np.array(database.state[:database.get_state_count()]), batch_size=512)
     # print(np.unique(value, return_counts=True))
 
     database.start()
@@ -303,6 +543,7 @@ def main():
     try:
         for iteration_idx in range(args.iteration+1, args.iteration+args.total_iterations+1):
             log.info("Starting iteration: {0}".format(iteration_idx))
+            database.set_iteration(iteration_idx)
             self_play(log, args, best_model, curr_model, database)
             curr_model.retrain(args, curr_model.model.model, database)
             curr_model.save(os.path.join(args.root_dir, 'models', 'save_{0}'.format(iteration_idx)))
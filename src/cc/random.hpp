@@ -0,0 +1,98 @@
+#ifndef RANDOM_HPP
+#define RANDOM_HPP
+
+#include <limits>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+//! Counter-based random generator, usable with the distributions of <random>
+/*!
+ * \details Value n of a stream is splitmix64 of key + n * gamma, the key is derived from a seed and stream ids.
+ *          State is a key and a counter, so streams are created and copied for free and never share state.
+ *          Streams of the same seed with different ids are independent, e.g. one per thread, search or purpose.
+ * \author adamp87
+*/
+class MCTSRandom {
+    std::uint64_t key; //!< derived from seed and stream ids
+    std::uint64_t counter; //!< number of drawn values
+
+public:
+    typedef std::uint64_t result_type;
+
+    constexpr static std::uint64_t Gamma = 0x9e3779b97f4a7c15ULL; //!< golden ratio, increment of splitmix64
+
+    //! Finalizer of splitmix64, a bijective mix of all bits
+    static std::uint64_t mix(std::uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    //! Stream of seed, identified by up to two ids
+    explicit MCTSRandom(std::uint64_t seed = 0, std::uint64_t stream = 0, std::uint64_t substream = 0)
+        : key(mix(mix(mix(seed) + stream * Gamma) + substream * Gamma)), counter(0) {}
+
+    constexpr static result_type min() { return 0; }
+    constexpr static result_type max() { return std::numeric_limits<result_type>::max(); }
+
+    result_type operator()() {
+        return mix(key + (++counter) * Gamma);
+    }
+
+    //! Skip n values
+    void discard(std::uint64_t n) {
+        counter += n;
+    }
+
+    //! Uniform integer in [0, n)
+    std::uint64_t below(std::uint64_t n) {
+        return (((*this)() >> 32) * n) >> 32;
+    }
+};
+
+//! One MCTSRandom stream per thread of a parallel search
+/*!
+ * \details Stream of thread t in search s is MCTSRandom(seed, s, t), so a search repeats for the same seed and thread count.
+ *          Each stream is on its own cache line, drawing is not shared with other threads.
+ * \author adamp87
+*/
+class MCTSRandomStreams {
+    struct Stream {
+        MCTSRandom random;
+        char padding[64 - sizeof(MCTSRandom)]; //!< keeps streams of threads on separate cache lines
+    };
+
+    std::vector<Stream> threads;
+    int level; //!< openmp level of the caller, searches run one level below
+
+public:
+    MCTSRandomStreams() : threads(1), level(0) {}
+
+    //! Create streams of search for upto nThreads threads
+    void begin(std::uint64_t seed, std::uint64_t search, size_t nThreads) {
+        threads.resize(std::max<size_t>(nThreads, 1));
+        for (size_t t = 0; t < threads.size(); ++t)
+            threads[t].random = MCTSRandom(seed, search, t);
+#ifdef _OPENMP
+        level = omp_get_level();
+#endif
+    }
+
+    //! Stream of the calling thread
+    MCTSRandom& local() {
+#ifdef _OPENMP
+        size_t idx = omp_get_level() > level ? static_cast<size_t>(omp_get_thread_num()) : 0;
+        return threads[std::min(idx, threads.size()-1)].random;
+#else
+        return threads[0].random;
+#endif
+    }
+};
+
+#endif // RANDOM_HPP
@@ -0,0 +1,73 @@
+#ifndef ROLLOUT_HPP
+#define ROLLOUT_HPP
+
+#include <cstdint>
+
+#include "random.hpp"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+//! Random playouts from the leafs of a pure mcts, value of a leaf is the mean result of its playouts
+/*!
+ * \details Each playout picks uniform random actions until the game is finished or maxDepth actions are played,
+ *          its result is computeMCTS_W of the problem, e.g. the end result of Connect4 or the figure ratio of chess.
+ *          Playouts of one leaf can run in a nested parallel region of threads (leaf parallelization),
+ *          this is effective if the search itself runs with one thread, otherwise the region gets one thread.
+ *          Random numbers of playout i are a function of seed, a value of the stream of the searching thread and i,
+ *          so searches repeat for the same seed and thread count, no state is shared by the threads.
+ *          Shared by the trees of all threads, evaluate is thread-safe.
+ *          Replaces the cuda rollouts of the deprecated mcts, problems hold host-only members (strings, tables).
+ * \author adamp87
+*/
+template <class TProblem>
+class MCTSRollout {
+    typedef typename TProblem::ActType ActType;
+
+    unsigned int count; //!< playouts of each leaf
+    unsigned int maxDepth; //!< max actions of a playout, zero plays until finished
+    int threads; //!< threads of the playouts of one leaf
+    std::uint64_t seed;
+
+    MCTSRollout(const MCTSRollout&) = delete;
+
+    //! Play one random game from state, return its value for idxAi
+    double playout(int idxAi, const TProblem& initial, MCTSRandom random) const {
+        TProblem state(initial);
+        ActType actions[TProblem::MaxActions];
+        for (unsigned int depth = 0; !state.isFinished() && (maxDepth == 0 || depth < maxDepth); ++depth) {
+            int player = state.getPlayer();
+            std::uint64_t nActions = state.getPossibleActions(player, player, actions);
+            if (nActions == 0)
+                break;
+            state.update(actions[random.below(nActions)]);
+        }
+        return state.computeMCTS_W(idxAi);
+    }
+
+public:
+    //! Create playouts
+    /*!
+    * \param count Playouts of each leaf
+    * \param maxDepth Max actions of a playout, zero plays until finished
+    * \param threads Threads of the playouts of one leaf
+    * \param seed Changes the random numbers of all playouts
+    */
+    MCTSRollout(unsigned int count, unsigned int maxDepth = 0, int threads = 1, std::uint64_t seed = 0)
+        : count(count == 0 ? 1 : count), maxDepth(maxDepth), threads(threads < 1 ? 1 : threads), seed(seed)
+    {}
+
+    //! Mean value of the playouts from state for idxAi, random is the stream of the calling thread
+    double evaluate(int idxAi, const TProblem& state, MCTSRandom& random) const {
+        const std::uint64_t leaf = random();
+        const int n = static_cast<int>(count);
+        double sum = 0.0;
+        #pragma omp parallel for reduction(+:sum) schedule(static) num_threads(threads) if(threads > 1)
+        for (int i = 0; i < n; ++i)
+            sum += playout(idxAi, state, MCTSRandom(seed, leaf, std::uint64_t(i)));
+        return sum / n;
+    }
+};
+
+#endif // ROLLOUT_HPP
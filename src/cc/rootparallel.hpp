@@ -0,0 +1,252 @@
+#ifndef ROOTPARALLEL_HPP
+#define ROOTPARALLEL_HPP
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <type_traits>
+
+#include <zmq.hpp>
+
+#include "zmqpool.hpp"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+//! Messages between a root parallel search and its remote workers
+/*!
+ * \details Request: Request, ActType[historySize], the history of the game from the initial state of the worker.
+ *          Reply: Reply, RootStat[count], the visits and values of the childs of the searched state.
+ *          Actions and statistics are sent as raw bytes, so workers must be built for the same problem and platform.
+ * \author adamp87
+*/
+struct MCTSRootWire {
+    struct Request {
+        std::int32_t idxAi; //!< player who searches
+        std::int32_t isDeterministic;
+        std::uint32_t policyIter;
+        std::uint32_t historySize;
+    };
+
+    struct Reply {
+        std::uint32_t iterations; //!< policy iterations of the worker
+        std::uint32_t count; //!< number of root statistics
+    };
+};
+
+//! Root parallel search, independent trees search the same state and merge the statistics of their roots
+/*!
+ * \details Trees of the process search at the same time, each with an equal share of the threads in a nested parallel region.
+ *          Trees of other hosts are searched by MCTSRootWorker, requested over ZeroMQ while the local trees search.
+ *          Trees differ by their seeds and by the order of their parallel iterations, so they explore different paths.
+ *          Visits and values of the root childs are summed over all trees once each tree finished its search,
+ *          the first tree selects the move from the merged statistics.
+ *          Unlike tree parallelization, trees share no memory and only the root statistics are exchanged.
+ * \author adamp87
+*/
+template <class TMCTS, class TProblem>
+class MCTSRootParallel {
+    typedef typename TProblem::ActType ActType;
+    typedef typename TMCTS::RootStat RootStat;
+
+    static_assert(std::is_trivially_copyable<ActType>::value, "Actions are sent as raw bytes");
+
+    ZMQSocketPool& sockets; //!< connections to the workers
+    std::vector<TMCTS*> trees; //!< local trees, first selects the move
+    std::vector<std::unique_ptr<TMCTS> > owned; //!< trees added to the first one
+    std::vector<std::string> workers; //!< endpoints of remote workers
+    unsigned int iterations; //!< policy iterations of all trees in the last search
+
+    MCTSRootParallel(const MCTSRootParallel&) = delete;
+
+    //! Search on remote worker
+    void requestWorker(const std::string& endpoint, int idxAi, bool isDeterministic, unsigned int policyIter,
+                       const std::vector<ActType>& history, std::vector<RootStat>& stats, unsigned int& workerIter) {
+        MCTSRootWire::Request header;
+        header.idxAi = idxAi;
+        header.isDeterministic = isDeterministic ? 1 : 0;
+        header.policyIter = policyIter;
+        header.historySize = static_cast<std::uint32_t>(history.size());
+        zmq::message_t request(sizeof(header) + history.size()*sizeof(ActType));
+        memcpy(request.data(), &header, sizeof(header));
+        if (!history.empty())
+            memcpy(static_cast<char*>(request.data()) + sizeof(header), history.data(), history.size()*sizeof(ActType));
+
+        zmq::message_t reply;
+        sockets.request(endpoint, request, reply);
+        MCTSRootWire::Reply result;
+        if (reply.size() < sizeof(result))
+            throw std::runtime_error("Bad Reply of root worker " + endpoint);
+        memcpy(&result, reply.data(), sizeof(result));
+        if (reply.size() != sizeof(result) + result.count*sizeof(RootStat))
+            throw std::runtime_error("Bad Reply of root worker " + endpoint);
+        stats.resize(result.count);
+        if (result.count != 0)
+            memcpy(stats.data(), static_cast<const char*>(reply.data()) + sizeof(result), result.count*sizeof(RootStat));
+        workerIter = result.iterations;
+    }
+
+public:
+    //! Create search of one local tree and remote workers
+    /*!
+    * \param sockets Pool of connected sockets, used for the workers
+    * \param tree First local tree, not owned, selects the move and samples of stochastic searches
+    * \param workers Endpoints of MCTSRootWorker, e.g. tcp://host:5560
+    */
+    MCTSRootParallel(ZMQSocketPool& sockets, TMCTS& tree, const std::vector<std::string>& workers = std::vector<std::string>())
+        : sockets(sockets), trees(1, &tree), workers(workers), iterations(0)
+    {}
+
+    //! Add another local tree, it should have the settings of the first tree and another seed
+    void addTree(std::unique_ptr<TMCTS> tree) {
+        trees.push_back(tree.get());
+        owned.push_back(std::move(tree));
+    }
+
+    //! Split comma separated endpoints of workers
+    static std::vector<std::string> parseWorkers(const std::string& list) {
+        std::vector<std::string> result;
+        std::stringstream stream(list);
+        std::string endpoint;
+        while (std::getline(stream, endpoint, ','))
+            if (!endpoint.empty())
+                result.push_back(endpoint);
+        return result;
+    }
+
+    //! Number of policy iterations of all trees in the last search
+    unsigned int getIterations() const {
+        return iterations;
+    }
+
+    //! Execute a search on all trees, return the action selected on the merged statistics
+    /*!
+    * \details Each local tree gets an equal share of the threads, at least one.
+    *          Remote workers search with their own threads, they need the same initial state as the caller.
+    */
+    ActType execute(int idxAi,
+                    bool isDeterministic,
+                    const TProblem& cstate,
+                    unsigned int policyIter,
+                    const std::vector<ActType>& history)
+    {
+        const int nLocal = static_cast<int>(trees.size());
+        const int nTasks = nLocal + static_cast<int>(workers.size());
+        std::vector<std::vector<RootStat> > stats(nTasks);
+        std::vector<unsigned int> taskIter(nTasks, 0);
+        std::exception_ptr error;
+        std::mutex lock; // guards error
+#ifdef _OPENMP
+        int threads = std::max(omp_get_max_threads() / nLocal, 1);
+        omp_set_max_active_levels(std::max(omp_get_max_active_levels(), omp_get_level() + 2));
+#endif
+
+        #pragma omp parallel for schedule(dynamic, 1) num_threads(nTasks)
+        for (int i = 0; i < nTasks; ++i) {
+            try {
+                if (i < nLocal) {
+#ifdef _OPENMP
+                    omp_set_num_threads(threads); // team of the search of this tree
+#endif
+                    trees[i]->search(idxAi, isDeterministic, cstate, policyIter, history);
+                    trees[i]->getRootStatistics(stats[i]);
+                    taskIter[i] = trees[i]->getIterations();
+                } else {
+                    requestWorker(workers[i - nLocal], idxAi, isDeterministic, policyIter, history, stats[i], taskIter[i]);
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(lock);
+                error = std::current_exception();
+            }
+        }
+        if (error)
+            std::rethrow_exception(error);
+
+        iterations = 0;
+        for (int i = 0; i < nTasks; ++i) {
+            iterations += taskIter[i];
+            if (i != 0)
+                TMCTS::mergeRootStatistics(stats[0], stats[i]);
+        }
+        return trees[0]->selectMove(idxAi, isDeterministic, cstate, history.size(), stats[0]);
+    }
+};
+
+//! Remote tree of a root parallel search, serves MCTSRootParallel of another host
+/*!
+ * \details Each request replays the history on the initial state and searches it with the tree of its player.
+ *          Values of a tree are from the view of its player, so each player has its own tree.
+ *          Successive requests of one game reuse the subtree of the played moves, as execute does.
+ *          A request which does not continue the last history of its player starts a new game on that tree.
+ * \author adamp87
+*/
+template <class TMCTS, class TProblem>
+class MCTSRootWorker {
+    typedef typename TProblem::ActType ActType;
+    typedef typename TMCTS::RootStat RootStat;
+
+public:
+    //! Answer requests at endpoint until an error occurs
+    /*!
+    * \param zmq_context Context of the socket
+    * \param endpoint Bound address, e.g. tcp://0.0.0.0:5560
+    * \param trees Tree of each player, indexed by idxAi of the requests, their settings are used for all requests
+    * \param initial State at the start of the history of the requests
+    */
+    static void serve(zmq::context_t& zmq_context, const std::string& endpoint, const std::vector<TMCTS*>& trees, const TProblem& initial) {
+        zmq::socket_t socket(zmq_context, ZMQ_REP);
+        socket.bind(endpoint);
+        std::vector<ActType> history;
+        std::vector<std::vector<ActType> > played(trees.size()); // history of the last request of each tree
+        std::vector<RootStat> stats;
+        while (true) {
+            zmq::message_t request;
+            if (!socket.recv(&request))
+                throw std::runtime_error("Could not receive request");
+            MCTSRootWire::Request header;
+            if (request.size() < sizeof(header))
+                throw std::runtime_error("Bad Request");
+            memcpy(&header, request.data(), sizeof(header));
+            if (request.size() != sizeof(header) + header.historySize*sizeof(ActType))
+                throw std::runtime_error("Bad Request, size differs from header");
+            if (header.idxAi < 0 || static_cast<size_t>(header.idxAi) >= trees.size())
+                throw std::runtime_error("Bad Request, no tree of player");
+            history.resize(header.historySize);
+            if (!history.empty())
+                memcpy(history.data(), static_cast<const char*>(request.data()) + sizeof(header), history.size()*sizeof(ActType));
+
+            TMCTS& tree = *trees[header.idxAi];
+            std::vector<ActType>& last = played[header.idxAi];
+            bool continues = history.size() >= last.size() && std::equal(last.begin(), last.end(), history.begin());
+            if (!continues)
+                tree.clear(); // another game, the root of the tree is not on its history
+            last = history;
+
+            TProblem state(initial);
+            for (size_t i = 0; i < history.size(); ++i)
+                state.update(history[i]);
+            tree.search(header.idxAi, header.isDeterministic != 0, state, header.policyIter, history);
+            tree.getRootStatistics(stats);
+
+            MCTSRootWire::Reply result;
+            result.iterations = tree.getIterations();
+            result.count = static_cast<std::uint32_t>(stats.size());
+            zmq::message_t reply(sizeof(result) + stats.size()*sizeof(RootStat));
+            memcpy(reply.data(), &result, sizeof(result));
+            if (!stats.empty())
+                memcpy(static_cast<char*>(reply.data()) + sizeof(result), stats.data(), stats.size()*sizeof(RootStat));
+            if (!socket.send(reply))
+                throw std::runtime_error("Could not send reply");
+        }
+    }
+};
+
+#endif // ROOTPARALLEL_HPP
@@ -0,0 +1,163 @@
+#ifndef SAMPLESTREAM_HPP
+#define SAMPLESTREAM_HPP
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <condition_variable>
+
+#include <zmq.hpp>
+
+//! One-way stream of training samples to the database server, e.g. DNNStatePolicyHandler of pyExecute.py
+/*!
+ * \details Each sample is one framed ZeroMQ PUSH message: SampleFrame, float state[stateSize], float policy[policySize].
+ *          End of a game is a frame of kind End with the results and without data, its samples precede it.
+ *          Value of a sample is the result of its player, the server sets it when the game has ended.
+ *          Samples are encoded into their messages once and buffered per game, finish queues the messages of the game.
+ *          A background thread owns the socket and sends the queue, so neither search nor storage wait for each other.
+ *          Queued messages are kept while no server is connected, at destruction they are dropped after linger ms.
+ *          Numbers are sent in the byte order of the host.
+ * \author adamp87
+*/
+class MCTSSampleStream {
+public:
+    constexpr static std::uint16_t Version = 1;
+
+    enum Kind : std::uint8_t {
+        Sample = 0, //!< state and policy of one stochastic move
+        End = 1 //!< game has ended, result is set
+    };
+
+    //! Header of each message, 28 bytes
+    struct SampleFrame {
+        char magic[4]; //!< "MCSS"
+        std::uint16_t version;
+        std::uint8_t kind; //!< Kind of the message
+        std::uint8_t player; //!< player to move, perspective of the state
+        std::uint32_t game; //!< id of the game, chosen by the caller
+        std::uint32_t move; //!< index of the move in the game
+        std::uint32_t stateSize; //!< number of floats of the state
+        std::uint32_t policySize; //!< number of floats of the policy
+        std::int8_t result[2]; //!< result of white and black at End: 1 won, -1 lost, 0 even
+        std::uint8_t reserved[2];
+    };
+
+private:
+    zmq::socket_t socket; //!< used by the sender only
+    std::chrono::milliseconds linger; //!< max time to send queued messages at destruction
+    std::mutex lock; //!< guards games, queue and stopping
+    std::condition_variable wakeup; //!< signals the sender
+    std::map<std::uint32_t, std::vector<zmq::message_t> > games; //!< encoded samples of unfinished games
+    std::deque<zmq::message_t> queue; //!< messages of finished games, in order of sending
+    bool stopping;
+    std::thread sender;
+
+    MCTSSampleStream(const MCTSSampleStream&) = delete;
+
+    static SampleFrame createFrame(Kind kind, std::uint32_t game, std::uint32_t move, int player) {
+        SampleFrame frame;
+        memset(&frame, 0, sizeof(frame));
+        memcpy(frame.magic, "MCSS", 4);
+        frame.version = Version;
+        frame.kind = kind;
+        frame.player = static_cast<std::uint8_t>(player);
+        frame.game = game;
+        frame.move = move;
+        return frame;
+    }
+
+    //! Send queue until stopped, a full queue of zeromq is retried without blocking the caller of finish
+    void run() {
+        std::unique_lock<std::mutex> guard(lock);
+        bool expired = false;
+        std::chrono::steady_clock::time_point deadline;
+        while (true) {
+            wakeup.wait(guard, [this] { return stopping || !queue.empty(); });
+            if (stopping && (queue.empty() || expired))
+                return;
+            if (stopping && deadline == std::chrono::steady_clock::time_point())
+                deadline = std::chrono::steady_clock::now() + linger;
+
+            zmq::message_t message(std::move(queue.front()));
+            queue.pop_front();
+            guard.unlock();
+            bool sent = socket.send(message, ZMQ_DONTWAIT);
+            guard.lock();
+            if (!sent) { // no server or its queue is full, retry later
+                queue.push_front(std::move(message));
+                expired = stopping && std::chrono::steady_clock::now() >= deadline;
+                wakeup.wait_for(guard, std::chrono::milliseconds(1));
+            }
+        }
+    }
+
+public:
+    //! Connect stream to endpoint, e.g. tcp://localhost:5557
+    /*!
+    * \param zmq_context Context of the socket
+    * \param endpoint Address of the database server, which binds a PULL socket
+    * \param linger Max milliseconds to send queued messages at destruction
+    */
+    MCTSSampleStream(zmq::context_t& zmq_context, const std::string& endpoint, unsigned int linger = 1000)
+        : socket(zmq_context, ZMQ_PUSH), linger(linger), stopping(false)
+    {
+        int zero = 0; // messages are dropped by the sender, do not block context termination
+        socket.setsockopt(ZMQ_LINGER, &zero, sizeof(zero));
+        socket.connect(endpoint);
+        sender = std::thread(&MCTSSampleStream::run, this);
+    }
+
+    //! Send queued messages, drop samples of unfinished games
+    ~MCTSSampleStream() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wakeup.notify_one();
+        sender.join();
+    }
+
+    //! Buffer sample of player at move of game, thread-safe
+    void add(std::uint32_t game, std::uint32_t move, int player,
+             const std::vector<float>& state, const std::vector<float>& policy) {
+        SampleFrame frame = createFrame(Sample, game, move, player);
+        frame.stateSize = static_cast<std::uint32_t>(state.size());
+        frame.policySize = static_cast<std::uint32_t>(policy.size());
+        zmq::message_t message(sizeof(frame) + (state.size() + policy.size())*sizeof(float));
+        char* data = static_cast<char*>(message.data());
+        memcpy(data, &frame, sizeof(frame));
+        memcpy(data + sizeof(frame), state.data(), state.size()*sizeof(float));
+        memcpy(data + sizeof(frame) + state.size()*sizeof(float), policy.data(), policy.size()*sizeof(float));
+
+        std::lock_guard<std::mutex> guard(lock);
+        games[game].push_back(std::move(message));
+    }
+
+    //! Queue the samples of game and its end after moves with the results of white and black, thread-safe
+    void finish(std::uint32_t game, std::uint32_t moves, int resultWhite, int resultBlack) {
+        SampleFrame frame = createFrame(End, game, moves, 0);
+        frame.result[0] = static_cast<std::int8_t>(resultWhite);
+        frame.result[1] = static_cast<std::int8_t>(resultBlack);
+        zmq::message_t message(sizeof(frame));
+        memcpy(message.data(), &frame, sizeof(frame));
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            std::map<std::uint32_t, std::vector<zmq::message_t> >::iterator it = games.find(game);
+            if (it != games.end()) {
+                for (zmq::message_t& sample : it->second)
+                    queue.push_back(std::move(sample));
+                games.erase(it);
+            }
+            queue.push_back(std::move(message));
+        }
+        wakeup.notify_one();
+    }
+};
+
+#endif // SAMPLESTREAM_HPP
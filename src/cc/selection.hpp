@@ -0,0 +1,245 @@
+#ifndef SELECTION_HPP
+#define SELECTION_HPP
+
+#include <cmath>
+#include <mutex>
+#include <limits>
+#include <random>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+#include <algorithm>
+
+#include "ucbkernel.hpp"
+
+//! Selection policies of MCTS, the template TSelection of the tree
+/*!
+ * \details A policy is a struct of static functions, instantiated with the problem, so its constants are folded.
+ *          Parent holds the terms of the parent node, computed once per visit of the parent instead of per child.
+ *          value rates one child, argmax selects on the statistics arrays of MCTSStorageSoA.
+ *          RootHalving selects the root childs by MCTSSequentialHalving, other levels use value.
+ *          Default policy is PUCT, the define MCTS_SELECTION_UCT or MCTS_SELECTION_GUMBEL (cmake MCTS_Selection) changes it.
+ * \author adamp87
+*/
+template <class TProblem>
+struct MCTSSelectPUCT {
+    constexpr static double C = TProblem::UCT_C; //!< exploration constant
+    constexpr static bool RootNoise = true; //!< root priors are mixed with dirichlet noise
+    constexpr static bool RootHalving = false;
+
+    struct Parent {
+        double visitSqrt; //!< square root of the visits of parent
+    };
+
+    static Parent parent(std::uint64_t N, double) {
+        Parent terms;
+        terms.visitSqrt = sqrt(std::max<double>(static_cast<double>(N), 1.0));
+        return terms;
+    }
+
+    //! Q + c * P' * sqrt(N_parent) / (1 + N), see MCTSKernelUCB
+    static double value(std::uint32_t N, double W, double P, double noise, double ratio, const Parent& parent) {
+        return MCTSKernelUCB::value(N, W, P, noise, ratio, parent.visitSqrt, C);
+    }
+
+    static size_t argmax(size_t count, const std::uint32_t* N, const double* W, const double* P,
+                         const double* noise, double ratio, const Parent& parent) {
+        return MCTSKernelUCB::argmax(count, N, W, P, noise, ratio, parent.visitSqrt, C);
+    }
+};
+
+//! UCT without priors, unvisited childs get the value of first play urgency (FPU)
+/*!
+ * \details Value of a visited child is Q + c * sqrt(ln(N_parent) / N), priors and noise are not used.
+ *          FPU is the mean value of the parent reduced by FPUReduction, so unvisited childs are not all tried first.
+ *          For pure mcts without dnn, where the priors are uniform.
+ * \author adamp87
+*/
+template <class TProblem>
+struct MCTSSelectUCT {
+    constexpr static double C = TProblem::UCT_C; //!< exploration constant
+    constexpr static double FPUReduction = 0.25; //!< unvisited child is rated this much below the parent
+    constexpr static bool RootNoise = false;
+    constexpr static bool RootHalving = false;
+
+    struct Parent {
+        double visitLog; //!< logarithm of the visits of parent
+        double fpu; //!< value of unvisited childs
+    };
+
+    static Parent parent(std::uint64_t N, double W) {
+        Parent terms;
+        terms.visitLog = log(std::max<double>(static_cast<double>(N), 1.0));
+        terms.fpu = (N != 0 ? W / static_cast<double>(N) : 0.0) - FPUReduction;
+        return terms;
+    }
+
+    static double value(std::uint32_t N, double W, double, double, double, const Parent& parent) {
+        if (N == 0)
+            return parent.fpu;
+        double n = static_cast<double>(N);
+        return W / n + C * sqrt(parent.visitLog / n);
+    }
+
+    static size_t argmax(size_t count, const std::uint32_t* N, const double* W, const double* P,
+                         const double* noise, double ratio, const Parent& parent) {
+        size_t best = 0;
+        double bestVal = -std::numeric_limits<double>::max();
+        for (size_t i = 0; i < count; ++i) {
+            double val = value(N[i], W[i], P[i], 0.0, ratio, parent);
+            if (bestVal < val) {
+                best = i;
+                bestVal = val;
+            }
+        }
+        (void)noise;
+        return best;
+    }
+};
+
+//! Gumbel root selection with sequential halving, PUCT below root, for searches with few iterations
+/*!
+ * \details Root childs are sampled without replacement by the Gumbel-top-k trick on the logarithm of their priors.
+ *          Iterations are split evenly between the sampled childs by sequential halving, see MCTSSequentialHalving.
+ *          Root selection needs no exploration noise, the Gumbel variables explore.
+ *          Below root, childs are selected by PUCT.
+ * \author adamp87
+*/
+template <class TProblem>
+struct MCTSSelectGumbel : MCTSSelectPUCT<TProblem> {
+    constexpr static bool RootNoise = false;
+    constexpr static bool RootHalving = true;
+    constexpr static unsigned int Considered = 16; //!< root childs sampled for halving
+};
+
+//! Sequential halving of the root childs in one search, thread-safe
+/*!
+ * \details Phase k gives each remaining candidate budget / (phases * candidates) iterations, then keeps the better half.
+ *          Candidates are ranked by g + log(P) + (CVisit + max N) * CScale * Q', Q' is the value mapped to [0, 1].
+ *          Values are between the value of a lost game and 1, e.g. [0, 1] for chess without dnn, see getLostValue of the problem.
+ *          The last candidate gets the remaining iterations, so it has the most selections of the search.
+ *          The move of the search is the best ranked candidate, also if a limit stopped the search before the last halving.
+ *          Selections are counted when they are handed out, so parallel threads follow the same schedule.
+ * \author adamp87
+*/
+class MCTSSequentialHalving {
+public:
+    constexpr static double CVisit = 50.0;
+    constexpr static double CScale = 1.0;
+
+private:
+    std::mutex lock; //!< guards all members
+    std::vector<double> score; //!< gumbel variable plus logarithm of the prior of each child
+    std::vector<size_t> candidates; //!< remaining childs
+    std::vector<unsigned int> selected; //!< selections of each child in this search
+    unsigned int budget; //!< iterations of the search
+    unsigned int phases; //!< number of halvings
+    unsigned int target; //!< selections of each candidate at the end of the phase
+    double lost; //!< value of a lost game, lower bound of the values
+
+    //! Sort candidates by rank, best first, stats(i, N, W) reads the statistics of child i
+    template <class TStats>
+    void rankCandidates(TStats stats) {
+        double maxN = 0.0;
+        std::vector<double> rank(score.size(), 0.0);
+        std::vector<double> N(score.size()), W(score.size());
+        for (size_t i = 0; i < score.size(); ++i) {
+            stats(i, N[i], W[i]);
+            maxN = std::max(maxN, N[i]);
+        }
+        for (size_t c : candidates) {
+            double q = N[c] > 0.0 ? (W[c] / N[c] - lost) / (1.0 - lost) : 0.5;
+            rank[c] = score[c] + (CVisit + maxN) * CScale * q;
+        }
+        std::stable_sort(candidates.begin(), candidates.end(), [&rank] (size_t a, size_t b) { return rank[a] > rank[b]; });
+    }
+
+    void nextTarget() {
+        if (candidates.size() == 1)
+            target = std::numeric_limits<unsigned int>::max(); // rest of the budget
+        else
+            target += std::max<unsigned int>(budget / (phases * static_cast<unsigned int>(candidates.size())), 1);
+    }
+
+public:
+    MCTSSequentialHalving() : budget(0), phases(0), target(0), lost(-1.0) {}
+
+    //! Start halving on the childs with priors P
+    /*!
+    * \param count Number of childs
+    * \param budget Iterations of the search, which select a root child
+    * \param considered Max number of candidates, sampled by the Gumbel-top-k trick
+    * \param lost Value of a lost game, values of the childs are between lost and 1
+    * \param generator Draws the gumbel variables
+    */
+    template <class TGenerator>
+    void begin(const double* P, size_t count, unsigned int budget, unsigned int considered, double lost, TGenerator& generator) {
+        std::lock_guard<std::mutex> guard(lock);
+        std::uniform_real_distribution<double> uniform(std::numeric_limits<double>::min(), 1.0);
+        score.resize(count);
+        for (size_t i = 0; i < count; ++i)
+            score[i] = -log(-log(uniform(generator))) + log(P[i] + std::numeric_limits<double>::min());
+        candidates.resize(count);
+        std::iota(candidates.begin(), candidates.end(), size_t(0));
+        std::stable_sort(candidates.begin(), candidates.end(), [this] (size_t a, size_t b) { return score[a] > score[b]; });
+        candidates.resize(std::min<size_t>(std::max(considered, 1u), count));
+        selected.assign(count, 0);
+        this->budget = budget;
+        this->lost = lost;
+        phases = 1;
+        while ((size_t(1) << phases) < candidates.size())
+            ++phases; // ceil(log2(candidates))
+        target = 0;
+        nextTarget();
+    }
+
+    //! Number of childs of the current halving, zero if not started
+    size_t size() const {
+        return score.size();
+    }
+
+    //! Selections of child i in this search
+    unsigned int getSelected(size_t i) const {
+        return selected[i];
+    }
+
+    //! Index of the child of the next iteration, stats(i, N, W) reads the statistics of child i
+    template <class TStats>
+    size_t select(TStats stats) {
+        std::lock_guard<std::mutex> guard(lock);
+        bool done = true;
+        for (size_t c : candidates)
+            done = done && selected[c] >= target;
+        if (done) { // keep the better half
+            rankCandidates(stats);
+            candidates.resize(std::max<size_t>(candidates.size() / 2, 1));
+            nextTarget();
+        }
+        size_t best = candidates[0];
+        for (size_t c : candidates) {
+            if (selected[c] < selected[best])
+                best = c;
+        }
+        ++selected[best];
+        return best;
+    }
+
+    //! Index of the best ranked remaining candidate, the move of the search, stats(i, N, W) reads the statistics of child i
+    template <class TStats>
+    size_t getBest(TStats stats) {
+        std::lock_guard<std::mutex> guard(lock);
+        rankCandidates(stats);
+        return candidates[0];
+    }
+};
+
+#if defined(MCTS_SELECTION_UCT)
+template <class TProblem> using MCTSSelectDefault = MCTSSelectUCT<TProblem>;
+#elif defined(MCTS_SELECTION_GUMBEL)
+template <class TProblem> using MCTSSelectDefault = MCTSSelectGumbel<TProblem>;
+#else
+template <class TProblem> using MCTSSelectDefault = MCTSSelectPUCT<TProblem>;
+#endif
+
+#endif // SELECTION_HPP
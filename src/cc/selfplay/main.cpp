@@ -0,0 +1,337 @@
+#include <chrono>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <iostream>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#include "mcts.hpp"
+#include "selfplay.hpp"
+#include "batchqueue.hpp"
+#include "chess/chess.hpp"
+#include "connect4/connect4.hpp"
+
+#ifdef __linux__
+#include <ctime>
+#include <unistd.h>
+int getSeed() {
+    return ((time(NULL) & 0xFFFF) | (getpid() << 16));
+}
+#else
+#include <ctime>
+#include <windows.h>
+int getSeed() {
+    return ((time(NULL) & 0xFFFF) | (GetCurrentProcessId() << 16));
+}
+#endif
+
+//! Parameters of the self-play run
+struct Config {
+    std::string game = "connect4";
+    std::string out = "-";
+    std::string wire = "dense";
+    std::string evaluator = "zmq";
+    std::string telemetry = ""; //!< path of json lines of the searches, empty disables
+    std::string ports[2] = {"tcp://localhost:5555", "tcp://localhost:5555"}; //!< dnn A and B
+    unsigned int games = 128;
+    unsigned int concurrent = 16;
+    unsigned int threads = 1;
+    unsigned int seed = getSeed();
+    unsigned int policyIter = 800;
+    unsigned int maxMoves = 0;
+    unsigned int batchSize = 0; //!< 0 derives it from the threads waiting at each queue
+    unsigned int batchTimeout = 1000;
+    unsigned int transpositions = 0;
+    unsigned int evalCache = 0;
+    unsigned int evalLatency = 0;
+    bool isDeterministic = false;
+    bool swap = true;
+    bool symmetry = false;
+    bool mirrorSamples = false;
+};
+
+//! Batch size of each dnn queue, the number of threads that evaluate through it, at most MaxBatch
+/*!
+ * \details A batch is sent when it is full or its oldest request waited batchTimeout.
+ *          A batch larger than the threads of all games never fills, each evaluation waits the whole timeout.
+ *          With two dnns, at any time about half of the threads of the games search the moves of each,
+ *          so a full batch is sent as soon as every thread of its dnn is blocked.
+ */
+unsigned int defaultBatchSize(const Config& cfg) {
+    const unsigned int MaxBatch = 64;
+#ifdef _OPENMP
+    unsigned int producers = cfg.concurrent * cfg.threads;
+#else
+    unsigned int producers = cfg.threads; // games are played one after the other
+#endif
+    if (cfg.ports[0] != "0" && cfg.ports[1] != "0")
+        producers /= 2; // each dnn has its own queue
+    return std::min(std::max(producers, 1u), MaxBatch);
+}
+
+//! Play all games on a shared pool of threads, each game is searched by its own thread
+/*!
+ * \details Threads of all games evaluate through one evaluator and batch queue per dnn, so their states fill the same batches.
+ *          With more than one search thread per game, searches are nested parallel regions of the game thread.
+ *          Finished games are written immediately, the record order is the order of completion.
+ */
+template <class TProblem>
+int playGames(const Config& cfg) {
+    typedef typename TProblem::ActType ActType;
+#ifdef _OPENMP
+    typedef MCTS<TProblem, MCTSNodeBaseMT<ActType>, MCTSStorageArena> MCTSDef;
+#else
+    typedef MCTS<TProblem, MCTSNodeBase<ActType>, MCTSStorageArena> MCTSDef;
+#endif
+
+    zmq::context_t zmq_context(16);
+    ZMQSocketPool sockets(zmq_context);
+    DNNWireFormat wire(DNNWireFormat::parseMode(cfg.wire), TProblem::PlaneSize);
+    std::unique_ptr<DNNEvaluator> evaluators[2]; // shared by all games, for each dnn
+    std::unique_ptr<DNNBatchQueue> queues[2];
+    std::unique_ptr<DNNEvalCache> caches[2][2]; // for each dnn and color, results depend on the perspective
+    for (int d = 0; d < 2; ++d) {
+        if (cfg.ports[d] == "0")
+            continue; // no dnn
+        evaluators[d] = createDNNEvaluator(cfg.evaluator, sockets, cfg.ports[d], wire, TProblem::PlaneSize+1,
+                                           TProblem::PlaneHeight, TProblem::PlaneSize/TProblem::PlaneHeight, cfg.evalLatency);
+        if (cfg.batchSize > 1)
+            queues[d].reset(new DNNBatchQueue(*evaluators[d], cfg.batchSize, cfg.batchTimeout));
+        for (int p = 0; cfg.evalCache > 0 && p < 2; ++p)
+            caches[d][p].reset(new DNNEvalCache(cfg.evalCache));
+    }
+
+    // sizes of the samples, policy of no action is zero
+    std::vector<float> stateDNN;
+    std::vector<float> policyDNN;
+    std::vector<std::pair<ActType, double> > noPolicy;
+    DNNPlayers pure(sockets, "0", "0");
+    TProblem initial(pure);
+    initial.getGameStateDNN(stateDNN, 0);
+    initial.getPolicyTrainDNN(policyDNN, 0, noPolicy);
+    SelfPlayWriter writer(cfg.out, stateDNN.size(), policyDNN.size());
+    std::ofstream telemetryFile;
+    std::unique_ptr<MCTSTelemetrySink> telemetry; // shared by the searches of all games
+    if (!cfg.telemetry.empty()) {
+        telemetryFile.open(cfg.telemetry);
+        telemetry.reset(new MCTSTelemetrySink(telemetryFile));
+    }
+
+#ifdef _OPENMP
+    omp_set_max_active_levels(cfg.threads > 1 ? 2 : 1);
+#endif
+    std::atomic<unsigned int> results[2][3]; // for each dnn: won, lost, even
+    for (int d = 0; d < 2; ++d)
+        results[d][0] = results[d][1] = results[d][2] = 0;
+    std::atomic<size_t> samples(0);
+    std::atomic<bool> failed(false);
+    auto t0 = std::chrono::steady_clock::now();
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(cfg.concurrent)
+    for (int g = 0; g < static_cast<int>(cfg.games); ++g) {
+        if (failed)
+            continue; // cannot break out of parallel loop
+#ifdef _OPENMP
+        omp_set_num_threads(cfg.threads); // team of the searches of this game
+#endif
+        try {
+            const bool swapped = cfg.swap && g % 2 == 1; // dnn B plays white
+            const int dnn[2] = {swapped ? 1 : 0, swapped ? 0 : 1}; // dnn of white and black
+            DNNPlayers players(sockets, cfg.ports[dnn[0]], cfg.ports[dnn[1]]); // evaluators of the dnn of each color
+            TProblem state(players);
+            MCTSDef ai[2] = {MCTSDef(cfg.seed + 2*g), MCTSDef(cfg.seed + 2*g + 1)};
+            for (int p = 0; p < 2; ++p) {
+                players.setEvaluator(p, queues[dnn[p]] ? queues[dnn[p]].get() : evaluators[dnn[p]].get());
+                players.setEvalCache(p, caches[dnn[p]][p].get());
+                players.setWireFormat(p, wire);
+                state.setSymmetry(cfg.symmetry);
+                ai[p].setVirtualLoss(cfg.threads > 1 ? 3 : 0, state.getLostValue(p));
+                ai[p].setTranspositionTable(cfg.transpositions);
+                ai[p].setVerbose(false);
+                ai[p].setTelemetry(telemetry.get(), "game " + std::to_string(g) + (p == 0 ? " white" : " black"));
+            }
+
+            SelfPlayWriter::Game game(g, swapped);
+            std::vector<ActType> history;
+            std::vector<float> gameDNN;
+            std::vector<float> trainDNN;
+            while (!state.isFinished()) {
+                if (cfg.maxMoves != 0 && history.size() == cfg.maxMoves) {
+                    game.header.truncated = 1;
+                    break;
+                }
+                int player = state.getPlayer();
+                ActType act = ai[player].execute(player, cfg.isDeterministic, state, cfg.policyIter, history);
+                if (!ai[player].getPolicy().empty()) {
+                    std::vector<std::pair<ActType, double> > pi(ai[player].getPolicy());
+                    state.getGameStateDNN(gameDNN, player);
+                    state.getPolicyTrainDNN(trainDNN, player, pi);
+                    writer.addSample(game, player, gameDNN, trainDNN);
+                    if (cfg.mirrorSamples && state.mirrorSampleDNN(gameDNN, trainDNN))
+                        writer.addSample(game, player, gameDNN, trainDNN);
+                }
+                state.update(act);
+                history.push_back(act);
+            }
+            game.header.moves = static_cast<std::uint32_t>(history.size());
+            writer.finish(game, state.getResult(0), state.getResult(1));
+
+            for (int p = 0; p < 2; ++p) {
+                int r = state.getResult(p);
+                ++results[dnn[p]][r == 1 ? 0 : (r == -1 ? 1 : 2)];
+            }
+            samples += game.header.samples;
+        } catch (const std::exception& e) {
+            #pragma omp critical
+            std::cerr << "Game " << g << " failed: " << e.what() << std::endl;
+            failed = true;
+        }
+    }
+
+    auto t1 = std::chrono::steady_clock::now();
+    double sec = std::chrono::duration_cast<std::chrono::duration<double> >(t1-t0).count();
+    for (int d = 0; d < 2; ++d) {
+        std::cerr << "DNN " << char('A'+d) << " Won: " << results[d][0]
+                  << " Lost: " << results[d][1] << " Even: " << results[d][2] << std::endl;
+    }
+    std::cerr << "Games: " << cfg.games << " Samples: " << samples << " Time: " << sec << " s "
+              << "Games per Hour: " << cfg.games / sec * 3600.0 << std::endl;
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char** argv) {
+    Config cfg;
+
+    if (argc == 2 && (argv[1] == std::string("-h") || argv[1] == std::string("--help"))) {
+        std::cout << "Paramaters:" << std::endl;
+        std::cout << "game connect4 (or chess)" << std::endl;
+        std::cout << "games 128 (number of games to play)" << std::endl;
+        std::cout << "concurrent 16 (number of games played at the same time, one thread each)" << std::endl;
+        std::cout << "threads 1 (search threads of each game)" << std::endl;
+        std::cout << "portA tcp://localhost:5555 (port of first dnn, plays white in even games)" << std::endl;
+        std::cout << "portB tcp://localhost:5555 (port of second dnn, plays white in odd games)" << std::endl;
+        std::cout << "      ipc:///tmp/alpha4_5555 (ipc transport for DNN on the same host, not on Windows)" << std::endl;
+        std::cout << "swap 1 (alternate colors of the dnns, 0 lets dnn A play white in all games)" << std::endl;
+        std::cout << "out - (path of binary stream of games, - for stdout)" << std::endl;
+        std::cout << "deterministic 0 (stochastic games store training samples, 1 for evaluation games)" << std::endl;
+        std::cout << "iter 800 (policy iterations per move)" << std::endl;
+        std::cout << "maxMoves 0 (end game as even after this many moves, 0 disables)" << std::endl;
+        std::cout << "batchSize 0 (number of states per dnn request, shared by all games, 1 disables batching)" << std::endl;
+        std::cout << "          0 uses concurrent*threads, halved with two dnns, at most 64: a batch is sent once all threads wait" << std::endl;
+        std::cout << "          larger batches than waiting threads never fill, each evaluation then waits batchTimeout" << std::endl;
+        std::cout << "batchTimeout 1000 (max wait in microseconds to fill a batch)" << std::endl;
+        std::cout << "transpositions 0 (log2 of transposition table entries, states share nodes, 0 disables)" << std::endl;
+        std::cout << "evalCache 0 (number of cached dnn results for each dnn and color, 0 disables)" << std::endl;
+        std::cout << "wire dense (encoding of dnn requests: dense, compact planes, or half for compact with float16)" << std::endl;
+        std::cout << "evaluator zmq (dnn backend: zmq server at port, synthetic, or onnx, onnx-cuda, onnx-tensorrt with port as model path)" << std::endl;
+        std::cout << "evalLatency 0 (microseconds of each synthetic evaluation)" << std::endl;
+        std::cout << "telemetry path.jsonl (counters of each search as json lines, needs build with BUILD_Telemetry, empty disables)" << std::endl;
+        std::cout << "symmetry 0 (evaluate and cache connect4 states in their mirror-canonical form)" << std::endl;
+        std::cout << "mirrorSamples 0 (add the mirrored sample of each stochastic move, connect4)" << std::endl;
+        std::cout << "seed 123 (seed of first game, incremented for each)" << std::endl;
+        return 0;
+    }
+
+    if (argc % 2 == 0) {
+        std::cout << "Invalid input, exe key1 value1 key2 value2" << std::endl;
+        return -1;
+    }
+
+    for (int i = 1; i < argc; i+=2) {
+        std::string key(argv[i+0]);
+        std::string val(argv[i+1]);
+        if (key == "game") {
+            cfg.game = val;
+        } else if (key == "games") {
+            cfg.games = std::stoi(val);
+        } else if (key == "concurrent") {
+            cfg.concurrent = std::max(std::stoi(val), 1);
+        } else if (key == "threads") {
+            cfg.threads = std::max(std::stoi(val), 1);
+        } else if (key == "portA") {
+            cfg.ports[0] = val;
+        } else if (key == "portB") {
+            cfg.ports[1] = val;
+        } else if (key == "swap") {
+            cfg.swap = (val != "0");
+        } else if (key == "out") {
+            cfg.out = val;
+        } else if (key == "deterministic") {
+            cfg.isDeterministic = (val != "0");
+        } else if (key == "iter") {
+            cfg.policyIter = std::stoi(val);
+        } else if (key == "maxMoves") {
+            cfg.maxMoves = std::stoi(val);
+        } else if (key == "batchSize") {
+            cfg.batchSize = std::stoi(val);
+        } else if (key == "batchTimeout") {
+            cfg.batchTimeout = std::stoi(val);
+        } else if (key == "transpositions") {
+            cfg.transpositions = std::stoi(val);
+        } else if (key == "evalCache") {
+            cfg.evalCache = std::stoi(val);
+        } else if (key == "wire") {
+            cfg.wire = val;
+        } else if (key == "evaluator") {
+            cfg.evaluator = val;
+        } else if (key == "evalLatency") {
+            cfg.evalLatency = std::stoi(val);
+        } else if (key == "telemetry") {
+            cfg.telemetry = val;
+        } else if (key == "symmetry") {
+            cfg.symmetry = (val != "0");
+        } else if (key == "mirrorSamples") {
+            cfg.mirrorSamples = (val != "0");
+        } else if (key == "seed") {
+            cfg.seed = std::stoi(val);
+        } else {
+            std::cout << "Unknown Key: " << key << std::endl;
+            return -1;
+        }
+    }
+    if (cfg.batchSize == 0)
+        cfg.batchSize = defaultBatchSize(cfg);
+
+    // stdout may carry the binary stream, settings are printed to stderr
+    std::cerr << "Game: " << cfg.game << std::endl;
+    std::cerr << "Games: " << cfg.games << " Concurrent: " << cfg.concurrent << " Threads: " << cfg.threads << std::endl;
+    std::cerr << "Port A: " << cfg.ports[0] << std::endl;
+    std::cerr << "Port B: " << cfg.ports[1] << std::endl;
+    std::cerr << "Swap: " << cfg.swap << std::endl;
+    std::cerr << "Deterministic: " << cfg.isDeterministic << std::endl;
+    std::cerr << "PIter: " << cfg.policyIter << std::endl;
+    std::cerr << "Batch Size: " << cfg.batchSize << std::endl;
+    std::cerr << "Wire Format: " << cfg.wire << std::endl;
+    std::cerr << "Evaluator: " << cfg.evaluator << std::endl;
+    std::cerr << "Telemetry: " << (cfg.telemetry.empty() ? "Disabled" : cfg.telemetry) << std::endl;
+    std::cerr << "Symmetry: " << cfg.symmetry << " Mirror Samples: " << cfg.mirrorSamples << std::endl;
+    if (!cfg.telemetry.empty() && !MCTSTelemetry::Enabled)
+        std::cerr << "Built without telemetry, no counters are written" << std::endl;
+    std::cerr << "Seed: " << cfg.seed << std::endl;
+    std::cerr << "Output: " << cfg.out << std::endl;
+#ifndef _OPENMP
+    std::cerr << "Built without OpenMP, games are played one after the other" << std::endl;
+#endif
+#ifdef _WIN32
+    if (cfg.out == "-")
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+    try {
+        if (cfg.game == "connect4")
+            return playGames<Connect4>(cfg);
+        if (cfg.game == "chess")
+            return playGames<Chess>(cfg);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return -1;
+    }
+    std::cout << "Unknown Game: " << cfg.game << std::endl;
+    return -1;
+}
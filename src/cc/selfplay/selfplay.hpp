@@ -0,0 +1,121 @@
+#ifndef SELFPLAY_HPP
+#define SELFPLAY_HPP
+
+#include <mutex>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <stdexcept>
+
+//! Binary stream of finished self-play games
+/*!
+ * \details Stream starts with the header, followed by one record for each finished game in order of completion.
+ *          Header: char magic[4] "MCSP", uint32 version, uint32 state size, uint32 policy size (number of floats).
+ *          Record: SelfPlayGame, then for each sample float state[state size], float policy[policy size], float value.
+ *          Value of a sample is the result of the game for the player to move, i.e. the perspective of the encoded state.
+ *          Samples are only taken from stochastic moves, deterministic games have results only.
+ *          Numbers are stored in the byte order of the host.
+ *          Each record is written at once and flushed, so a reader of a pipe can store games while others are played.
+ * \author adamp87
+*/
+class SelfPlayWriter {
+public:
+    constexpr static std::uint32_t Version = 1;
+
+    //! Record header of one game, 16 bytes
+    struct SelfPlayGame {
+        std::uint32_t game; //!< index of game, from zero
+        std::uint32_t moves; //!< number of played moves
+        std::uint32_t samples; //!< number of training samples following the header
+        std::int8_t result[2]; //!< result of white and black: 1 won, -1 lost, 0 even
+        std::uint8_t swapped; //!< second dnn played white
+        std::uint8_t truncated; //!< game reached the move limit, result is even
+    };
+
+    //! Samples of one game, collected while it is played
+    struct Game {
+        SelfPlayGame header;
+        std::vector<float> data; //!< concatenated samples, value of each is set when the game is finished
+        std::vector<std::uint8_t> players; //!< player to move of each sample
+
+        Game(std::uint32_t idx, bool swapped) {
+            header.game = idx;
+            header.moves = 0;
+            header.samples = 0;
+            header.result[0] = header.result[1] = 0;
+            header.swapped = swapped ? 1 : 0;
+            header.truncated = 0;
+        }
+    };
+
+private:
+    std::FILE* file; //!< output, not owned if stdout
+    bool owned; //!< file must be closed
+    std::uint32_t stateSize;
+    std::uint32_t policySize;
+    std::mutex lock; //!< games are written by the thread which finished them
+
+    SelfPlayWriter(const SelfPlayWriter&) = delete;
+
+    void write(const void* data, size_t bytes) {
+        if (bytes != 0 && std::fwrite(data, 1, bytes, file) != bytes)
+            throw std::runtime_error("Could not write self-play stream");
+    }
+
+public:
+    //! Open stream and write header
+    /*!
+    * \param path File path, "-" writes to stdout which must be in binary mode
+    * \param stateSize Number of floats of the encoded state
+    * \param policySize Number of floats of the training policy
+    */
+    SelfPlayWriter(const std::string& path, size_t stateSize, size_t policySize)
+        : stateSize(static_cast<std::uint32_t>(stateSize)), policySize(static_cast<std::uint32_t>(policySize))
+    {
+        owned = (path != "-");
+        file = owned ? std::fopen(path.c_str(), "wb") : stdout;
+        if (file == NULL)
+            throw std::runtime_error("Could not open self-play stream: " + path);
+
+        const char magic[4] = {'M', 'C', 'S', 'P'};
+        const std::uint32_t header[3] = {Version, this->stateSize, this->policySize};
+        write(magic, sizeof(magic));
+        write(header, sizeof(header));
+        std::fflush(file);
+    }
+
+    ~SelfPlayWriter() {
+        if (owned)
+            std::fclose(file);
+        else
+            std::fflush(file);
+    }
+
+    //! Add sample of the player to move, value is set by finish
+    void addSample(Game& game, int player, const std::vector<float>& state, const std::vector<float>& policy) const {
+        if (state.size() != stateSize || policy.size() != policySize)
+            throw std::runtime_error("Sample size differs from the stream header");
+        game.data.insert(game.data.end(), state.begin(), state.end());
+        game.data.insert(game.data.end(), policy.begin(), policy.end());
+        game.data.push_back(0.0f);
+        game.players.push_back(static_cast<std::uint8_t>(player));
+        ++game.header.samples;
+    }
+
+    //! Set results and values of the samples, write the game record, thread-safe
+    void finish(Game& game, int resultWhite, int resultBlack) {
+        game.header.result[0] = static_cast<std::int8_t>(resultWhite);
+        game.header.result[1] = static_cast<std::int8_t>(resultBlack);
+        const size_t sampleSize = stateSize + policySize + 1;
+        for (size_t i = 0; i < game.players.size(); ++i)
+            game.data[(i+1)*sampleSize - 1] = static_cast<float>(game.header.result[game.players[i]]);
+
+        std::lock_guard<std::mutex> guard(lock);
+        write(&game.header, sizeof(game.header));
+        write(game.data.data(), game.data.size()*sizeof(float));
+        std::fflush(file);
+    }
+};
+
+#endif // SELFPLAY_HPP
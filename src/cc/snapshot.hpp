@@ -0,0 +1,165 @@
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+//! Header of a binary tree snapshot, 48 bytes
+/*!
+ * \details File: MCTSSnapshotHeader, MCTSSnapshotNode[nodeCount].
+ *          Nodes are in breadth-first order from the root at index zero, so the childs of a node are contiguous.
+ *          Each node stores the index of its first child, a reader walks the tree without parsing or recursion.
+ *          Nodes linked to a transposition are leafs, their shared childs are stored once.
+ *          Numbers are stored in the byte order of the host, actions as raw bytes of the problem.
+ *          Root is identified by the hash of the moves that lead to it, a tree searched by another game does not match.
+ * \author adamp87
+*/
+struct MCTSSnapshotHeader {
+    constexpr static std::uint32_t Version = 2;
+
+    char magic[4]; //!< "MCTT"
+    std::uint32_t version;
+    std::uint32_t nodeBytes; //!< size of one node record
+    std::uint32_t actionBytes; //!< size of the action of the problem
+    std::uint64_t nodeCount; //!< number of node records
+    std::uint64_t rootTime; //!< length of the history at root, zero if root is the initial state
+    std::uint64_t iterations; //!< visits of root
+    std::uint64_t rootHash; //!< hashHistory of the first rootTime moves, zero if rootTime is zero
+
+    static MCTSSnapshotHeader create(std::uint32_t nodeBytes, std::uint32_t actionBytes) {
+        MCTSSnapshotHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "MCTT", 4);
+        header.version = Version;
+        header.nodeBytes = nodeBytes;
+        header.actionBytes = actionBytes;
+        return header;
+    }
+
+    //! FNV-1a of the raw bytes of the first count actions of history, see rootHash
+    template <typename T_Act>
+    static std::uint64_t hashHistory(const std::vector<T_Act>& history, size_t count) {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(history.data());
+        std::uint64_t hash = 14695981039346656037ull;
+        for (size_t i = 0; i < count * sizeof(T_Act); ++i) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+};
+
+//! Node record of a tree snapshot, action is at byte offset 32
+template <typename T_Act>
+struct MCTSSnapshotNode {
+    constexpr static std::uint16_t Expanded = 1; //!< flag, childs were added by policy
+
+    std::uint64_t   N;          //!< visit count
+    double          W;          //!< total value
+    double          P;          //!< prior probability
+    std::uint32_t   first;      //!< index of the first child, zero if there is none
+    std::uint16_t   count;      //!< number of childs
+    std::uint16_t   flags;
+    T_Act           action;     //!< action that takes to the node
+};
+
+//! Read-only memory map of a tree snapshot, see MCTSSnapshotHeader
+/*!
+ * \details Pages are loaded when read, so opening a large snapshot is immediate.
+ * \author adamp87
+*/
+class MCTSSnapshotFile {
+    const char* data; //!< mapped file
+    size_t bytes; //!< size of the file
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+
+    MCTSSnapshotFile(const MCTSSnapshotFile&) = delete;
+
+    void unmap() {
+#ifdef _WIN32
+        if (data != nullptr)
+            UnmapViewOfFile(data);
+        if (mapping != NULL)
+            CloseHandle(mapping);
+        CloseHandle(file);
+        mapping = NULL;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (data != nullptr)
+            munmap(const_cast<char*>(data), bytes);
+#endif
+        data = nullptr;
+    }
+
+public:
+    //! Map file at path, throws if it is no snapshot
+    explicit MCTSSnapshotFile(const std::string& path) : data(nullptr), bytes(0) {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("Could not open snapshot: " + path);
+        LARGE_INTEGER size;
+        GetFileSizeEx(file, &size);
+        bytes = static_cast<size_t>(size.QuadPart);
+        mapping = bytes != 0 ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+        if (mapping != NULL)
+            data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("Could not open snapshot: " + path);
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size != 0) {
+            bytes = static_cast<size_t>(info.st_size);
+            void* map = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+            data = map != MAP_FAILED ? static_cast<const char*>(map) : nullptr;
+        }
+        close(fd); // mapping keeps the file
+#endif
+        if (data == nullptr || bytes < sizeof(MCTSSnapshotHeader) || memcmp(data, "MCTT", 4) != 0) {
+            unmap();
+            throw std::runtime_error("No tree snapshot: " + path);
+        }
+        const MCTSSnapshotHeader& head = header();
+        if (head.version != MCTSSnapshotHeader::Version || bytes != sizeof(head) + head.nodeCount * head.nodeBytes) {
+            unmap();
+            throw std::runtime_error("Bad tree snapshot: " + path);
+        }
+    }
+
+    ~MCTSSnapshotFile() {
+        unmap();
+    }
+
+    const MCTSSnapshotHeader& header() const {
+        return *reinterpret_cast<const MCTSSnapshotHeader*>(data);
+    }
+
+    //! Node records, throws if they were written for another action type
+    template <typename T_Act>
+    const MCTSSnapshotNode<T_Act>* nodes() const {
+        if (header().nodeBytes != sizeof(MCTSSnapshotNode<T_Act>) || header().actionBytes != sizeof(T_Act))
+            throw std::runtime_error("Tree snapshot was written for another problem");
+        return reinterpret_cast<const MCTSSnapshotNode<T_Act>*>(data + sizeof(MCTSSnapshotHeader));
+    }
+};
+
+#endif // SNAPSHOT_HPP
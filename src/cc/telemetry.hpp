@@ -0,0 +1,236 @@
+#ifndef TELEMETRY_HPP
+#define TELEMETRY_HPP
+
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <sstream>
+#include <ostream>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+//! Destination of telemetry lines, shared by the searches of many games
+class MCTSTelemetrySink {
+    std::ostream& stream;
+    std::mutex lock;
+
+public:
+    explicit MCTSTelemetrySink(std::ostream& stream) : stream(stream) {}
+
+    //! Write one line, thread-safe
+    void write(const std::string& line) {
+        std::lock_guard<std::mutex> guard(lock);
+        stream << line << '\n';
+        stream.flush();
+    }
+};
+
+#ifdef MCTS_TELEMETRY
+
+//! Counters of one search, written as one json line per move
+/*!
+ * \details Each thread counts into its own entry, counters are read after the parallel region of the search.
+ *          Evaluation latency covers computeMCTS_WP, i.e. the dnn request or the wait for its batch.
+ *          Wait is the time a thread waits for another thread to expand the same node.
+ *          Depth is the number of nodes visited below the subroot, following a transposition counts as one more.
+ *          Histograms of latency have power of two buckets in microseconds, bucket b counts [2^(b-1), 2^b).
+ *          Enabled by the define MCTS_TELEMETRY (cmake BUILD_Telemetry), otherwise all functions are empty.
+ * \author adamp87
+*/
+class MCTSTelemetry {
+public:
+    constexpr static bool Enabled = true;
+    constexpr static size_t LatencyBuckets = 24;
+    constexpr static size_t DepthBuckets = 64; //!< last bucket counts deeper paths
+
+    typedef std::chrono::steady_clock Clock;
+    typedef Clock::time_point TimePoint;
+
+private:
+    //! Counters of one thread
+    struct Counters {
+        std::uint64_t iterations;
+        std::uint64_t expanded; //!< nodes which got childs
+        std::uint64_t transpositions; //!< nodes linked to an expanded node of the same state
+        std::uint64_t evaluations;
+        std::uint64_t evalNs;
+        std::uint64_t waits;
+        std::uint64_t waitNs;
+        std::uint64_t busyNs; //!< time in the search loop
+        std::uint64_t latency[LatencyBuckets];
+        std::uint64_t depth[DepthBuckets];
+        char padding[64]; //!< keeps counters of threads on separate cache lines
+    };
+
+    std::vector<Counters> threads;
+    TimePoint start;
+    int level; //!< openmp level of the caller, searches run one level below
+
+    Counters& local() {
+#ifdef _OPENMP
+        size_t idx = omp_get_level() > level ? static_cast<size_t>(omp_get_thread_num()) : 0;
+        return threads[std::min(idx, threads.size()-1)];
+#else
+        return threads[0];
+#endif
+    }
+
+    static std::uint64_t since(TimePoint t0) {
+        return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t0).count());
+    }
+
+    template <size_t N>
+    static void writeArray(std::ostream& out, const std::uint64_t (&values)[N]) {
+        size_t last = N;
+        while (last > 1 && values[last-1] == 0)
+            --last; // trailing zeros are omitted
+        out << "[";
+        for (size_t i = 0; i < last; ++i)
+            out << (i == 0 ? "" : ",") << values[i];
+        out << "]";
+    }
+
+public:
+    MCTSTelemetry() : threads(1), level(0) {
+        begin(1);
+    }
+
+    static TimePoint now() {
+        return Clock::now();
+    }
+
+    //! Reset counters at the start of a search of upto nThreads threads
+    void begin(size_t nThreads) {
+        threads.assign(std::max<size_t>(nThreads, 1), Counters());
+        start = Clock::now();
+#ifdef _OPENMP
+        level = omp_get_level();
+#endif
+    }
+
+    void addIteration(size_t depth) {
+        Counters& c = local();
+        ++c.iterations;
+        ++c.depth[std::min(depth, DepthBuckets-1)];
+    }
+
+    void addExpanded() {
+        ++local().expanded;
+    }
+
+    void addTransposition() {
+        ++local().transpositions;
+    }
+
+    void addEvaluation(TimePoint t0) {
+        Counters& c = local();
+        std::uint64_t ns = since(t0);
+        size_t bucket = 0;
+        for (std::uint64_t us = ns / 1000; us != 0 && bucket+1 < LatencyBuckets; us >>= 1)
+            ++bucket;
+        ++c.evaluations;
+        c.evalNs += ns;
+        ++c.latency[bucket];
+    }
+
+    void addWait(TimePoint t0) {
+        Counters& c = local();
+        ++c.waits;
+        c.waitNs += since(t0);
+    }
+
+    void addBusy(TimePoint t0) {
+        local().busyNs += since(t0);
+    }
+
+    //! Json line of the counters of the search
+    /*!
+    * \param label Identifies the search in the lines of many games, omitted if empty
+    * \param time Length of the history, i.e. number of the move
+    * \param idxAi ID of player who searched
+    * \param nodes Number of nodes in the tree after the search
+    */
+    std::string json(const std::string& label, size_t time, int idxAi, size_t nodes) const {
+        Counters sum = Counters();
+        for (const Counters& c : threads) {
+            sum.iterations += c.iterations;
+            sum.expanded += c.expanded;
+            sum.transpositions += c.transpositions;
+            sum.evaluations += c.evaluations;
+            sum.evalNs += c.evalNs;
+            sum.waits += c.waits;
+            sum.waitNs += c.waitNs;
+            for (size_t b = 0; b < LatencyBuckets; ++b)
+                sum.latency[b] += c.latency[b];
+            for (size_t b = 0; b < DepthBuckets; ++b)
+                sum.depth[b] += c.depth[b];
+        }
+        std::uint64_t depthSum = 0;
+        size_t depthMax = 0;
+        for (size_t b = 0; b < DepthBuckets; ++b) {
+            depthSum += b * sum.depth[b];
+            if (sum.depth[b] != 0)
+                depthMax = b;
+        }
+
+        std::ostringstream out;
+        out << "{";
+        if (!label.empty())
+            out << "\"label\":\"" << label << "\",";
+        out << "\"move\":" << time
+            << ",\"player\":" << idxAi
+            << ",\"ms\":" << since(start) / 1e6
+            << ",\"iterations\":" << sum.iterations
+            << ",\"nodes\":" << nodes
+            << ",\"expanded\":" << sum.expanded
+            << ",\"transpositions\":" << sum.transpositions
+            << ",\"evaluations\":" << sum.evaluations
+            << ",\"eval_us\":" << (sum.evaluations != 0 ? sum.evalNs / 1e3 / sum.evaluations : 0.0)
+            << ",\"eval_hist\":";
+        writeArray(out, sum.latency);
+        out << ",\"waits\":" << sum.waits
+            << ",\"wait_us\":" << sum.waitNs / 1e3
+            << ",\"depth_mean\":" << (sum.iterations != 0 ? double(depthSum) / sum.iterations : 0.0)
+            << ",\"depth_max\":" << depthMax
+            << ",\"depth_hist\":";
+        writeArray(out, sum.depth);
+        out << ",\"threads\":[";
+        for (size_t i = 0; i < threads.size(); ++i) {
+            const Counters& c = threads[i];
+            out << (i == 0 ? "" : ",")
+                << "{\"iterations\":" << c.iterations
+                << ",\"iter_per_sec\":" << (c.busyNs != 0 ? c.iterations * 1e9 / c.busyNs : 0.0) << "}";
+        }
+        out << "]}";
+        return out.str();
+    }
+};
+
+#else
+
+//! Telemetry compiled out, calls are empty and removed by the compiler
+class MCTSTelemetry {
+public:
+    constexpr static bool Enabled = false;
+
+    struct TimePoint {};
+
+    static TimePoint now() { return TimePoint(); }
+    void begin(size_t) {}
+    void addIteration(size_t) {}
+    void addExpanded() {}
+    void addTransposition() {}
+    void addEvaluation(TimePoint) {}
+    void addWait(TimePoint) {}
+    void addBusy(TimePoint) {}
+    std::string json(const std::string&, size_t, int, size_t) const { return std::string(); }
+};
+
+#endif // MCTS_TELEMETRY
+
+#endif // TELEMETRY_HPP
@@ -0,0 +1,146 @@
+#ifndef UCBKERNEL_HPP
+#define UCBKERNEL_HPP
+
+#include <limits>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+//! Selection of the child with highest UCB value on statistics stored as arrays
+/*!
+ * \details Value of child i is Q + c * P' * sqrt(N_parent) / (1 + N), P' is the prior mixed with noise at root.
+ *          Same formula as MCTS::getUCB, same child is selected, the first one if values are equal.
+ *          Childs are evaluated four at a time with AVX2, two at a time with NEON on 64 bit ARM.
+ *          Without these instruction sets (e.g. no -mavx2 or -march=native), the scalar loop is used.
+ *          Arrays are read without synchronization, other threads may update them meanwhile, as in the scalar policy.
+ * \author adamp87
+*/
+struct MCTSKernelUCB {
+    //! Value of one child
+    static double value(std::uint32_t N, double W, double P, double noise, double ratio, double visitSqrt, double c) {
+        double p = ratio * P + (1.0-ratio) * noise;
+        double n = static_cast<double>(N) + std::numeric_limits<double>::epsilon();
+        double q = W / n;
+        double u = p * (visitSqrt/(1+n));
+        return q + c*u;
+    }
+
+    //! Index of best child, scalar loop from index first, best and bestVal hold the best of preceding childs
+    static size_t argmaxScalar(size_t first, size_t count, const std::uint32_t* N, const double* W, const double* P,
+                               const double* noise, double ratio, double visitSqrt, double c,
+                               size_t best = 0, double bestVal = -std::numeric_limits<double>::max()) {
+        if (noise == nullptr)
+            ratio = 1.0;
+        for (size_t i = first; i < count; ++i) {
+            double val = value(N[i], W[i], P[i], noise != nullptr ? noise[i] : 0.0, ratio, visitSqrt, c);
+            if (bestVal < val) {
+                best = i;
+                bestVal = val;
+            }
+        }
+        return best;
+    }
+
+    //! Index of best child, vectorized if the instruction set is available
+    /*!
+    * \param count Number of childs, at least one
+    * \param N Visit counts of childs
+    * \param W Total values of childs
+    * \param P Priors of childs
+    * \param noise Dirichlet noise of childs, nullptr if noise is not applied
+    * \param ratio Ratio of prior to noise
+    * \param visitSqrt Square root of the visit count of the parent
+    * \param c Exploration constant
+    */
+    static size_t argmax(size_t count, const std::uint32_t* N, const double* W, const double* P,
+                         const double* noise, double ratio, double visitSqrt, double c) {
+        size_t best = 0;
+        double bestVal = -std::numeric_limits<double>::max();
+        size_t i = 0;
+        if (noise == nullptr)
+            ratio = 1.0;
+#if defined(__AVX2__)
+        if (count >= 8) { // below, the reduction of the lanes costs more than it saves
+            const __m256d eps = _mm256_set1_pd(std::numeric_limits<double>::epsilon());
+            const __m256d one = _mm256_set1_pd(1.0);
+            const __m256d vRatio = _mm256_set1_pd(ratio);
+            const __m256d vNoiseRatio = _mm256_set1_pd(1.0-ratio);
+            const __m256d vSqrt = _mm256_set1_pd(visitSqrt);
+            const __m256d vC = _mm256_set1_pd(c);
+            const __m256d step = _mm256_set1_pd(4.0);
+            __m256d idx = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+            __m256d laneBest = _mm256_setzero_pd();
+            __m256d laneVal = _mm256_set1_pd(bestVal);
+            for (; i + 4 <= count; i += 4) {
+                __m256d p = _mm256_loadu_pd(P + i);
+                if (noise != nullptr)
+                    p = _mm256_add_pd(_mm256_mul_pd(vRatio, p), _mm256_mul_pd(vNoiseRatio, _mm256_loadu_pd(noise + i)));
+                // counts are far below 2^31, signed conversion is exact
+                __m256d n = _mm256_add_pd(_mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(N + i))), eps);
+                __m256d q = _mm256_div_pd(_mm256_loadu_pd(W + i), n);
+                __m256d u = _mm256_mul_pd(p, _mm256_div_pd(vSqrt, _mm256_add_pd(one, n)));
+                __m256d val = _mm256_add_pd(q, _mm256_mul_pd(vC, u));
+                __m256d better = _mm256_cmp_pd(laneVal, val, _CMP_LT_OQ);
+                laneVal = _mm256_blendv_pd(laneVal, val, better);
+                laneBest = _mm256_blendv_pd(laneBest, idx, better);
+                idx = _mm256_add_pd(idx, step);
+            }
+            double vals[4], idxs[4];
+            _mm256_storeu_pd(vals, laneVal);
+            _mm256_storeu_pd(idxs, laneBest);
+            reduce(vals, idxs, 4, best, bestVal);
+        }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+        if (count >= 4) {
+            const float64x2_t eps = vdupq_n_f64(std::numeric_limits<double>::epsilon());
+            const float64x2_t one = vdupq_n_f64(1.0);
+            const float64x2_t vRatio = vdupq_n_f64(ratio);
+            const float64x2_t vNoiseRatio = vdupq_n_f64(1.0-ratio);
+            const float64x2_t vSqrt = vdupq_n_f64(visitSqrt);
+            const float64x2_t vC = vdupq_n_f64(c);
+            const float64x2_t step = vdupq_n_f64(2.0);
+            const double first[2] = {0.0, 1.0};
+            float64x2_t idx = vld1q_f64(first);
+            float64x2_t laneBest = vdupq_n_f64(0.0);
+            float64x2_t laneVal = vdupq_n_f64(bestVal);
+            for (; i + 2 <= count; i += 2) {
+                float64x2_t p = vld1q_f64(P + i);
+                if (noise != nullptr)
+                    p = vaddq_f64(vmulq_f64(vRatio, p), vmulq_f64(vNoiseRatio, vld1q_f64(noise + i)));
+                float64x2_t n = vaddq_f64(vcvtq_f64_u64(vmovl_u32(vld1_u32(N + i))), eps);
+                float64x2_t q = vdivq_f64(vld1q_f64(W + i), n);
+                float64x2_t u = vmulq_f64(p, vdivq_f64(vSqrt, vaddq_f64(one, n)));
+                float64x2_t val = vaddq_f64(q, vmulq_f64(vC, u));
+                uint64x2_t better = vcltq_f64(laneVal, val);
+                laneVal = vbslq_f64(better, val, laneVal);
+                laneBest = vbslq_f64(better, idx, laneBest);
+                idx = vaddq_f64(idx, step);
+            }
+            double vals[2], idxs[2];
+            vst1q_f64(vals, laneVal);
+            vst1q_f64(idxs, laneBest);
+            reduce(vals, idxs, 2, best, bestVal);
+        }
+#endif
+        return argmaxScalar(i, count, N, W, P, noise, ratio, visitSqrt, c, best, bestVal);
+    }
+
+private:
+    //! Best of the lanes, first child if values are equal
+    static void reduce(const double* vals, const double* idxs, size_t lanes, size_t& best, double& bestVal) {
+        for (size_t l = 0; l < lanes; ++l) {
+            size_t idx = static_cast<size_t>(idxs[l]);
+            if (bestVal < vals[l] || (bestVal == vals[l] && idx < best)) {
+                best = idx;
+                bestVal = vals[l];
+            }
+        }
+    }
+};
+
+#endif // UCBKERNEL_HPP
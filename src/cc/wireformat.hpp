@@ -0,0 +1,298 @@
+#ifndef WIREFORMAT_HPP
+#define WIREFORMAT_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#include <zmq.hpp>
+
+#include "zmqpool.hpp"
+
+//! Encoding of dnn requests and replies
+/*!
+ * \details Dense sends the states as concatenated float32 and receives concatenated float32 rows, as the first servers did.
+ *          Compact classifies each plane (planeSize values) of each state:
+ *          zero planes are only marked, constant planes (e.g. color, move count, castling) are one float32,
+ *          binary planes (pieces) are bitboards, other planes are float32, or float16 with CompactHalf.
+ *          Request: Header, uint8 kind[states*planes], payload of the planes in order.
+ *          Reply: ReplyHeader, float32 or float16 row of each state, e.g. policy logits and value.
+ *          The magic of both headers is a NaN as float32, so servers can tell a compact message from dense states.
+ *          Numbers are stored in the byte order of the host, bits of a bitboard are least significant first.
+ * \author adamp87
+*/
+class DNNWireFormat {
+public:
+    enum Mode { Dense, Compact, CompactHalf };
+
+    constexpr static std::uint16_t Version = 1;
+    constexpr static std::uint16_t FlagHalf = 1; //!< dense planes and reply rows are float16
+
+    //! Kind of one plane of a compact request
+    enum Kind : std::uint8_t { Zero = 0, Constant = 1, Bits = 2, Values = 3 };
+
+    //! Header of a compact request, 20 bytes
+    struct Header {
+        char magic[4]; //!< "MC\xC1\xFF"
+        std::uint16_t version;
+        std::uint16_t flags;
+        std::uint32_t states; //!< number of states
+        std::uint32_t planes; //!< planes of each state
+        std::uint32_t planeSize; //!< values of each plane
+    };
+
+    //! Header of a compact reply, 16 bytes
+    struct ReplyHeader {
+        char magic[4]; //!< same as request
+        std::uint16_t version;
+        std::uint16_t flags;
+        std::uint32_t states; //!< number of rows
+        std::uint32_t rowSize; //!< values of each row
+    };
+
+private:
+    Mode mode;
+    size_t planeSize; //!< number of values of one plane, e.g. squares of the board
+
+    static void setMagic(char* magic) {
+        magic[0] = 'M';
+        magic[1] = 'C';
+        magic[2] = char(0xC1);
+        magic[3] = char(0xFF);
+    }
+
+    static bool isMagic(const char* magic) {
+        return magic[0] == 'M' && magic[1] == 'C' && magic[2] == char(0xC1) && magic[3] == char(0xFF);
+    }
+
+    //! Classify plane and return its payload size
+    size_t classify(const float* plane, Kind& kind) const {
+        bool constant = true;
+        bool binary = true;
+        for (size_t i = 0; i < planeSize; ++i) {
+            constant &= (plane[i] == plane[0]);
+            binary &= (plane[i] == 0.0f || plane[i] == 1.0f);
+        }
+        if (constant) {
+            kind = plane[0] == 0.0f ? Zero : Constant;
+            return kind == Zero ? 0 : sizeof(float);
+        }
+        if (binary) {
+            kind = Bits;
+            return (planeSize + 7) / 8;
+        }
+        kind = Values;
+        return planeSize * (mode == CompactHalf ? sizeof(std::uint16_t) : sizeof(float));
+    }
+
+    void encodeCompact(const std::vector<const std::vector<float>*>& states, zmq::message_t& request) const {
+        const size_t stateSize = states[0]->size();
+        if (stateSize % planeSize != 0)
+            throw std::runtime_error("State size is not a multiple of the plane size");
+        const size_t planes = stateSize / planeSize;
+
+        // first pass sizes the message
+        std::vector<Kind> kinds(states.size() * planes);
+        size_t payload = 0;
+        for (size_t s = 0; s < states.size(); ++s) {
+            if (states[s]->size() != stateSize)
+                throw std::runtime_error("States of a batch differ in size");
+            for (size_t p = 0; p < planes; ++p)
+                payload += classify(states[s]->data() + p*planeSize, kinds[s*planes + p]);
+        }
+
+        request.rebuild(sizeof(Header) + kinds.size() + payload);
+        char* data = static_cast<char*>(request.data());
+        Header header;
+        setMagic(header.magic);
+        header.version = Version;
+        header.flags = (mode == CompactHalf) ? FlagHalf : 0;
+        header.states = static_cast<std::uint32_t>(states.size());
+        header.planes = static_cast<std::uint32_t>(planes);
+        header.planeSize = static_cast<std::uint32_t>(planeSize);
+        memcpy(data, &header, sizeof(Header));
+        memcpy(data + sizeof(Header), kinds.data(), kinds.size());
+        data += sizeof(Header) + kinds.size();
+
+        for (size_t s = 0; s < states.size(); ++s) {
+            for (size_t p = 0; p < planes; ++p) {
+                const float* plane = states[s]->data() + p*planeSize;
+                switch (kinds[s*planes + p]) {
+                case Zero:
+                    break;
+                case Constant:
+                    memcpy(data, plane, sizeof(float));
+                    data += sizeof(float);
+                    break;
+                case Bits:
+                    memset(data, 0, (planeSize + 7) / 8);
+                    for (size_t i = 0; i < planeSize; ++i) {
+                        if (plane[i] != 0.0f)
+                            data[i/8] |= char(1 << (i%8));
+                    }
+                    data += (planeSize + 7) / 8;
+                    break;
+                case Values:
+                    if (mode == CompactHalf) {
+                        for (size_t i = 0; i < planeSize; ++i, data += sizeof(std::uint16_t)) {
+                            std::uint16_t h = toHalf(plane[i]);
+                            memcpy(data, &h, sizeof(h));
+                        }
+                    } else {
+                        memcpy(data, plane, planeSize*sizeof(float));
+                        data += planeSize*sizeof(float);
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    void decodeCompact(const zmq::message_t& reply, size_t nStates, std::vector<float>& result) const {
+        ReplyHeader header;
+        if (reply.size() < sizeof(ReplyHeader))
+            throw std::runtime_error("Bad Reply");
+        memcpy(&header, reply.data(), sizeof(ReplyHeader));
+        if (!isMagic(header.magic) || header.version != Version)
+            throw std::runtime_error("Bad Reply, unknown format");
+        if (header.states != nStates)
+            throw std::runtime_error("Bad Reply, number of results differs from states");
+
+        const size_t count = size_t(header.states) * header.rowSize;
+        const bool half = (header.flags & FlagHalf) != 0;
+        const char* data = static_cast<const char*>(reply.data()) + sizeof(ReplyHeader);
+        if (reply.size() != sizeof(ReplyHeader) + count * (half ? sizeof(std::uint16_t) : sizeof(float)))
+            throw std::runtime_error("Bad Reply, size differs from header");
+        result.resize(count);
+        if (half) {
+            for (size_t i = 0; i < count; ++i, data += sizeof(std::uint16_t)) {
+                std::uint16_t h;
+                memcpy(&h, data, sizeof(h));
+                result[i] = fromHalf(h);
+            }
+        } else if (count != 0) {
+            memcpy(result.data(), data, count*sizeof(float));
+        }
+    }
+
+public:
+    //! Create format
+    /*!
+    * \param mode Dense or Compact encoding
+    * \param planeSize Number of values of one plane of the state, e.g. 64 squares for chess
+    */
+    DNNWireFormat(Mode mode = Dense, size_t planeSize = 1)
+        : mode(mode), planeSize(planeSize == 0 ? 1 : planeSize)
+    {}
+
+    //! Parse name of mode: dense, compact or half
+    static Mode parseMode(const std::string& name) {
+        if (name == "dense")
+            return Dense;
+        if (name == "compact")
+            return Compact;
+        if (name == "half")
+            return CompactHalf;
+        throw std::invalid_argument("Unknown wire format: " + name);
+    }
+
+    Mode getMode() const {
+        return mode;
+    }
+
+    //! Encode states of equal size into one request
+    void encode(const std::vector<const std::vector<float>*>& states, zmq::message_t& request) const {
+        if (mode != Dense) {
+            encodeCompact(states, request);
+            return;
+        }
+        const size_t stateSize = states[0]->size();
+        request.rebuild(states.size()*stateSize*sizeof(float));
+        float* data = static_cast<float*>(request.data());
+        for (size_t i = 0; i < states.size(); ++i) {
+            if (states[i]->size() != stateSize)
+                throw std::runtime_error("States of a batch differ in size");
+            memcpy(data + i*stateSize, states[i]->data(), stateSize*sizeof(float));
+        }
+    }
+
+    //! Decode reply of nStates states into concatenated rows, throws if a compact header does not match
+    void decode(const zmq::message_t& reply, size_t nStates, std::vector<float>& result) const {
+        if (mode != Dense) {
+            decodeCompact(reply, nStates, result);
+            return;
+        }
+        result.resize(reply.size() / sizeof(float));
+        if (!result.empty())
+            memcpy(result.data(), reply.data(), result.size()*sizeof(float));
+    }
+
+    //! Send states to the dnn server at port and receive their results, thread-safe
+    void exchange(ZMQSocketPool& sockets, const std::string& port,
+                  const std::vector<const std::vector<float>*>& states, std::vector<float>& result) const {
+        zmq::message_t request;
+        zmq::message_t reply;
+        encode(states, request);
+        sockets.request(port, request, reply);
+        decode(reply, states.size(), result);
+    }
+
+    //! IEEE half precision of value, rounded to nearest even
+    static std::uint16_t toHalf(float value) {
+        std::uint32_t x;
+        memcpy(&x, &value, sizeof(x));
+        std::uint32_t sign = (x >> 16) & 0x8000;
+        std::uint32_t mant = x & 0x7FFFFF;
+        int exp = static_cast<int>((x >> 23) & 0xFF) - 127 + 15;
+        if (((x >> 23) & 0xFF) == 0xFF) // infinity or nan
+            return static_cast<std::uint16_t>(sign | 0x7C00 | (mant != 0 ? 0x200 : 0));
+        if (exp >= 31) // overflow
+            return static_cast<std::uint16_t>(sign | 0x7C00);
+        if (exp <= 0) { // subnormal half
+            if (exp < -10)
+                return static_cast<std::uint16_t>(sign);
+            mant |= 0x800000;
+            int shift = 14 - exp;
+            std::uint32_t half = mant >> shift;
+            std::uint32_t rest = mant & ((1u << shift) - 1);
+            std::uint32_t halfway = 1u << (shift - 1);
+            if (rest > halfway || (rest == halfway && (half & 1)))
+                ++half;
+            return static_cast<std::uint16_t>(sign | half);
+        }
+        std::uint32_t half = sign | (static_cast<std::uint32_t>(exp) << 10) | (mant >> 13);
+        std::uint32_t rest = mant & 0x1FFF;
+        if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+            ++half; // carry into exponent rounds up to the next power of two or infinity
+        return static_cast<std::uint16_t>(half);
+    }
+
+    //! Single precision of IEEE half
+    static float fromHalf(std::uint16_t half) {
+        std::uint32_t sign = static_cast<std::uint32_t>(half & 0x8000) << 16;
+        std::uint32_t exp = (half >> 10) & 0x1F;
+        std::uint32_t mant = half & 0x3FF;
+        std::uint32_t x;
+        if (exp == 0x1F) {
+            x = sign | 0x7F800000 | (mant << 13);
+        } else if (exp != 0) {
+            x = sign | ((exp + 112) << 23) | (mant << 13);
+        } else if (mant == 0) {
+            x = sign;
+        } else { // subnormal half is a normal float
+            exp = 113;
+            while ((mant & 0x400) == 0) {
+                mant <<= 1;
+                --exp;
+            }
+            x = sign | (exp << 23) | ((mant & 0x3FF) << 13);
+        }
+        float value;
+        memcpy(&value, &x, sizeof(value));
+        return value;
+    }
+};
+
+#endif // WIREFORMAT_HPP
@@ -0,0 +1,75 @@
+#ifndef ZMQPOOL_HPP
+#define ZMQPOOL_HPP
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include <zmq.hpp>
+
+//! Pool of connected ZeroMQ REQ sockets, reused between requests
+/*!
+ * \details Connecting a socket for each evaluation costs more than the inference on loopback.
+ *          The pool keeps idle sockets for each endpoint, a request takes one or connects a new one.
+ *          After the reply has arrived, the socket is put back to the pool.
+ *          If the exchange fails, the socket is closed, since a REQ socket cannot recover from a missing reply.
+ *          Number of sockets grows to the number of threads requesting the same endpoint at the same time.
+ *          It must be owned outside of the problem, because problem states are copied for each policy iteration.
+ *          Endpoints can use any transport of ZeroMQ, e.g. tcp://localhost:5555 or ipc:///tmp/alpha4_5555.
+ * \author adamp87
+*/
+class ZMQSocketPool {
+    typedef std::unique_ptr<zmq::socket_t> SocketPtr;
+
+    zmq::context_t& zmq_context; //!< zeromq context for socket connections
+    std::mutex lock; //!< guards idle
+    std::map<std::string, std::vector<SocketPtr> > idle; //!< connected sockets not in use, per endpoint
+
+    ZMQSocketPool(const ZMQSocketPool&) = delete;
+
+    //! Take an idle socket of endpoint, or connect a new one
+    SocketPtr acquire(const std::string& endpoint) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            std::vector<SocketPtr>& sockets = idle[endpoint];
+            if (!sockets.empty()) {
+                SocketPtr socket(std::move(sockets.back()));
+                sockets.pop_back();
+                return socket;
+            }
+        }
+
+        int linger = 0; // do not block context termination on pending messages
+        SocketPtr socket(new zmq::socket_t(zmq_context, ZMQ_REQ));
+        socket->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+        socket->connect(endpoint);
+        return socket;
+    }
+
+    //! Put socket back to the pool
+    void release(const std::string& endpoint, SocketPtr socket) {
+        std::lock_guard<std::mutex> guard(lock);
+        idle[endpoint].push_back(std::move(socket));
+    }
+
+public:
+    ZMQSocketPool(zmq::context_t& zmq_context)
+        : zmq_context(zmq_context)
+    {}
+
+    //! Send request and receive reply on a pooled socket of the endpoint, thread-safe
+    void request(const std::string& endpoint, zmq::message_t& request, zmq::message_t& reply) {
+        SocketPtr socket = acquire(endpoint);
+        // on failure socket is closed
+        if (!socket->send(request))
+            throw std::runtime_error("Could not send request");
+        if (!socket->recv(&reply))
+            throw std::runtime_error("Could not receive reply");
+        release(endpoint, std::move(socket));
+    }
+};
+
+#endif // ZMQPOOL_HPP
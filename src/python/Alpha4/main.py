@@ -16,7 +16,7 @@ from Alpha4.mcts import MCTS
 # from Alpha4.model import DNNPredict as Predict
 # from Alpha4.model_rt import DNNPredictRT as Predict
 from Alpha4.model_lite import DNNPredictLite as Predict
-from Alpha4.database import Database
+from Alpha4.replay import ReplayBuffer
 from Alpha4.connect4 import Connect4 as Game
 from Alpha4.logger import get_logger, add_file_logger
 
@@ -122,7 +122,9 @@ def main():
     parser.add_argument("--total_iterations", type=int, default=10, help="Total number of iterations to run")
     parser.add_argument("--self_plays", type=int, default=250, help="Number of self play games to execute")
     parser.add_argument("--eval_plays", type=int, default=60, help="Number of evaluation play games to execute")
-    parser.add_argument("--path_to_database", type=str, default=Game.name+'.hdf', help="Path to HDF file")
+    parser.add_argument("--path_to_database", type=str, default=Game.name+'_replay', help="Path to replay buffer directory")
+    parser.add_argument("--replay_window", type=int, default=0,
+                        help="Number of recent iterations whose samples are trained on, 0 uses all")
     parser.add_argument("--train_epochs", type=int, default=300, help="Number of epochs for training")
     parser.add_argument("--train_sample_size", type=int, default=256, help="Number of game states to use for training")
     args = parser.parse_args()
@@ -130,8 +132,8 @@ def main():
     # set up logging
     log = get_logger()
     add_file_logger(log, os.path.join(args.root_dir, 'data', Game.name+'.log'))
-    if args.path_to_database == Game.name+'.hdf':
-        args.path_to_database = os.path.join(args.root_dir, 'data', Game.name+'.hdf')
+    if args.path_to_database == Game.name+'_replay':
+        args.path_to_database = os.path.join(args.root_dir, 'data', Game.name+'_replay')
 
     # set up TF GPU
     log.info("TensorFlow V: {0}, CUDA: {1}".format(tf.__version__, tf.test.is_built_with_cuda()))
@@ -140,7 +142,7 @@ def main():
         tf.config.experimental.set_memory_growth(gpu, True)
 
     # open database and init models
-    database = Database(log, args.path_to_database, Game.dims_state, Game.dims_policy)
+    database = ReplayBuffer(log, args.path_to_database, Game.dims_state, Game.dims_policy, args.replay_window)
     tf_lite_args = {"database": database, "delegate": "libedgetpu.so.1", "device": "usb:0", "compile_tpu": True}
     curr_model = Predict(log, Game.dims_state, Game.dims_policy, **tf_lite_args)
     best_model = Predict(log, Game.dims_state, Game.dims_policy, **tf_lite_args)
@@ -155,13 +157,14 @@ def main():
 
     # Test Code, only for DNNPredict
     # curr_model.load(os.path.join(args.root_dir, 'models', 'save_1'))
-    # value, policy = curr_model.predict(np.array(database.datafile["state"]))
+    # value, policy = curr_model.predict(np.array(database.state[:database.get_state_count()]))
     # print(np.unique(value, return_counts=True))
     # exit(0)
 
     try:  # main loop for AlphaZero workflow
         for iteration_idx in range(args.iteration+1, args.iteration+args.total_iterations+1):
             log.info("Starting iteration: {0}".format(iteration_idx))
+            database.set_iteration(iteration_idx)
             self_play(args, best_model, curr_model, database, log)
             curr_model.retrain(args, database)
             curr_model.save(os.path.join(args.root_dir, 'models', 'save_{0}'.format(iteration_idx)))
@@ -172,6 +172,16 @@ class DNNPredict(AlphaNet):
         value, policy = self.model.predict(state)
         return value[0, 0], policy
 
+    def predict_batch(self, state):
+        """
+        Prediction of value and policy for a batch of input states.
+        :param state: Input tensor of game states, first dimension is the batch.
+        :return: value: one value for each state describing the chance to win
+        :return: policy: tensor describing for each state which next position should be investigated
+        """
+        value, policy = self.model.predict(state, batch_size=state.shape[0])
+        return value[:, 0], policy
+
     def retrain(self, args, database):
         """Performs retraining of the model"""
         fit = None
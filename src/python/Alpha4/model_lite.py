@@ -43,6 +43,21 @@ class DNNPredictLite(DNNPredict):
 
         return value[0, 0], policy
 
+    def predict_batch(self, state):
+        """
+        Prediction of value and policy for a batch of input states.
+        The interpreter has a fixed input of one state, states are predicted one after the other.
+        :param state: Input tensor of game states, first dimension is the batch.
+        :return: value: one value for each state describing the chance to win
+        :return: policy: tensor describing for each state which next position should be investigated
+        """
+        values = np.empty(state.shape[0], dtype=np.float32)
+        policies = []
+        for i in range(state.shape[0]):
+            values[i], policy = self.predict(state[i:i+1])
+            policies.append(policy)
+        return values, np.concatenate(policies, axis=0)
+
     def save(self, path):
         """Save model weights and convert to TFLite CPU and TPU"""
         def representative_dataset_gen():
@@ -32,6 +32,19 @@ class DNNPredictRT(DNNPredict):
         policy = prediction[0].numpy()
         return value[0, 0], policy
 
+    def predict_batch(self, state):
+        """
+        Prediction of value and policy for a batch of input states on freezed TensorRT models.
+        :param state: Input tensor of game states, first dimension is the batch.
+        :return: value: one value for each state describing the chance to win
+        :return: policy: tensor describing for each state which next position should be investigated
+        """
+        state = tf.convert_to_tensor(state, dtype=tf.float32)
+        prediction = self.tensorrt_predict(state)
+        value = prediction[1].numpy()
+        policy = prediction[0].numpy()
+        return value[:, 0], policy
+
     def save(self, path):
         """Save model weights and convert to TensorRT"""
         DNNPredict.save(self, path)  # save model weights
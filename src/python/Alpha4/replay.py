@@ -0,0 +1,166 @@
+"""
+Implementation of a replay buffer using memory-mapped record files
+
+Author: AdamP 2020-2020
+"""
+
+import os
+import json
+import threading
+
+import numpy as np
+
+
+class ReplayBuffer:
+    """
+    Replay buffer to store input/output tensors for DNN training, a drop-in for Database.
+    Stores state, policy and value of each sample as fixed-size float32 records in uncompressed files of a directory.
+    Files are memory-mapped and grow by doubling, so storing a game appends without rewriting or recompressing.
+    An index holds game, iteration, first sample and sample count of each game in order of storage.
+    Random batches are drawn from a sliding window over the games of the last iterations in O(batch size).
+    """
+    VERSION = 1
+    INDEX_DTYPE = np.dtype([('game', '<u4'), ('iteration', '<u4'), ('start', '<u8'), ('count', '<u4'), ('reserved', '<u4')])
+    MIN_CAPACITY = 4096  # samples of new record files
+
+    def __init__(self, log, path, dims_state, dims_policy, window=0):
+        """
+        :param path: Directory of the buffer, created if missing
+        :param window: Number of most recent iterations which load samples from, zero uses all
+        """
+        self.log = log
+        self.path = path
+        self.dims_state = tuple(dims_state)
+        self.dims_policy = tuple(dims_policy)
+        self.window = window
+        self.iteration = 0
+        self.lock = threading.Lock()  # handler thread stores while training loads
+
+        meta_path = os.path.join(path, "meta.json")
+        if not os.path.isfile(meta_path):
+            os.makedirs(path, exist_ok=True)
+            with open(meta_path, "w") as file:
+                json.dump({"version": ReplayBuffer.VERSION, "state": self.dims_state, "policy": self.dims_policy}, file)
+            self.log.info("Replay buffer have been created at {0}".format(path))
+        with open(meta_path) as file:
+            meta = json.load(file)
+        if meta["version"] != ReplayBuffer.VERSION or tuple(meta["state"]) != self.dims_state or \
+                tuple(meta["policy"]) != self.dims_policy:
+            raise ValueError("Replay buffer at {0} does not match the dimensions of the problem".format(path))
+
+        # index is the commit record, samples behind its last game are overwritten
+        self.index_path = os.path.join(path, "index.bin")
+        if os.path.isfile(self.index_path):
+            with open(self.index_path, "rb") as file:
+                data = file.read()
+            n_games = len(data) // ReplayBuffer.INDEX_DTYPE.itemsize  # drop an incomplete last entry
+            self.index = np.frombuffer(data[:n_games * ReplayBuffer.INDEX_DTYPE.itemsize],
+                                       dtype=ReplayBuffer.INDEX_DTYPE).copy()
+        else:
+            self.index = np.zeros(0, dtype=ReplayBuffer.INDEX_DTYPE)
+        self.n_states = int(self.index["start"][-1] + self.index["count"][-1]) if len(self.index) else 0
+        if len(self.index):
+            self.iteration = int(self.index["iteration"][-1])
+
+        self.capacity = max(ReplayBuffer.MIN_CAPACITY, self.n_states)
+        self._map()
+
+    def _map_file(self, name, dims):
+        path = os.path.join(self.path, name)
+        size = self.capacity * int(np.prod(dims)) * 4
+        with open(path, "ab") as file:
+            if file.tell() < size:
+                file.truncate(size)
+        return np.memmap(path, dtype=np.float32, mode="r+", shape=(self.capacity,) + dims)
+
+    def _map(self):
+        self.state = self._map_file("state.f32", self.dims_state)
+        self.policy = self._map_file("policy.f32", self.dims_policy)
+        self.value = self._map_file("value.f32", (1,))
+
+    def set_iteration(self, iteration):
+        """Games stored after the call belong to iteration, which moves the sliding window"""
+        self.iteration = iteration
+
+    def store(self, game_idx, data_state, data_policy, data_result):
+        """Stores the simulated data of one self-play game"""
+        if len(data_state) != len(data_policy) or len(data_state) != len(data_result):
+            self.log.error("Error with result size")
+            exit(-1)
+
+        count = len(data_state)
+        with self.lock:
+            start = self.n_states
+            if start + count > self.capacity:
+                del self.state, self.policy, self.value  # unmap before growing
+                self.capacity = max(2 * self.capacity, start + count)
+                self._map()
+            self.state[start:start + count] = data_state
+            self.policy[start:start + count] = data_policy
+            self.value[start:start + count, 0] = data_result
+            self.state.flush()
+            self.policy.flush()
+            self.value.flush()
+
+            entry = np.zeros(1, dtype=ReplayBuffer.INDEX_DTYPE)
+            entry["game"] = game_idx
+            entry["iteration"] = self.iteration
+            entry["start"] = start
+            entry["count"] = count
+            with open(self.index_path, "ab") as file:
+                file.write(entry.tobytes())
+            self.index = np.concatenate((self.index, entry))
+            self.n_states = start + count
+
+    def _window_start(self):
+        """First sample of the games of the last window iterations"""
+        if self.window <= 0 or len(self.index) == 0:
+            return 0
+        recent = self.index["iteration"] + self.window > self.iteration
+        if not recent.any():
+            return self.n_states
+        return int(self.index["start"][np.argmax(recent)])  # games are stored in order of iterations
+
+    def load(self, count):
+        """
+        Returns maximum 'count' number of samples from self-play games.
+        The function selects random samples from the games of the sliding window, with replacement.
+        If the window has less samples then 'count', all of its samples are returned.
+
+        :return: state: Input state tensors
+        :return: policy: Output policy tensor
+        :return: value: Output value array
+        """
+        with self.lock:
+            lo = self._window_start()
+            hi = self.n_states
+            if hi - lo <= count:
+                idx = np.arange(lo, hi)
+            else:
+                idx = np.sort(np.random.randint(lo, hi, count))  # sorted reads of the mapped pages
+            return np.array(self.state[idx]), np.array(self.policy[idx]), np.array(self.value[idx])
+
+    def get_game_count(self):
+        """
+        Get the number of executed self-play games.
+        note: Sequential storage in database is not guaranteed.
+        """
+        if len(self.index) == 0:
+            return 0
+        return int(np.max(self.index["game"]))
+
+    def get_state_count(self):
+        """Get number of stored states (training samples)"""
+        return self.n_states
+
+    def get_games(self, iteration):
+        """Index entries (game, iteration, start, count) of the games of iteration"""
+        return self.index[self.index["iteration"] == iteration]
+
+    def import_database(self, database):
+        """Appends the samples of an HDF5 Database, games are split by game index"""
+        game_idx = np.array(database.datafile["game_idx"][:, 0])
+        bounds = np.flatnonzero(np.diff(game_idx)) + 1
+        for lo, hi in zip(np.concatenate(([0], bounds)), np.concatenate((bounds, [len(game_idx)]))):
+            self.store(int(game_idx[lo]), database.datafile["state"][lo:hi], database.datafile["policy"][lo:hi],
+                       database.datafile["value"][lo:hi, 0])